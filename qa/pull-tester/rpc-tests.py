@@ -120,6 +120,7 @@ testScripts = [
     'disablewallet.py',
     'sendheaders.py', # NOTE: needs onex_hash to pass
     'keypool.py',
+    'importrescan.py',
     'prioritise_transaction.py',
     'invalidblockrequest.py', # NOTE: needs onex_hash to pass
     'invalidtxrequest.py', # NOTE: needs onex_hash to pass
@@ -149,6 +150,7 @@ testScriptsExt = [
     'p2p-acceptblock.py', # NOTE: needs onex_hash to pass
     'mempool_packages.py',
     'maxuploadtarget.py',
+    'instantsend_latency.py',
     # 'replace-by-fee.py', # RBF is disabled in Onex Core
 ]
 
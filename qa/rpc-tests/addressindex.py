@@ -24,7 +24,7 @@ class AddressIndexTest(BitcoinTestFramework):
         self.nodes = []
         # Nodes 0/1 are "wallet" nodes
         self.nodes.append(start_node(0, self.options.tmpdir, ["-debug", "-relaypriority=0"]))
-        self.nodes.append(start_node(1, self.options.tmpdir, ["-debug", "-addressindex"]))
+        self.nodes.append(start_node(1, self.options.tmpdir, ["-debug", "-addressindex", "-addressbalanceindex"]))
         # Nodes 2/3 are used for testing
         self.nodes.append(start_node(2, self.options.tmpdir, ["-debug", "-addressindex", "-relaypriority=0"]))
         self.nodes.append(start_node(3, self.options.tmpdir, ["-debug", "-addressindex"]))
@@ -169,6 +169,13 @@ class AddressIndexTest(BitcoinTestFramework):
 
         balance2 = self.nodes[1].getaddressbalance(address2)
         assert_equal(balance2["balance"], change_amount)
+        assert_equal(balance2["txcount"], 2)
+        assert_equal(balance2["height"], self.nodes[1].getblockcount())
+
+        # The balance index agrees with summing the address index
+        balance2_full = self.nodes[3].getaddressbalance(address2)
+        assert_equal(balance2_full["balance"], balance2["balance"])
+        assert_equal(balance2_full["received"], balance2["received"])
 
         # Check that deltas are returned correctly
         deltas = self.nodes[1].getaddressdeltas({"addresses": [address2], "start": 0, "end": 200})
@@ -183,7 +190,25 @@ class AddressIndexTest(BitcoinTestFramework):
         deltasAll = self.nodes[1].getaddressdeltas({"addresses": [address2]})
         assert_equal(len(deltasAll), len(deltas))
 
-        # Check that deltas can be returned from range of block heights
+        # Check that deltas can be paged through with a cursor
+        paged = []
+        page = self.nodes[1].getaddressdeltas({"addresses": [address2], "limit": 1})
+        while True:
+            assert(len(page["deltas"]) <= 1)
+            paged += page["deltas"]
+            if "cursor" not in page:
+                break
+            page = self.nodes[1].getaddressdeltas({"addresses": [address2], "limit": 1, "cursor": page["cursor"]})
+        assert_equal(paged, deltasAll)
+
+        # A page of txids ends after all entries of its last tx
+        txids_all = self.nodes[1].getaddresstxids(address2)
+        page = self.nodes[1].getaddresstxids({"addresses": [address2], "limit": 1})
+        assert_equal(page["txids"], txids_all[:1])
+        page = self.nodes[1].getaddresstxids({"addresses": [address2], "limit": 10, "cursor": page["cursor"]})
+        assert_equal(page["txids"], txids_all[1:])
+        assert("cursor" not in page)
+
         deltas = self.nodes[1].getaddressdeltas({"addresses": [address2], "start": 113, "end": 113})
         assert_equal(len(deltas), 1)
 
@@ -207,6 +232,9 @@ class AddressIndexTest(BitcoinTestFramework):
 
         balance4 = self.nodes[1].getaddressbalance(address2)
         assert_equal(balance4, balance1)
+        balance4_full = self.nodes[3].getaddressbalance(address2)
+        assert_equal(balance4_full["balance"], balance4["balance"])
+        assert_equal(balance4_full["received"], balance4["received"])
 
         utxos2 = self.nodes[1].getaddressutxos({"addresses": [address2]})
         assert_equal(len(utxos2), 1)
@@ -271,6 +299,9 @@ class AddressIndexTest(BitcoinTestFramework):
         assert_equal(mempool[2]["txid"], memtxid2)
         assert_equal(mempool[2]["index"], 1)
 
+        mempool_balance = self.nodes[2].getaddressbalance({"addresses": [address3], "mempool": True})
+        assert_equal(mempool_balance["unconfirmed_balance"], sum(delta["satoshis"] for delta in mempool))
+
         self.nodes[2].generate(1);
         self.sync_all();
         mempool2 = self.nodes[2].getaddressmempool({"addresses": [address3]})
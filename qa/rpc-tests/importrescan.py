@@ -0,0 +1,96 @@
+#!/usr/bin/env python2
+# Copyright (c) 2014-2017 The Onex Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Check that the node keeps answering other calls while an import rescans
+# the chain, that a second rescan is refused meanwhile, and that the
+# imported key sees its coins afterwards
+#
+
+import threading
+import time
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+
+class ImportRescanTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self):
+        self.nodes = start_nodes(2, self.options.tmpdir)
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.is_network_split = False
+        self.sync_all()
+
+    def import_in_background(self, privkey):
+        errors = []
+
+        def run():
+            # the import gets its own connection, the test keeps using nodes[1]
+            node = get_rpc_proxy(self.nodes[1].url, 1, timeout=600)
+            try:
+                node.importprivkey(privkey)
+            except Exception as e:
+                errors.append(e)
+
+        thread = threading.Thread(target=run)
+        thread.start()
+        return thread, errors
+
+    def import_refused(self, privkey):
+        # an import which rescans fails while another rescan is running
+        try:
+            self.nodes[1].importprivkey(privkey, "", True)
+        except JSONRPCException as e:
+            assert_equal(e.error["code"], -4)
+            return True
+        return False
+
+    def run_test(self):
+        print "Mining blocks..."
+        self.nodes[0].generate(101)
+        address = self.nodes[0].getnewaddress()
+        funded = address
+        self.nodes[0].sendtoaddress(funded, 10)
+        self.nodes[0].generate(1)
+        for i in range(10):
+            self.nodes[0].generate(100)
+        self.sync_all()
+        height = self.nodes[1].getblockcount()
+
+        # a short chain scans quickly, import further keys until a call
+        # that takes cs_main got answered and a second import got refused
+        # while a rescan was running
+        other = self.nodes[0].dumpprivkey(self.nodes[0].getnewaddress())
+        answered = False
+        refused = False
+        for attempt in range(10):
+            if attempt > 0:
+                address = self.nodes[0].getnewaddress()
+            thread, errors = self.import_in_background(self.nodes[0].dumpprivkey(address))
+            while thread.is_alive() and not (answered and refused):
+                if self.nodes[1].getrescaninfo()["scanning"]:
+                    assert_equal(self.nodes[1].getblockcount(), height)
+                    if self.nodes[1].getrescaninfo()["scanning"]:
+                        answered = True
+                    if not refused:
+                        refused = self.import_refused(other)
+                time.sleep(0.01)
+            thread.join()
+            assert_equal(errors, [])
+            if answered and refused:
+                break
+        assert(answered)
+        assert(refused)
+
+        info = self.nodes[1].getrescaninfo()
+        assert(not info["scanning"])
+        assert_equal(info["tip_height"], height)
+        assert_equal(self.nodes[1].getreceivedbyaddress(funded), 10)
+
+if __name__ == '__main__':
+    ImportRescanTest().main()
@@ -0,0 +1,157 @@
+#!/usr/bin/env python2
+# Copyright (c) 2014-2017 The Onex Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Drive concurrent InstantSend lock requests against a local network of
+# masternodes and report the lock latency percentiles from getinstantsendstats
+#
+# Usage: instantsend_latency.py [--masternodes=N] [--requests=N] [--senders=N]
+#
+
+import os
+import threading
+import time
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+
+MASTERNODE_COLLATERAL = 5000
+STAGES = ["vote_created", "vote_received", "quorum", "locked"]
+
+class InstantSendLatencyTest(BitcoinTestFramework):
+
+    def add_options(self, parser):
+        parser.add_option("--masternodes", dest="masternodes", default=10, type="int",
+                          help="Number of masternode nodes to start")
+        parser.add_option("--requests", dest="requests", default=100, type="int",
+                          help="Number of lock requests to send")
+        parser.add_option("--senders", dest="senders", default=4, type="int",
+                          help="Number of threads sending lock requests")
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        self.num_masternodes = self.options.masternodes
+        # node 0 mines and sends, the rest are masternodes
+        initialize_chain_clean(self.options.tmpdir, self.num_masternodes + 1)
+
+    def setup_network(self):
+        self.nodes = []
+        self.nodes.append(start_node(0, self.options.tmpdir, ["-debug=instantsend"]))
+
+        print "Funding masternode collaterals..."
+        self.nodes[0].generate(100 + self.num_masternodes)
+        self.mnkeys = []
+        conf_lines = []
+        for i in range(self.num_masternodes):
+            key = self.nodes[0].masternode("genkey")
+            address = self.nodes[0].getnewaddress()
+            txid = self.nodes[0].sendtoaddress(address, MASTERNODE_COLLATERAL)
+            vout = find_output(self.nodes[0], txid, MASTERNODE_COLLATERAL)
+            conf_lines.append("mn%d 127.0.0.1:%d %s %s %d" % (i + 1, p2p_port(i + 1), key, txid, vout))
+            self.mnkeys.append(key)
+        self.nodes[0].generate(15)
+
+        stop_node(self.nodes[0], 0)
+        with open(os.path.join(self.options.tmpdir, "node0", "regtest", "masternode.conf"), 'w') as f:
+            f.write("\n".join(conf_lines) + "\n")
+        self.nodes[0] = start_node(0, self.options.tmpdir, ["-debug=instantsend"])
+
+        for i in range(self.num_masternodes):
+            self.nodes.append(start_node(i + 1, self.options.tmpdir,
+                                         ["-debug=instantsend", "-masternode=1", "-externalip=127.0.0.1",
+                                          "-masternodeprivkey=" + self.mnkeys[i]]))
+        for i in range(1, len(self.nodes)):
+            connect_nodes_bi(self.nodes, 0, i)
+            if i > 1:
+                connect_nodes(self.nodes[i], i - 1)
+
+        self.is_network_split = False
+        self.sync_all()
+
+    def start_masternodes(self):
+        print "Waiting for masternode sync..."
+        for node in self.nodes:
+            while not get_mnsync_status(node):
+                node.mnsync("next")
+                time.sleep(0.5)
+
+        print "Starting masternodes..."
+        for i in range(self.num_masternodes):
+            result = self.nodes[0].masternode("start-alias", "mn%d" % (i + 1))
+            assert_equal(result["result"], "successful")
+
+        # wait for every node to see every masternode as enabled
+        deadline = time.time() + 120
+        while time.time() < deadline:
+            counts = [node.masternode("count", "enabled") for node in self.nodes]
+            if min(counts) >= self.num_masternodes:
+                return
+            time.sleep(1)
+        raise AssertionError("Masternodes did not become enabled")
+
+    def prepare_inputs(self):
+        # InstantSend needs confirmed inputs, give each request its own
+        print "Preparing %d inputs..." % self.options.requests
+        address = self.nodes[0].getnewaddress()
+        for i in range(self.options.requests):
+            self.nodes[0].sendtoaddress(address, 1)
+        self.nodes[0].generate(6)
+        self.sync_all()
+
+    def send_requests(self):
+        print "Sending %d lock requests from %d threads..." % (self.options.requests, self.options.senders)
+        per_sender = self.options.requests // self.options.senders
+        errors = []
+
+        def sender(n):
+            # every thread uses its own connection
+            node = get_rpc_proxy(self.nodes[0].url, 0)
+            address = node.getnewaddress()
+            for i in range(per_sender):
+                try:
+                    node.instantsendtoaddress(address, 0.1)
+                except JSONRPCException as e:
+                    errors.append(e.error["message"])
+
+        threads = [threading.Thread(target=sender, args=(n,)) for n in range(self.options.senders)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        if errors:
+            print "%d requests failed, first error: %s" % (len(errors), errors[0])
+        return per_sender * self.options.senders - len(errors)
+
+    def report(self, sent):
+        # wait until the sender has seen every lock complete or time out
+        deadline = time.time() + 60
+        stats = self.nodes[0].getinstantsendstats()
+        while stats["locked"]["count"] < sent and time.time() < deadline:
+            time.sleep(1)
+            stats = self.nodes[0].getinstantsendstats()
+
+        print "Lock latency on the sending node (ms):"
+        print "%-14s %8s %8s %8s %8s %8s" % ("stage", "count", "avg", "p50", "p99", "max")
+        for stage in STAGES:
+            s = stats[stage]
+            print "%-14s %8d %8d %8d %8d %8d" % (stage, s["count"], s["avg"], s["p50"], s["p99"], s["max"])
+
+        votes = 0
+        for node in self.nodes[1:]:
+            votes += node.getinstantsendstats()["vote_created"]["count"]
+        print "Votes created by masternodes: %d" % votes
+
+        assert_equal(stats["locked"]["count"], sent)
+
+    def run_test(self):
+        self.start_masternodes()
+        self.prepare_inputs()
+        # measure this run only
+        for node in self.nodes:
+            node.getinstantsendstats(True)
+        sent = self.send_requests()
+        self.report(sent)
+
+if __name__ == '__main__':
+    InstantSendLatencyTest().main()
@@ -43,6 +43,7 @@ namespace benchmark {
         double lastTime, minTime, maxTime;
         int64_t count;
         int64_t timeCheckCount;
+        std::string label;
     public:
         State(std::string _name, double _maxElapsed) : name(_name), maxElapsed(_maxElapsed), count(0) {
             minTime = std::numeric_limits<double>::max();
@@ -50,6 +51,8 @@ namespace benchmark {
             timeCheckCount = 1;
         }
         bool KeepRunning();
+        // Extra text reported with the timings, e.g. a memory figure
+        void SetLabel(const std::string& _label) { label = _label; }
     };
 
     typedef boost::function<void(State&)> BenchFunction;
@@ -0,0 +1,47 @@
+// Copyright (c) 2014-2017 The Onex Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "consensus/merkle.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "random.h"
+
+#include <vector>
+
+// Double SHA-256 of a whole level of 1024 pairs of hashes
+static void SHA256D64_1024(benchmark::State& state)
+{
+    std::vector<unsigned char> in(64 * 1024, 8);
+    while (state.KeepRunning()) {
+        SHA256D64(&in[0], &in[0], 1024);
+    }
+}
+
+// The same level hashed one pair at a time
+static void CHash256_1024(benchmark::State& state)
+{
+    std::vector<unsigned char> in(64 * 1024, 8);
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1024; i++)
+            CHash256().Write(&in[64 * i], 64).Finalize(&in[32 * i]);
+    }
+}
+
+static void MerkleRoot(benchmark::State& state)
+{
+    std::vector<uint256> leaves(9001);
+    for (size_t i = 0; i < leaves.size(); i++)
+        leaves[i] = GetRandHash();
+    while (state.KeepRunning()) {
+        bool fMutated = false;
+        uint256 root = ComputeMerkleRoot(leaves, &fMutated);
+        leaves[0] = root;
+    }
+}
+
+BENCHMARK(SHA256D64_1024);
+BENCHMARK(CHash256_1024);
+BENCHMARK(MerkleRoot);
@@ -0,0 +1,65 @@
+// Copyright (c) 2014-2017 The Onex Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "arith_uint256.h"
+#include "governance-votedb.h"
+#include "tinyformat.h"
+
+static const int BENCH_VOTE_COUNT = 5000;
+
+static void CreateVotes(std::vector<CGovernanceVote>& vecVotes)
+{
+    for(int i = 0; i < BENCH_VOTE_COUNT; ++i) {
+        CTxIn vinMasternode(COutPoint(ArithToUint256(arith_uint256(i)), 1));
+        CGovernanceVote vote(vinMasternode, uint256(), VOTE_SIGNAL_FUNDING, VOTE_OUTCOME_YES);
+        vote.SetSignature(std::vector<unsigned char>(65, (unsigned char)i));
+        vecVotes.push_back(vote);
+    }
+}
+
+// Add BENCH_VOTE_COUNT votes to an empty vote file, the label reports the
+// memory used per vote by the filled file
+static void GovernanceVoteFileInsert(benchmark::State& state)
+{
+    std::vector<CGovernanceVote> vecVotes;
+    CreateVotes(vecVotes);
+    {
+        CGovernanceObjectVoteFile fileVotes;
+        for(size_t i = 0; i < vecVotes.size(); ++i) {
+            fileVotes.AddVote(vecVotes[i]);
+        }
+        state.SetLabel(strprintf("%u bytes per vote", fileVotes.GetMemoryUsage() / vecVotes.size()));
+    }
+    while (state.KeepRunning()) {
+        CGovernanceObjectVoteFile fileVotes;
+        for(size_t i = 0; i < vecVotes.size(); ++i) {
+            fileVotes.AddVote(vecVotes[i]);
+        }
+    }
+}
+
+// Look up BENCH_VOTE_COUNT present and BENCH_VOTE_COUNT absent vote hashes
+static void GovernanceVoteFileLookup(benchmark::State& state)
+{
+    std::vector<CGovernanceVote> vecVotes;
+    CreateVotes(vecVotes);
+    CGovernanceObjectVoteFile fileVotes;
+    std::vector<uint256> vecHashes;
+    for(size_t i = 0; i < vecVotes.size(); ++i) {
+        fileVotes.AddVote(vecVotes[i]);
+        vecHashes.push_back(vecVotes[i].GetHash());
+        vecHashes.push_back(vecVotes[i].GetTypeHash());
+    }
+    int nFound = 0;
+    while (state.KeepRunning()) {
+        for(size_t i = 0; i < vecHashes.size(); ++i) {
+            nFound += fileVotes.HasVote(vecHashes[i]);
+        }
+    }
+    assert(nFound >= 0);
+}
+
+BENCHMARK(GovernanceVoteFileInsert);
+BENCHMARK(GovernanceVoteFileLookup);
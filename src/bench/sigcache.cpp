@@ -0,0 +1,79 @@
+// Copyright (c) 2014-2017 The Onex Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "cuckoocache.h"
+#include "random.h"
+
+#include <boost/thread.hpp>
+
+static const size_t BENCH_CACHE_BYTES = 32 << 20;
+static const int BENCH_ENTRY_COUNT = 100000;
+
+static void CreateEntries(std::vector<uint256>& vecEntries, int nCount)
+{
+    for (int i = 0; i < nCount; ++i)
+        vecEntries.push_back(GetRandHash());
+}
+
+// Insert BENCH_ENTRY_COUNT new entries into an empty cache
+static void SigCacheInsert(benchmark::State& state)
+{
+    std::vector<uint256> vecEntries;
+    CreateEntries(vecEntries, BENCH_ENTRY_COUNT);
+    while (state.KeepRunning()) {
+        CCuckooCache cache(BENCH_CACHE_BYTES);
+        for (size_t i = 0; i < vecEntries.size(); ++i)
+            cache.Insert(vecEntries[i]);
+    }
+}
+
+// Look up BENCH_ENTRY_COUNT present and BENCH_ENTRY_COUNT absent entries
+static void SigCacheContains(benchmark::State& state)
+{
+    std::vector<uint256> vecPresent, vecAbsent;
+    CreateEntries(vecPresent, BENCH_ENTRY_COUNT);
+    CreateEntries(vecAbsent, BENCH_ENTRY_COUNT);
+    CCuckooCache cache(BENCH_CACHE_BYTES);
+    for (size_t i = 0; i < vecPresent.size(); ++i)
+        cache.Insert(vecPresent[i]);
+
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < vecPresent.size(); ++i) {
+            cache.Contains(vecPresent[i]);
+            cache.Contains(vecAbsent[i]);
+        }
+    }
+}
+
+static void LookupAll(const CCuckooCache* pcache, const std::vector<uint256>* pvecEntries)
+{
+    for (size_t i = 0; i < pvecEntries->size(); ++i)
+        pcache->Contains((*pvecEntries)[i]);
+}
+
+// Look up entries from 8 threads while a ninth keeps inserting
+static void SigCacheContainsParallel(benchmark::State& state)
+{
+    std::vector<uint256> vecPresent, vecNew;
+    CreateEntries(vecPresent, BENCH_ENTRY_COUNT);
+    CreateEntries(vecNew, BENCH_ENTRY_COUNT);
+    CCuckooCache cache(BENCH_CACHE_BYTES);
+    for (size_t i = 0; i < vecPresent.size(); ++i)
+        cache.Insert(vecPresent[i]);
+
+    size_t nNext = 0;
+    while (state.KeepRunning()) {
+        boost::thread_group threads;
+        for (int i = 0; i < 8; ++i)
+            threads.create_thread(boost::bind(&LookupAll, &cache, &vecPresent));
+        for (int i = 0; i < 1000; ++i)
+            cache.Insert(vecNew[nNext++ % vecNew.size()]);
+        threads.join_all();
+    }
+}
+
+BENCHMARK(SigCacheInsert);
+BENCHMARK(SigCacheContains);
+BENCHMARK(SigCacheContainsParallel);
@@ -5,11 +5,16 @@
 #ifndef CACHEMAP_H_
 #define CACHEMAP_H_
 
-#include <map>
-#include <list>
+#include <iterator>
+#include <vector>
 #include <cstddef>
 
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "random.h"
 #include "serialize.h"
+#include "uint256.h"
 
 /**
  * Serializable structure for key/value items
@@ -38,11 +43,202 @@ struct CacheItem
     }
 };
 
+/**
+ * Hash functor used to index cache keys
+ *
+ * The keys come from peers, so hashes are salted per cache to keep them
+ * from forcing collisions. Caches with other key types can take their own
+ * hasher, e.g. COutPointKeyHasher.
+ */
+template<typename K>
+struct CacheKeyHasher : public boost::hash<K>
+{};
+
+template<>
+class CacheKeyHasher<uint256>
+{
+private:
+    uint256 salt;
+
+public:
+    CacheKeyHasher() : salt(GetRandHash()) {}
+
+    size_t operator()(const uint256& key) const
+    {
+        return key.GetHash(salt);
+    }
+};
+
+/**
+ * Doubly linked list of items stored in a pool of nodes
+ *
+ * Nodes live in a single vector and refer to each other by position,
+ * positions of freed nodes are reused by later inserts. A node position
+ * stays valid until the node is freed, so it can be used as a handle.
+ */
+template<typename T>
+class CacheItemPool
+{
+public:
+    static const uint32_t NONE = 0xffffffff;
+
+private:
+    struct node_t
+    {
+        T item;
+        uint32_t nPrev;
+        uint32_t nNext;
+    };
+
+    std::vector<node_t> vecNodes;
+
+    uint32_t nHead;
+
+    uint32_t nTail;
+
+    uint32_t nFree;
+
+public:
+    /**
+     * Iterates the items in list order without copying them. Freeing
+     * other nodes than the current one keeps the iterator valid.
+     */
+    class const_iterator : public std::iterator<std::forward_iterator_tag, T>
+    {
+    private:
+        const CacheItemPool* pool;
+        uint32_t nPos;
+
+    public:
+        const_iterator(const CacheItemPool* poolIn, uint32_t nPosIn) : pool(poolIn), nPos(nPosIn) {}
+
+        const T& operator*() const { return pool->Get(nPos); }
+        const T* operator->() const { return &pool->Get(nPos); }
+        const_iterator& operator++() { nPos = pool->Next(nPos); return *this; }
+        const_iterator operator++(int) { const_iterator prev = *this; nPos = pool->Next(nPos); return prev; }
+        bool operator==(const const_iterator& other) const { return nPos == other.nPos; }
+        bool operator!=(const const_iterator& other) const { return nPos != other.nPos; }
+    };
+
+    CacheItemPool()
+        : vecNodes(),
+          nHead(NONE),
+          nTail(NONE),
+          nFree(NONE)
+    {}
+
+    void Clear()
+    {
+        vecNodes.clear();
+        nHead = nTail = nFree = NONE;
+    }
+
+    uint32_t Front() const {
+        return nHead;
+    }
+
+    uint32_t Back() const {
+        return nTail;
+    }
+
+    uint32_t Next(uint32_t nPos) const {
+        return vecNodes[nPos].nNext;
+    }
+
+    T& Get(uint32_t nPos) {
+        return vecNodes[nPos].item;
+    }
+
+    const T& Get(uint32_t nPos) const {
+        return vecNodes[nPos].item;
+    }
+
+    uint32_t PushFront(const T& item)
+    {
+        uint32_t nPos = Allocate(item);
+        vecNodes[nPos].nPrev = NONE;
+        vecNodes[nPos].nNext = nHead;
+        if(nHead != NONE) {
+            vecNodes[nHead].nPrev = nPos;
+        }
+        nHead = nPos;
+        if(nTail == NONE) {
+            nTail = nPos;
+        }
+        return nPos;
+    }
+
+    uint32_t PushBack(const T& item)
+    {
+        uint32_t nPos = Allocate(item);
+        vecNodes[nPos].nPrev = nTail;
+        vecNodes[nPos].nNext = NONE;
+        if(nTail != NONE) {
+            vecNodes[nTail].nNext = nPos;
+        }
+        nTail = nPos;
+        if(nHead == NONE) {
+            nHead = nPos;
+        }
+        return nPos;
+    }
+
+    void Free(uint32_t nPos)
+    {
+        node_t& node = vecNodes[nPos];
+        if(node.nPrev != NONE) {
+            vecNodes[node.nPrev].nNext = node.nNext;
+        }
+        else {
+            nHead = node.nNext;
+        }
+        if(node.nNext != NONE) {
+            vecNodes[node.nNext].nPrev = node.nPrev;
+        }
+        else {
+            nTail = node.nPrev;
+        }
+        // Release whatever the item owns now rather than on reuse
+        node.item = T();
+        node.nPrev = NONE;
+        node.nNext = nFree;
+        nFree = nPos;
+    }
+
+    const_iterator begin() const {
+        return const_iterator(this, nHead);
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, NONE);
+    }
+
+private:
+    uint32_t Allocate(const T& item)
+    {
+        if(nFree == NONE) {
+            node_t node;
+            node.item = item;
+            vecNodes.push_back(node);
+            return vecNodes.size() - 1;
+        }
+        uint32_t nPos = nFree;
+        nFree = vecNodes[nPos].nNext;
+        vecNodes[nPos].item = item;
+        return nPos;
+    }
+};
+
+template<typename T>
+const uint32_t CacheItemPool<T>::NONE;
 
 /**
  * Map like container that keeps the N most recently added items
+ *
+ * Items are kept in a pooled linked list, most recently added first,
+ * and indexed by a hash table of key to node position.
  */
-template<typename K, typename V, typename Size = uint32_t>
+template<typename K, typename V, typename Size = uint32_t, typename Hasher = CacheKeyHasher<K> >
 class CacheMap
 {
 public:
@@ -50,13 +246,13 @@ public:
 
     typedef CacheItem<K,V> item_t;
 
-    typedef std::list<item_t> list_t;
+    typedef CacheItemPool<item_t> pool_t;
 
-    typedef typename list_t::iterator list_it;
+    typedef pool_t list_t;
 
-    typedef typename list_t::const_iterator list_cit;
+    typedef typename pool_t::const_iterator list_cit;
 
-    typedef std::map<K, list_it> map_t;
+    typedef boost::unordered_map<K, uint32_t, Hasher> map_t;
 
     typedef typename map_t::iterator map_it;
 
@@ -67,7 +263,7 @@ private:
 
     size_type nCurrentSize;
 
-    list_t listItems;
+    pool_t poolItems;
 
     map_t mapIndex;
 
@@ -75,23 +271,21 @@ public:
     CacheMap(size_type nMaxSizeIn = 0)
         : nMaxSize(nMaxSizeIn),
           nCurrentSize(0),
-          listItems(),
+          poolItems(),
           mapIndex()
     {}
 
-    CacheMap(const CacheMap<K,V>& other)
+    CacheMap(const CacheMap& other)
         : nMaxSize(other.nMaxSize),
           nCurrentSize(other.nCurrentSize),
-          listItems(other.listItems),
-          mapIndex()
-    {
-        RebuildIndex();
-    }
+          poolItems(other.poolItems),
+          mapIndex(other.mapIndex)
+    {}
 
     void Clear()
     {
         mapIndex.clear();
-        listItems.clear();
+        poolItems.Clear();
         nCurrentSize = 0;
     }
 
@@ -112,15 +306,14 @@ public:
     {
         map_it it = mapIndex.find(key);
         if(it != mapIndex.end()) {
-            item_t& item = *(it->second);
+            item_t& item = poolItems.Get(it->second);
             item.value = value;
             return;
         }
         if(nCurrentSize == nMaxSize) {
             PruneLast();
         }
-        listItems.push_front(item_t(key, value));
-        mapIndex[key] = listItems.begin();
+        mapIndex.insert(std::make_pair(key, poolItems.PushFront(item_t(key, value))));
         ++nCurrentSize;
     }
 
@@ -136,7 +329,7 @@ public:
         if(it == mapIndex.end()) {
             return false;
         }
-        item_t& item = *(it->second);
+        const item_t& item = poolItems.Get(it->second);
         value = item.value;
         return true;
     }
@@ -147,34 +340,68 @@ public:
         if(it == mapIndex.end()) {
             return;
         }
-        listItems.erase(it->second);
+        poolItems.Free(it->second);
         mapIndex.erase(it);
         --nCurrentSize;
     }
 
+    /**
+     * Items, most recently added first
+     */
     const list_t& GetItemList() const {
-        return listItems;
+        return poolItems;
     }
 
-    CacheMap<K,V>& operator=(const CacheMap<K,V>& other)
+    CacheMap& operator=(const CacheMap& other)
     {
         nMaxSize = other.nMaxSize;
         nCurrentSize = other.nCurrentSize;
-        listItems = other.listItems;
-        RebuildIndex();
+        poolItems = other.poolItems;
+        mapIndex = other.mapIndex;
         return *this;
     }
 
-    ADD_SERIALIZE_METHODS;
+    // Serialized as max size, current size and a list of items (most recent
+    // first), the same format as earlier std::list based versions.
 
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        unsigned int nSize = ::GetSerializeSize(nMaxSize, nType, nVersion);
+        nSize += ::GetSerializeSize(nCurrentSize, nType, nVersion);
+        nSize += GetSizeOfCompactSize(nCurrentSize);
+        for(uint32_t nPos = poolItems.Front(); nPos != pool_t::NONE; nPos = poolItems.Next(nPos)) {
+            nSize += ::GetSerializeSize(poolItems.Get(nPos), nType, nVersion);
+        }
+        return nSize;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, nMaxSize, nType, nVersion);
+        ::Serialize(s, nCurrentSize, nType, nVersion);
+        WriteCompactSize(s, nCurrentSize);
+        for(uint32_t nPos = poolItems.Front(); nPos != pool_t::NONE; nPos = poolItems.Next(nPos)) {
+            ::Serialize(s, poolItems.Get(nPos), nType, nVersion);
+        }
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
     {
-        READWRITE(nMaxSize);
-        READWRITE(nCurrentSize);
-        READWRITE(listItems);
-        if(ser_action.ForRead()) {
-            RebuildIndex();
+        Clear();
+        size_type nSize = 0;
+        ::Unserialize(s, nMaxSize, nType, nVersion);
+        ::Unserialize(s, nSize, nType, nVersion);
+        unsigned int nItems = ReadCompactSize(s);
+        for(unsigned int i = 0; i < nItems; ++i) {
+            item_t item;
+            ::Unserialize(s, item, nType, nVersion);
+            if(mapIndex.count(item.key) > 0) {
+                continue;
+            }
+            mapIndex.insert(std::make_pair(item.key, poolItems.PushBack(item)));
+            ++nCurrentSize;
         }
     }
 
@@ -184,19 +411,11 @@ private:
         if(nCurrentSize < 1) {
             return;
         }
-        item_t& item = listItems.back();
-        mapIndex.erase(item.key);
-        listItems.pop_back();
+        uint32_t nPos = poolItems.Back();
+        mapIndex.erase(poolItems.Get(nPos).key);
+        poolItems.Free(nPos);
         --nCurrentSize;
     }
-
-    void RebuildIndex()
-    {
-        mapIndex.clear();
-        for(list_it it = listItems.begin(); it != listItems.end(); ++it) {
-            mapIndex[it->key] = it;
-        }
-    }
 };
 
 #endif /* CACHEMAP_H_ */
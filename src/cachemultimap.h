@@ -5,10 +5,9 @@
 #ifndef CACHEMULTIMAP_H_
 #define CACHEMULTIMAP_H_
 
+#include <algorithm>
 #include <cstddef>
-#include <map>
-#include <list>
-#include <set>
+#include <vector>
 
 #include "serialize.h"
 
@@ -16,8 +15,12 @@
 
 /**
  * Map like container that keeps the N most recently added items
+ *
+ * Items are kept in a pooled linked list, most recently added first.
+ * A hash table maps each key to the node positions of its items,
+ * ordered by value so that duplicate values are detected cheaply.
  */
-template<typename K, typename V, typename Size = uint32_t>
+template<typename K, typename V, typename Size = uint32_t, typename Hasher = CacheKeyHasher<K> >
 class CacheMultiMap
 {
 public:
@@ -25,19 +28,19 @@ public:
 
     typedef CacheItem<K,V> item_t;
 
-    typedef std::list<item_t> list_t;
+    typedef CacheItemPool<item_t> pool_t;
 
-    typedef typename list_t::iterator list_it;
+    typedef pool_t list_t;
 
-    typedef typename list_t::const_iterator list_cit;
+    typedef typename pool_t::const_iterator list_cit;
 
-    typedef std::map<V,list_it> it_map_t;
+    typedef std::vector<uint32_t> pos_v_t;
 
-    typedef typename it_map_t::iterator it_map_it;
+    typedef typename pos_v_t::iterator pos_v_it;
 
-    typedef typename it_map_t::const_iterator it_map_cit;
+    typedef typename pos_v_t::const_iterator pos_v_cit;
 
-    typedef std::map<K, it_map_t> map_t;
+    typedef boost::unordered_map<K, pos_v_t, Hasher> map_t;
 
     typedef typename map_t::iterator map_it;
 
@@ -48,7 +51,7 @@ private:
 
     size_type nCurrentSize;
 
-    list_t listItems;
+    pool_t poolItems;
 
     map_t mapIndex;
 
@@ -56,23 +59,21 @@ public:
     CacheMultiMap(size_type nMaxSizeIn = 0)
         : nMaxSize(nMaxSizeIn),
           nCurrentSize(0),
-          listItems(),
+          poolItems(),
           mapIndex()
     {}
 
-    CacheMultiMap(const CacheMap<K,V>& other)
+    CacheMultiMap(const CacheMultiMap& other)
         : nMaxSize(other.nMaxSize),
           nCurrentSize(other.nCurrentSize),
-          listItems(other.listItems),
-          mapIndex()
-    {
-        RebuildIndex();
-    }
+          poolItems(other.poolItems),
+          mapIndex(other.mapIndex)
+    {}
 
     void Clear()
     {
         mapIndex.clear();
-        listItems.clear();
+        poolItems.Clear();
         nCurrentSize = 0;
     }
 
@@ -96,19 +97,17 @@ public:
         }
         map_it mit = mapIndex.find(key);
         if(mit == mapIndex.end()) {
-            mit = mapIndex.insert(std::pair<K,it_map_t>(key, it_map_t())).first;
+            mit = mapIndex.insert(std::pair<K,pos_v_t>(key, pos_v_t())).first;
         }
-        it_map_t& mapIt = mit->second;
+        pos_v_t& vecPos = mit->second;
 
-        if(mapIt.count(value) > 0) {
+        pos_v_it it = LowerBound(vecPos, value);
+        if(it != vecPos.end() && !(value < poolItems.Get(*it).value)) {
             // Don't insert duplicates
             return false;
         }
 
-        listItems.push_front(item_t(key, value));
-        list_it lit = listItems.begin();
-
-        mapIt[value] = lit;
+        vecPos.insert(it, poolItems.PushFront(item_t(key, value)));
         ++nCurrentSize;
         return true;
     }
@@ -125,8 +124,8 @@ public:
         if(it == mapIndex.end()) {
             return false;
         }
-        const it_map_t& mapIt = it->second;
-        const item_t& item = *(mapIt.begin()->second);
+        const pos_v_t& vecPos = it->second;
+        const item_t& item = poolItems.Get(vecPos.front());
         value = item.value;
         return true;
     }
@@ -137,10 +136,10 @@ public:
         if(mit == mapIndex.end()) {
             return false;
         }
-        const it_map_t& mapIt = mit->second;
+        const pos_v_t& vecPos = mit->second;
 
-        for(it_map_cit it = mapIt.begin(); it != mapIt.end(); ++it) {
-            const item_t& item = *(it->second);
+        for(pos_v_cit it = vecPos.begin(); it != vecPos.end(); ++it) {
+            const item_t& item = poolItems.Get(*it);
             vecValues.push_back(item.value);
         }
         return true;
@@ -159,10 +158,10 @@ public:
         if(mit == mapIndex.end()) {
             return;
         }
-        it_map_t& mapIt = mit->second;
+        pos_v_t& vecPos = mit->second;
 
-        for(it_map_it it = mapIt.begin(); it != mapIt.end(); ++it) {
-            listItems.erase(it->second);
+        for(pos_v_it it = vecPos.begin(); it != vecPos.end(); ++it) {
+            poolItems.Free(*it);
             --nCurrentSize;
         }
 
@@ -175,88 +174,129 @@ public:
         if(mit == mapIndex.end()) {
             return;
         }
-        it_map_t& mapIt = mit->second;
+        pos_v_t& vecPos = mit->second;
 
-        it_map_it it = mapIt.find(value);
-        if(it == mapIt.end()) {
+        pos_v_it it = LowerBound(vecPos, value);
+        if(it == vecPos.end() || value < poolItems.Get(*it).value) {
             return;
         }
 
-        listItems.erase(it->second);
+        poolItems.Free(*it);
         --nCurrentSize;
-        mapIt.erase(it);
+        vecPos.erase(it);
 
-        if(mapIt.size() < 1) {
+        if(vecPos.size() < 1) {
             mapIndex.erase(mit);
         }
     }
 
+    /**
+     * Items, most recently added first
+     */
     const list_t& GetItemList() const {
-        return listItems;
+        return poolItems;
     }
 
-    CacheMap<K,V>& operator=(const CacheMap<K,V>& other)
+    CacheMultiMap& operator=(const CacheMultiMap& other)
     {
         nMaxSize = other.nMaxSize;
         nCurrentSize = other.nCurrentSize;
-        listItems = other.listItems;
-        RebuildIndex();
+        poolItems = other.poolItems;
+        mapIndex = other.mapIndex;
         return *this;
     }
 
-    ADD_SERIALIZE_METHODS;
+    // Serialized as max size, current size and a list of items (most recent
+    // first), the same format as earlier std::list based versions.
 
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    unsigned int GetSerializeSize(int nType, int nVersion) const
     {
-        READWRITE(nMaxSize);
-        READWRITE(nCurrentSize);
-        READWRITE(listItems);
-        if(ser_action.ForRead()) {
-            RebuildIndex();
+        unsigned int nSize = ::GetSerializeSize(nMaxSize, nType, nVersion);
+        nSize += ::GetSerializeSize(nCurrentSize, nType, nVersion);
+        nSize += GetSizeOfCompactSize(nCurrentSize);
+        for(uint32_t nPos = poolItems.Front(); nPos != pool_t::NONE; nPos = poolItems.Next(nPos)) {
+            nSize += ::GetSerializeSize(poolItems.Get(nPos), nType, nVersion);
+        }
+        return nSize;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, nMaxSize, nType, nVersion);
+        ::Serialize(s, nCurrentSize, nType, nVersion);
+        WriteCompactSize(s, nCurrentSize);
+        for(uint32_t nPos = poolItems.Front(); nPos != pool_t::NONE; nPos = poolItems.Next(nPos)) {
+            ::Serialize(s, poolItems.Get(nPos), nType, nVersion);
+        }
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        Clear();
+        size_type nSize = 0;
+        ::Unserialize(s, nMaxSize, nType, nVersion);
+        ::Unserialize(s, nSize, nType, nVersion);
+        unsigned int nItems = ReadCompactSize(s);
+        for(unsigned int i = 0; i < nItems; ++i) {
+            item_t item;
+            ::Unserialize(s, item, nType, nVersion);
+            pos_v_t& vecPos = mapIndex[item.key];
+            pos_v_it it = LowerBound(vecPos, item.value);
+            if(it != vecPos.end() && !(item.value < poolItems.Get(*it).value)) {
+                continue;
+            }
+            vecPos.insert(it, poolItems.PushBack(item));
+            ++nCurrentSize;
         }
     }
 
 private:
+    struct CompareValue
+    {
+        const pool_t& pool;
+
+        CompareValue(const pool_t& poolIn) : pool(poolIn) {}
+
+        bool operator()(uint32_t nPos, const V& value) const
+        {
+            return pool.Get(nPos).value < value;
+        }
+    };
+
+    pos_v_it LowerBound(pos_v_t& vecPos, const V& value) const
+    {
+        return std::lower_bound(vecPos.begin(), vecPos.end(), value, CompareValue(poolItems));
+    }
+
     void PruneLast()
     {
         if(nCurrentSize < 1) {
             return;
         }
 
-        list_it lit = listItems.end();
-        --lit;
-        item_t& item = *lit;
+        uint32_t nPos = poolItems.Back();
+        const item_t& item = poolItems.Get(nPos);
 
         map_it mit = mapIndex.find(item.key);
 
         if(mit != mapIndex.end()) {
-            it_map_t& mapIt = mit->second;
+            pos_v_t& vecPos = mit->second;
 
-            mapIt.erase(item.value);
+            pos_v_it it = std::find(vecPos.begin(), vecPos.end(), nPos);
+            if(it != vecPos.end()) {
+                vecPos.erase(it);
+            }
 
-            if(mapIt.size() < 1) {
-                mapIndex.erase(item.key);
+            if(vecPos.size() < 1) {
+                mapIndex.erase(mit);
             }
         }
 
-        listItems.pop_back();
+        poolItems.Free(nPos);
         --nCurrentSize;
     }
-
-    void RebuildIndex()
-    {
-        mapIndex.clear();
-        for(list_it lit = listItems.begin(); lit != listItems.end(); ++lit) {
-            item_t& item = *lit;
-            map_it mit = mapIndex.find(item.key);
-            if(mit == mapIndex.end()) {
-                mit = mapIndex.insert(std::pair<K,it_map_t>(item.key, it_map_t())).first;
-            }
-            it_map_t& mapIt = mit->second;
-            mapIt[item.value] = lit;
-        }
-    }
 };
 
 #endif /* CACHEMULTIMAP_H_ */
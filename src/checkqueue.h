@@ -5,10 +5,18 @@
 #ifndef BITCOIN_CHECKQUEUE_H
 #define BITCOIN_CHECKQUEUE_H
 
+#include "utiltime.h"
+
 #include <algorithm>
+#include <deque>
 #include <vector>
 
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -16,145 +24,408 @@
 template <typename T>
 class CCheckQueueControl;
 
-/** 
+/** Counters of a CWorkerPool, summed over all workers */
+struct CWorkerPoolStats
+{
+    //! Number of worker threads
+    int nWorkers;
+    //! Jobs executed, and how many of those a thread took from another worker's deque
+    uint64_t nJobs;
+    uint64_t nSteals;
+    //! Times a deque lock was found taken and had to be waited for
+    uint64_t nContended;
+    //! Times a worker went to sleep for lack of work
+    uint64_t nSleeps;
+    //! Time spent executing jobs, and wall time the counters cover
+    int64_t nBusyMicros;
+    int64_t nElapsedMicros;
+
+    CWorkerPoolStats() : nWorkers(0), nJobs(0), nSteals(0), nContended(0), nSleeps(0), nBusyMicros(0), nElapsedMicros(0) {}
+
+    //! Fraction of the worker time spent executing jobs
+    double Utilization() const
+    {
+        if (nWorkers == 0 || nElapsedMicros == 0)
+            return 0;
+        return (double)nBusyMicros / ((double)nElapsedMicros * nWorkers);
+    }
+};
+
+/**
+ * Pool of worker threads shared by any number of CCheckQueues.
+ *
+ * Every worker owns a deque of jobs. New jobs are spread over the deques,
+ * a worker takes jobs from the back of its own deque and, once that is
+ * empty, steals from the front of the others. Each deque has its own lock,
+ * so workers only meet on the same lock when stealing.
+ *
+ * Workers may be started and interrupted any number of times; a stopped
+ * worker hands its deque back for the next one to start.
+ */
+class CWorkerPool : private boost::noncopyable
+{
+public:
+    typedef boost::function<void()> Job;
+
+private:
+    struct Counters
+    {
+        uint64_t nJobs;
+        uint64_t nSteals;
+        uint64_t nContended;
+        uint64_t nSleeps;
+        int64_t nBusyMicros;
+
+        Counters() : nJobs(0), nSteals(0), nContended(0), nSleeps(0), nBusyMicros(0) {}
+    };
+
+    struct WorkerQueue
+    {
+        boost::mutex mutex;
+        std::deque<Job> jobs;
+        //! Counters of the thread owning this deque
+        boost::mutex mutexCounters;
+        Counters counters;
+    };
+
+    //! One deque per possible worker, allocated up front so it never moves
+    std::vector<WorkerQueue*> vQueues;
+
+    //! Protects the fields below; idle workers sleep on condWorker
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    //! Running workers, written under mutex
+    boost::atomic<int> nWorkers;
+    //! Deques that have ever had a worker; they stay visible to stealers after it stopped
+    boost::atomic<int> nQueuesUsed;
+    //! Which deques belong to a running worker
+    std::vector<bool> vSlotUsed;
+    int nIdle;
+    //! Deque the next job is pushed to
+    unsigned int nNextQueue;
+    int64_t nStatsStart;
+
+    //! Counters of jobs run by threads that are not workers (the masters)
+    boost::mutex mutexMaster;
+    Counters masterCounters;
+
+    static void LockCounted(boost::unique_lock<boost::mutex>& lock, uint64_t& nContended)
+    {
+        if (!lock.try_lock()) {
+            lock.lock();
+            nContended++;
+        }
+    }
+
+    //! Number of deques that may hold jobs
+    int NumQueues() const
+    {
+        return std::max(nQueuesUsed.load(boost::memory_order_acquire), 1);
+    }
+
+    int AcquireSlot()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::vector<bool>::iterator it = std::find(vSlotUsed.begin(), vSlotUsed.end(), false);
+        assert(it != vSlotUsed.end());
+        *it = true;
+        int nId = it - vSlotUsed.begin();
+        nWorkers++;
+        if (nId >= nQueuesUsed.load(boost::memory_order_relaxed))
+            nQueuesUsed.store(nId + 1, boost::memory_order_release);
+        return nId;
+    }
+
+    void ReleaseSlot(int nId)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        vSlotUsed[nId] = false;
+        nWorkers--;
+        // jobs left in its deque are taken by the other workers or the masters
+        if (nIdle > 0)
+            condWorker.notify_all();
+    }
+
+    //! Take a job from the front of any of the first nQueues deques but nSkip
+    bool Steal(int nQueues, int nSkip, Job& job, uint64_t& nContended)
+    {
+        for (int i = 1; i <= nQueues; i++) {
+            int nVictim = (nSkip + i) % nQueues;
+            if (nVictim == nSkip)
+                continue;
+            WorkerQueue& victim = *vQueues[nVictim];
+            boost::unique_lock<boost::mutex> lock(victim.mutex, boost::defer_lock);
+            LockCounted(lock, nContended);
+            if (!victim.jobs.empty()) {
+                job.swap(victim.jobs.front());
+                victim.jobs.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void RunJob(Job& job, bool fStolen, uint64_t& nContended, boost::mutex& mutexCounters, Counters& counters)
+    {
+        int64_t nStart = GetTimeMicros();
+        job();
+        job.clear();
+        int64_t nTime = GetTimeMicros() - nStart;
+
+        boost::unique_lock<boost::mutex> lock(mutexCounters);
+        counters.nJobs++;
+        if (fStolen)
+            counters.nSteals++;
+        counters.nContended += nContended;
+        counters.nBusyMicros += nTime;
+        nContended = 0;
+    }
+
+public:
+    CWorkerPool(int nMaxWorkers = 64) : nWorkers(0), nQueuesUsed(0), vSlotUsed(nMaxWorkers, false), nIdle(0), nNextQueue(0), nStatsStart(GetTimeMicros())
+    {
+        for (int i = 0; i < nMaxWorkers; i++)
+            vQueues.push_back(new WorkerQueue());
+    }
+
+    ~CWorkerPool()
+    {
+        BOOST_FOREACH (WorkerQueue* pqueue, vQueues)
+            delete pqueue;
+    }
+
+    int NumWorkers() const
+    {
+        return nWorkers.load(boost::memory_order_relaxed);
+    }
+
+    //! Worker thread, returns when interrupted
+    void Thread()
+    {
+        int nId = AcquireSlot();
+        try {
+            Work(nId);
+        } catch (...) {
+            ReleaseSlot(nId);
+            throw;
+        }
+    }
+
+private:
+    void Work(int nId)
+    {
+        WorkerQueue& own = *vQueues[nId];
+        uint64_t nContended = 0;
+        Job job;
+        while (true) {
+            bool fFound = false;
+            {
+                boost::unique_lock<boost::mutex> lock(own.mutex, boost::defer_lock);
+                LockCounted(lock, nContended);
+                if (!own.jobs.empty()) {
+                    job.swap(own.jobs.back());
+                    own.jobs.pop_back();
+                    fFound = true;
+                }
+            }
+            if (fFound || Steal(NumQueues(), nId, job, nContended)) {
+                RunJob(job, !fFound, nContended, own.mutexCounters, own.counters);
+                continue;
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            // deques are checked again under mutex, Submit takes it after pushing
+            bool fWork = false;
+            for (int i = 0; i < NumQueues() && !fWork; i++) {
+                boost::unique_lock<boost::mutex> lockQueue(vQueues[i]->mutex);
+                fWork = !vQueues[i]->jobs.empty();
+            }
+            if (fWork)
+                continue;
+            {
+                boost::unique_lock<boost::mutex> lockCounters(own.mutexCounters);
+                own.counters.nSleeps++;
+            }
+            nIdle++;
+            try {
+                condWorker.wait(lock);
+            } catch (...) {
+                nIdle--;
+                throw;
+            }
+            nIdle--;
+        }
+    }
+
+public:
+    //! Queue jobs, spreading them over the workers' deques
+    void Submit(std::vector<Job>& vJobs)
+    {
+        if (vJobs.empty())
+            return;
+        unsigned int nFirst;
+        int nQueues;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nQueues = std::max(nWorkers.load(boost::memory_order_relaxed), 1);
+            nFirst = nNextQueue % nQueues;
+            nNextQueue = (nFirst + vJobs.size()) % nQueues;
+        }
+        uint64_t nContended = 0;
+        for (int i = 0; i < nQueues && i < (int)vJobs.size(); i++) {
+            WorkerQueue& queue = *vQueues[(nFirst + i) % nQueues];
+            boost::unique_lock<boost::mutex> lockQueue(queue.mutex, boost::defer_lock);
+            LockCounted(lockQueue, nContended);
+            for (unsigned int j = i; j < vJobs.size(); j += nQueues) {
+                queue.jobs.push_back(Job());
+                queue.jobs.back().swap(vJobs[j]);
+            }
+        }
+        if (nContended) {
+            boost::unique_lock<boost::mutex> lockCounters(mutexMaster);
+            masterCounters.nContended += nContended;
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nIdle > 0) {
+            if (vJobs.size() == 1)
+                condWorker.notify_one();
+            else
+                condWorker.notify_all();
+        }
+    }
+
+    //! Let a thread that is not a worker execute one queued job, if there is any
+    bool RunOne()
+    {
+        Job job;
+        uint64_t nContended = 0;
+        bool fFound = Steal(NumQueues(), -1, job, nContended);
+        if (fFound)
+            RunJob(job, false, nContended, mutexMaster, masterCounters);
+        else if (nContended) {
+            boost::unique_lock<boost::mutex> lockCounters(mutexMaster);
+            masterCounters.nContended += nContended;
+        }
+        return fFound;
+    }
+
+    CWorkerPoolStats GetStats()
+    {
+        CWorkerPoolStats stats;
+        boost::unique_lock<boost::mutex> lock(mutex);
+        stats.nWorkers = nWorkers;
+        stats.nElapsedMicros = GetTimeMicros() - nStatsStart;
+        int nQueues = nQueuesUsed.load(boost::memory_order_relaxed);
+        for (int i = 0; i <= nQueues; i++) {
+            boost::unique_lock<boost::mutex> lockCounters(i < nQueues ? vQueues[i]->mutexCounters : mutexMaster);
+            const Counters& counters = i < nQueues ? vQueues[i]->counters : masterCounters;
+            stats.nJobs += counters.nJobs;
+            stats.nSteals += counters.nSteals;
+            stats.nContended += counters.nContended;
+            stats.nSleeps += counters.nSleeps;
+            stats.nBusyMicros += counters.nBusyMicros;
+        }
+        return stats;
+    }
+};
+
+/**
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
   *
   * One thread (the master) is assumed to push batches of verifications
-  * onto the queue, where they are processed by N-1 worker threads. When
-  * the master is done adding work, it temporarily joins the worker pool
-  * as an N'th worker, until all jobs are done.
+  * onto the queue. They are executed as jobs of at most nBatchSize checks
+  * by the threads of a shared CWorkerPool. While waiting for the result
+  * the master helps executing queued jobs.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
+    CWorkerPool& pool;
+
     //! Mutex to protect the inner state
     boost::mutex mutex;
 
-    //! Worker threads block on this when out of work
-    boost::condition_variable condWorker;
-
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
-
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
-
-    //! The total number of workers (including the master).
-    int nTotal;
-
     //! The temporary evaluation result.
     bool fAllOk;
 
-    /**
-     * Number of verifications that haven't completed yet.
-     * This includes elements that are no longer queued, but still in the
-     * worker's own batches.
-     */
+    //! Number of jobs that haven't completed yet.
     unsigned int nTodo;
 
-    //! Whether we're shutting down.
-    bool fQuit;
-
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
-    /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    void RunBatch(boost::shared_ptr<std::vector<T> > pbatch)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
-        std::vector<T> vChecks;
-        vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
-        do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
-            }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
-        } while (true);
+        bool fOk;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fOk = fAllOk;
+        }
+        // once a check failed the remaining ones need not run
+        for (unsigned int i = 0; fOk && i < pbatch->size(); i++)
+            fOk = (*pbatch)[i]();
+        pbatch.reset();
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fAllOk &= fOk;
+        nTodo--;
+        if (nTodo == 0)
+            condMaster.notify_one();
     }
 
 public:
     //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
-
-    //! Worker thread
-    void Thread()
-    {
-        Loop();
-    }
+    CCheckQueue(CWorkerPool& poolIn, unsigned int nBatchSizeIn) : pool(poolIn), fAllOk(true), nTodo(0), nBatchSize(nBatchSizeIn) {}
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        while (true) {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (nTodo == 0) {
+                    bool fRet = fAllOk;
+                    // reset the status for new work later
+                    fAllOk = true;
+                    return fRet;
+                }
+            }
+            if (pool.RunOne())
+                continue;
+            // nothing is queued any more, our remaining jobs are running
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (nTodo != 0)
+                condMaster.wait(lock);
+        }
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        if (vChecks.empty())
+            return;
+        // split so that every worker gets a share, in jobs of at most nBatchSize
+        unsigned int nWorkers = std::max(pool.NumWorkers(), 1);
+        unsigned int nPerJob = std::max(1U, std::min(nBatchSize, (unsigned int)(vChecks.size() + nWorkers - 1) / nWorkers));
+        std::vector<CWorkerPool::Job> vJobs;
+        vJobs.reserve((vChecks.size() + nPerJob - 1) / nPerJob);
+        for (unsigned int i = 0; i < vChecks.size(); i += nPerJob) {
+            boost::shared_ptr<std::vector<T> > pbatch(new std::vector<T>(std::min(nPerJob, (unsigned int)vChecks.size() - i)));
+            for (unsigned int j = 0; j < pbatch->size(); j++)
+                (*pbatch)[j].swap(vChecks[i + j]);
+            vJobs.push_back(boost::bind(&CCheckQueue<T>::RunBatch, this, pbatch));
         }
-        nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
-            condWorker.notify_all();
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nTodo += vJobs.size();
+        }
+        pool.Submit(vJobs);
     }
 
     ~CCheckQueue()
@@ -164,12 +435,12 @@ public:
     bool IsIdle()
     {
         boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo == 0 && fAllOk == true);
     }
 
 };
 
-/** 
+/**
  * RAII-style controller object for a CCheckQueue that guarantees the passed
  * queue is finished before continuing.
  */
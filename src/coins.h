@@ -10,11 +10,14 @@
 #include "core_memusage.h"
 #include "memusage.h"
 #include "serialize.h"
+#include "support/allocators/pool.h"
 #include "uint256.h"
 
 #include <assert.h>
 #include <stdint.h>
 
+#include <functional>
+
 #include <boost/foreach.hpp>
 #include <boost/unordered_map.hpp>
 
@@ -109,12 +112,14 @@ public:
     //! empty constructor
     CCoins() : fCoinBase(false), vout(0), nHeight(0), nVersion(0) { }
 
-    //!remove spent outputs at the end of vout
+    //!remove spent outputs at the end of vout, and the space they took
     void Cleanup() {
         while (vout.size() > 0 && vout.back().IsNull())
             vout.pop_back();
         if (vout.empty())
             std::vector<CTxOut>().swap(vout);
+        else if (vout.capacity() > vout.size())
+            std::vector<CTxOut>(vout).swap(vout);
     }
 
     void ClearUnspendable() {
@@ -282,6 +287,20 @@ public:
     }
 };
 
+/** Salted hasher for outpoint keys */
+class COutPointKeyHasher
+{
+private:
+    uint256 salt;
+
+public:
+    COutPointKeyHasher();
+
+    size_t operator()(const COutPoint& outpoint) const {
+        return outpoint.hash.GetHash(salt) ^ outpoint.n;
+    }
+};
+
 struct CCoinsCacheEntry
 {
     CCoins coins; // The actual cached data.
@@ -295,7 +314,8 @@ struct CCoinsCacheEntry
     CCoinsCacheEntry() : coins(), flags(0) {}
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher, std::equal_to<uint256>,
+                             pool_allocator<std::pair<const uint256, CCoinsCacheEntry> > > CCoinsMap;
 
 struct CCoinsStats
 {
@@ -332,6 +352,9 @@ public:
     //! Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats) const;
 
+    //! Memory held by written changes that are not on disk yet
+    virtual size_t PendingWriteUsage() const;
+
     //! As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
 };
@@ -351,6 +374,7 @@ public:
     void SetBackend(CCoinsView &viewIn);
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats) const;
+    size_t PendingWriteUsage() const;
 };
 
 
@@ -389,6 +413,8 @@ protected:
      * declared as "const".  
      */
     mutable uint256 hashBlock;
+    //! Node memory of cacheCoins, released in one go when the cache is flushed
+    CPoolResource poolCoins;
     mutable CCoinsMap cacheCoins;
 
     /* Cached dynamic memory usage for the inner CCoins objects. */
@@ -412,6 +438,19 @@ public:
      */
     bool HaveCoinsInCache(const uint256 &txid) const;
 
+    /**
+     * Read coins from the backing view without touching the cache. Does not
+     * use any state of this cache, so it may be called from several threads
+     * at once as long as the backing view allows concurrent reads.
+     */
+    bool GetCoinsFromBase(const uint256 &txid, CCoins &coins) const;
+
+    /**
+     * Insert coins read with GetCoinsFromBase() as an unmodified entry, unless
+     * the cache already has an entry for txid. Returns whether it was added.
+     */
+    bool AddPrefetchedCoins(const uint256 &txid, CCoins &coins);
+
     /**
      * Return a pointer to CCoins in the cache, or NULL if not found. This is
      * more efficient than GetCoins. Modifications to other cache entries are
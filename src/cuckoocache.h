@@ -0,0 +1,277 @@
+// Copyright (c) 2014-2017 The Onex Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CUCKOOCACHE_H
+#define BITCOIN_CUCKOOCACHE_H
+
+#include "crypto/common.h"
+#include "uint256.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <new>
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** Counters of a CCuckooCache */
+struct CCuckooCacheStats
+{
+    size_t nSlots;
+    //! Estimated from a sample of the lookups
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nInserts;
+    //! Entries dropped because both of their buckets were full
+    uint64_t nEvictions;
+
+    CCuckooCacheStats() : nSlots(0), nHits(0), nMisses(0), nInserts(0), nEvictions(0) {}
+
+    double HitRate() const
+    {
+        return nHits + nMisses == 0 ? 0 : (double)nHits / (nHits + nMisses);
+    }
+};
+
+/**
+ * Fixed size set of uniformly distributed 256-bit hashes, e.g. salted
+ * SHA256 digests.
+ *
+ * All memory is allocated up front: buckets of two entries, each bucket one
+ * 64-byte cache line. An entry lives in one of two buckets picked by its
+ * bits, so a lookup touches at most two cache lines. Inserting into two
+ * full buckets moves an entry to its other bucket (cuckoo hashing), and after
+ * a few moves the last displaced entry is dropped.
+ *
+ * Contains() and Erase() take no lock. Entries are stored as atomic words
+ * next to a per slot sequence word, which a writer bumps before and after
+ * rewriting the slot. A reader only takes a match if the sequence word was
+ * the same before and after it loaded the entry, so a reader racing a writer
+ * can at worst miss an entry. Inserts are serialized by a mutex.
+ */
+class CCuckooCache : private boost::noncopyable
+{
+public:
+    static const unsigned int SLOTS_PER_BUCKET = 2;
+
+private:
+    //! Number of times an entry is moved to its other bucket before one is dropped
+    static const unsigned int MAX_KICKS = 16;
+    //! Hits and misses are counted for one in STATS_SAMPLE lookups, picked by entry bits
+    static const unsigned int STATS_SAMPLE = 32;
+
+    //! Sequence word bits: odd while the slot is being written, SEQ_USED while it holds an entry
+    static const uint32_t SEQ_WRITING = 1;
+    static const uint32_t SEQ_USED = 2;
+    static const uint32_t SEQ_STEP = 4;
+
+    struct Bucket
+    {
+        boost::atomic<uint64_t> words[SLOTS_PER_BUCKET][4];
+    };
+
+    void* pmemory;
+    Bucket* pbuckets;
+    //! One sequence word per slot: generation in the upper bits, SEQ_USED and SEQ_WRITING
+    boost::atomic<uint32_t>* pseqs;
+    size_t nBuckets;
+
+    //! Serializes inserts
+    boost::mutex mutex;
+    //! State of the generator picking the entry to move, protected by mutex
+    uint64_t nRand;
+
+    mutable boost::atomic<uint64_t> nHits;
+    mutable boost::atomic<uint64_t> nMisses;
+    boost::atomic<uint64_t> nInserts;
+    boost::atomic<uint64_t> nEvictions;
+
+    void FirstBuckets(const uint256& entry, size_t& nFirst, size_t& nSecond) const
+    {
+        nFirst = ReadLE64(entry.begin()) % nBuckets;
+        nSecond = ReadLE64(entry.begin() + 8) % nBuckets;
+        if (nSecond == nFirst)
+            nSecond = (nFirst + 1) % nBuckets;
+    }
+
+    size_t OtherBucket(const uint256& entry, size_t nBucket) const
+    {
+        size_t nFirst, nSecond;
+        FirstBuckets(entry, nFirst, nSecond);
+        return nBucket == nFirst ? nSecond : nFirst;
+    }
+
+    bool Matches(size_t nSlot, const uint256& entry) const
+    {
+        uint32_t nSeq = pseqs[nSlot].load(boost::memory_order_acquire);
+        if ((nSeq & (SEQ_USED | SEQ_WRITING)) != SEQ_USED)
+            return false;
+        const boost::atomic<uint64_t>* pwords = pbuckets[nSlot / SLOTS_PER_BUCKET].words[nSlot % SLOTS_PER_BUCKET];
+        bool fMatch = true;
+        for (int i = 0; i < 4; i++)
+            fMatch &= pwords[i].load(boost::memory_order_relaxed) == ReadLE64(entry.begin() + 8 * i);
+        if (!fMatch)
+            return false;
+        // the words may be torn by a writer that started after the first load
+        boost::atomic_thread_fence(boost::memory_order_acquire);
+        return pseqs[nSlot].load(boost::memory_order_relaxed) == nSeq;
+    }
+
+    //! Find the slot holding entry, or -1
+    long Find(const uint256& entry) const
+    {
+        if (nBuckets == 0)
+            return -1;
+        size_t nFirst, nSecond;
+        FirstBuckets(entry, nFirst, nSecond);
+        for (unsigned int i = 0; i < SLOTS_PER_BUCKET; i++) {
+            if (Matches(nFirst * SLOTS_PER_BUCKET + i, entry))
+                return nFirst * SLOTS_PER_BUCKET + i;
+            if (Matches(nSecond * SLOTS_PER_BUCKET + i, entry))
+                return nSecond * SLOTS_PER_BUCKET + i;
+        }
+        return -1;
+    }
+
+    uint256 Load(size_t nSlot) const
+    {
+        uint256 entry;
+        const boost::atomic<uint64_t>* pwords = pbuckets[nSlot / SLOTS_PER_BUCKET].words[nSlot % SLOTS_PER_BUCKET];
+        for (int i = 0; i < 4; i++)
+            WriteLE64(entry.begin() + 8 * i, pwords[i].load(boost::memory_order_relaxed));
+        return entry;
+    }
+
+    void Store(size_t nSlot, const uint256& entry)
+    {
+        // readers skip the slot while it is being rewritten, and a reader
+        // that loaded it before sees the generation change
+        uint32_t nSeq = pseqs[nSlot].load(boost::memory_order_relaxed);
+        pseqs[nSlot].store(nSeq | SEQ_WRITING, boost::memory_order_relaxed);
+        boost::atomic_thread_fence(boost::memory_order_release);
+        boost::atomic<uint64_t>* pwords = pbuckets[nSlot / SLOTS_PER_BUCKET].words[nSlot % SLOTS_PER_BUCKET];
+        for (int i = 0; i < 4; i++)
+            pwords[i].store(ReadLE64(entry.begin() + 8 * i), boost::memory_order_relaxed);
+        pseqs[nSlot].store(((nSeq & ~(SEQ_USED | SEQ_WRITING)) + SEQ_STEP) | SEQ_USED, boost::memory_order_release);
+    }
+
+    //! Free slot in nBucket, or -1
+    long FreeSlot(size_t nBucket) const
+    {
+        for (unsigned int i = 0; i < SLOTS_PER_BUCKET; i++)
+            if (!(pseqs[nBucket * SLOTS_PER_BUCKET + i].load(boost::memory_order_relaxed) & SEQ_USED))
+                return nBucket * SLOTS_PER_BUCKET + i;
+        return -1;
+    }
+
+    static bool IsSampled(const uint256& entry)
+    {
+        // the bucket choice uses the first 16 bytes, sample on other bits
+        return entry.begin()[24] % STATS_SAMPLE == 0;
+    }
+
+public:
+    /** Create a cache using at most nBytes of memory */
+    explicit CCuckooCache(size_t nBytes) : pmemory(NULL), pbuckets(NULL), pseqs(NULL), nBuckets(0), nRand(0x9E3779B97F4A7C15ULL),
+        nHits(0), nMisses(0), nInserts(0), nEvictions(0)
+    {
+        nBuckets = nBytes / (sizeof(Bucket) + SLOTS_PER_BUCKET * sizeof(boost::atomic<uint32_t>));
+        if (nBuckets == 0)
+            return;
+        size_t nSlots = nBuckets * SLOTS_PER_BUCKET;
+        // one extra line to align the buckets to a cache line
+        pmemory = malloc(64 + nBuckets * sizeof(Bucket) + nSlots * sizeof(boost::atomic<uint32_t>));
+        if (!pmemory)
+            throw std::bad_alloc();
+        pbuckets = reinterpret_cast<Bucket*>(((uintptr_t)pmemory + 63) & ~(uintptr_t)63);
+        pseqs = reinterpret_cast<boost::atomic<uint32_t>*>(pbuckets + nBuckets);
+        for (size_t i = 0; i < nBuckets; i++) {
+            Bucket* pbucket = new (pbuckets + i) Bucket;
+            for (unsigned int j = 0; j < SLOTS_PER_BUCKET; j++)
+                for (int k = 0; k < 4; k++)
+                    pbucket->words[j][k].store(0, boost::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < nSlots; i++)
+            new (pseqs + i) boost::atomic<uint32_t>(0);
+    }
+
+    ~CCuckooCache()
+    {
+        free(pmemory);
+    }
+
+    size_t Slots() const { return nBuckets * SLOTS_PER_BUCKET; }
+
+    bool Contains(const uint256& entry) const
+    {
+        bool fFound = Find(entry) >= 0;
+        // all validation threads look up here, keep them off a shared counter
+        if (IsSampled(entry))
+            (fFound ? nHits : nMisses).fetch_add(1, boost::memory_order_relaxed);
+        return fFound;
+    }
+
+    void Erase(const uint256& entry)
+    {
+        long nSlot = Find(entry);
+        if (nSlot >= 0)
+            pseqs[nSlot].fetch_and(~SEQ_USED, boost::memory_order_release);
+    }
+
+    void Insert(const uint256& entry)
+    {
+        if (nBuckets == 0)
+            return;
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (Find(entry) >= 0)
+            return;
+        nInserts.fetch_add(1, boost::memory_order_relaxed);
+
+        size_t nFirst, nSecond;
+        FirstBuckets(entry, nFirst, nSecond);
+        long nSlot = FreeSlot(nFirst);
+        if (nSlot < 0)
+            nSlot = FreeSlot(nSecond);
+        if (nSlot >= 0) {
+            Store(nSlot, entry);
+            return;
+        }
+
+        // both buckets full: take a random slot and move its entry on
+        uint256 entryMove = entry;
+        size_t nBucket = (nRand & 1) ? nSecond : nFirst;
+        for (unsigned int nKick = 0; nKick < MAX_KICKS; nKick++) {
+            nRand ^= nRand << 13;
+            nRand ^= nRand >> 7;
+            nRand ^= nRand << 17;
+            nSlot = nBucket * SLOTS_PER_BUCKET + nRand % SLOTS_PER_BUCKET;
+            uint256 entryOld = Load(nSlot);
+            Store(nSlot, entryMove);
+            entryMove = entryOld;
+            nBucket = OtherBucket(entryMove, nBucket);
+            long nFree = FreeSlot(nBucket);
+            if (nFree >= 0) {
+                Store(nFree, entryMove);
+                return;
+            }
+        }
+        nEvictions.fetch_add(1, boost::memory_order_relaxed);
+    }
+
+    CCuckooCacheStats GetStats() const
+    {
+        CCuckooCacheStats stats;
+        stats.nSlots = Slots();
+        stats.nHits = nHits.load(boost::memory_order_relaxed) * STATS_SAMPLE;
+        stats.nMisses = nMisses.load(boost::memory_order_relaxed) * STATS_SAMPLE;
+        stats.nInserts = nInserts.load(boost::memory_order_relaxed);
+        stats.nEvictions = nEvictions.load(boost::memory_order_relaxed);
+        return stats;
+    }
+};
+
+#endif // BITCOIN_CUCKOOCACHE_H
@@ -18,6 +18,7 @@
 #include "utilmoneystr.h"
 
 #include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
 
 int nPrivateSendRounds = DEFAULT_PRIVATESEND_ROUNDS;
 int nPrivateSendAmount = DEFAULT_PRIVATESEND_AMOUNT;
@@ -1885,6 +1886,11 @@ bool CDarksendPool::CreateDenominated()
 // Create denominations
 bool CDarksendPool::CreateDenominated(const CompactTallyItem& tallyItem, bool fCreateMixingCollaterals)
 {
+    // Keep the keys of all outputs in one wallet database batch, it is closed
+    // before CommitTransaction so the tx is on disk before it is relayed
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    boost::scoped_ptr<CWalletDBBatch> pbatch(new CWalletDBBatch(pwalletMain));
+
     std::vector<CRecipient> vecSend;
     CAmount nValueLeft = tallyItem.nAmount;
     nValueLeft -= PRIVATESEND_COLLATERAL; // leave some room for fees
@@ -1990,6 +1996,7 @@ bool CDarksendPool::CreateDenominated(const CompactTallyItem& tallyItem, bool fC
 
     // TODO: keep reservekeyDenom here
     reservekeyCollateral.KeepKey();
+    pbatch.reset();
 
     if(!pwalletMain->CommitTransaction(wtx, reservekeyChange)) {
         LogPrintf("CDarksendPool::CreateDenominated -- CommitTransaction failed!\n");
@@ -114,6 +114,10 @@ public:
         return piter->key().size();
     }
 
+    std::string GetKeyBytes() {
+        return piter->key().ToString();
+    }
+
     template<typename V> bool GetValue(V& value) {
         leveldb::Slice slValue = piter->value();
         try {
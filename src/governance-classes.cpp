@@ -8,6 +8,7 @@
 #include "governance-classes.h"
 #include "init.h"
 #include "main.h"
+#include "masternodeman.h"
 #include "utilstrencodings.h"
 
 #include <boost/algorithm/string.hpp>
@@ -139,6 +140,7 @@ bool CGovernanceTriggerManager::AddNewTrigger(uint256 nHash)
 
     DBG( cout << "CGovernanceTriggerManager::AddNewTrigger: Inserting trigger" << endl; );
     mapTrigger.insert(std::make_pair(nHash, pSuperblock));
+    governance.IncreaseStateVersion();
 
     DBG( cout << "CGovernanceTriggerManager::AddNewTrigger: End" << endl; );
 
@@ -231,6 +233,7 @@ void CGovernanceTriggerManager::CleanAndRemove()
                );
             LogPrint("gobject", "CGovernanceTriggerManager::CleanAndRemove -- Removing trigger object\n");
             mapTrigger.erase(it++);
+            governance.IncreaseStateVersion();
         }
         else  {
             ++it;
@@ -272,6 +275,29 @@ std::vector<CSuperblock_sptr> CGovernanceTriggerManager::GetActiveTriggers()
     return vecResults;
 }
 
+/**
+*   Check Cached State Version
+*
+*   - Superblock lookups only depend on triggers, votes and the enabled masternode
+*     count, drop the memoized results once the governance state moved on
+*/
+
+void CGovernanceTriggerManager::CheckCachedStateVersion()
+{
+    AssertLockHeld(governance.cs);
+
+    uint64_t nStateVersion = governance.GetStateVersion();
+    if(nStateVersion == nCachedStateVersion &&
+       mapBestSuperblock.size() <= MAX_CACHED_HEIGHTS &&
+       mapSuperblockTriggered.size() <= MAX_CACHED_HEIGHTS) {
+        return;
+    }
+
+    mapBestSuperblock.clear();
+    mapSuperblockTriggered.clear();
+    nCachedStateVersion = nStateVersion;
+}
+
 /**
 *   Is Superblock Triggered
 *
@@ -286,6 +312,26 @@ bool CSuperblockManager::IsSuperblockTriggered(int nBlockHeight)
     }
 
     LOCK(governance.cs);
+
+    // Funding flags depend on the number of enabled masternodes as well
+    int nMnCount = mnodeman.CountEnabled();
+
+    triggerman.CheckCachedStateVersion();
+    CGovernanceTriggerManager::triggered_m_it it = triggerman.mapSuperblockTriggered.find(nBlockHeight);
+    if(it != triggerman.mapSuperblockTriggered.end() && it->second.first == nMnCount) {
+        LogPrint("gobject", "CSuperblockManager::IsSuperblockTriggered -- cached, nBlockHeight = %d, result = %d\n", nBlockHeight, it->second.second);
+        return it->second.second;
+    }
+
+    bool fTriggered = FindSuperblockTrigger(nBlockHeight);
+    triggerman.mapSuperblockTriggered[nBlockHeight] = std::make_pair(nMnCount, fTriggered);
+    return fTriggered;
+}
+
+bool CSuperblockManager::FindSuperblockTrigger(int nBlockHeight)
+{
+    AssertLockHeld(governance.cs);
+
     // GET ALL ACTIVE TRIGGERS
     std::vector<CSuperblock_sptr> vecTriggers = triggerman.GetActiveTriggers();
 
@@ -344,11 +390,48 @@ bool CSuperblockManager::IsSuperblockTriggered(int nBlockHeight)
 
 
 bool CSuperblockManager::GetBestSuperblock(CSuperblock_sptr& pSuperblockRet, int nBlockHeight)
+{
+    std::vector<CTxOut> voutPayments;
+    return GetBestSuperblock(pSuperblockRet, voutPayments, nBlockHeight);
+}
+
+bool CSuperblockManager::GetBestSuperblock(CSuperblock_sptr& pSuperblockRet, std::vector<CTxOut>& voutPaymentsRet, int nBlockHeight)
 {
     if(!CSuperblock::IsValidBlockHeight(nBlockHeight)) {
         return false;
     }
 
+    AssertLockHeld(governance.cs);
+
+    triggerman.CheckCachedStateVersion();
+    CGovernanceTriggerManager::best_superblock_m_it it = triggerman.mapBestSuperblock.find(nBlockHeight);
+    if(it == triggerman.mapBestSuperblock.end()) {
+        CGovernanceTriggerManager::best_superblock_t best;
+        if(FindBestSuperblock(best.pSuperblock, nBlockHeight)) {
+            for(int i = 0; i < best.pSuperblock->CountPayments(); i++) {
+                CGovernancePayment payment;
+                if(best.pSuperblock->GetPayment(i, payment)) {
+                    best.voutPayments.push_back(CTxOut(payment.nAmount, payment.script));
+                }
+            }
+        }
+        else {
+            best.pSuperblock.reset();
+        }
+        it = triggerman.mapBestSuperblock.insert(std::make_pair(nBlockHeight, best)).first;
+    }
+
+    if(!it->second.pSuperblock) {
+        return false;
+    }
+
+    pSuperblockRet = it->second.pSuperblock;
+    voutPaymentsRet = it->second.voutPayments;
+    return true;
+}
+
+bool CSuperblockManager::FindBestSuperblock(CSuperblock_sptr& pSuperblockRet, int nBlockHeight)
+{
     AssertLockHeld(governance.cs);
     std::vector<CSuperblock_sptr> vecTriggers = triggerman.GetActiveTriggers();
     int nYesCount = 0;
@@ -400,7 +483,8 @@ void CSuperblockManager::CreateSuperblock(CMutableTransaction& txNewRet, int nBl
     // GET THE BEST SUPERBLOCK FOR THIS BLOCK HEIGHT
 
     CSuperblock_sptr pSuperblock;
-    if(!CSuperblockManager::GetBestSuperblock(pSuperblock, nBlockHeight)) {
+    std::vector<CTxOut> voutPayments;
+    if(!CSuperblockManager::GetBestSuperblock(pSuperblock, voutPayments, nBlockHeight)) {
         LogPrint("gobject", "CSuperblockManager::CreateSuperblock -- Can't find superblock for height %d\n", nBlockHeight);
         DBG( cout << "CSuperblockManager::CreateSuperblock Failed to get superblock for height, returning" << endl; );
         return;
@@ -412,37 +496,28 @@ void CSuperblockManager::CreateSuperblock(CMutableTransaction& txNewRet, int nBl
     // CONFIGURE SUPERBLOCK OUTPUTS
 
     // Superblock payments are appended to the end of the coinbase vout vector
-    DBG( cout << "CSuperblockManager::CreateSuperblock Number payments: " << pSuperblock->CountPayments() << endl; );
+    DBG( cout << "CSuperblockManager::CreateSuperblock Number payments: " << voutPayments.size() << endl; );
 
     // TODO: How many payments can we add before things blow up?
     //       Consider at least following limits:
     //          - max coinbase tx size
     //          - max "budget" available
-    for(int i = 0; i < pSuperblock->CountPayments(); i++) {
-        CGovernancePayment payment;
-        DBG( cout << "CSuperblockManager::CreateSuperblock i = " << i << endl; );
-        if(pSuperblock->GetPayment(i, payment)) {
-            DBG( cout << "CSuperblockManager::CreateSuperblock Payment found " << endl; );
-            // SET COINBASE OUTPUT TO SUPERBLOCK SETTING
+    for(size_t i = 0; i < voutPayments.size(); i++) {
+        // SET COINBASE OUTPUT TO SUPERBLOCK SETTING
 
-            CTxOut txout = CTxOut(payment.nAmount, payment.script);
-            txNewRet.vout.push_back(txout);
-            voutSuperblockRet.push_back(txout);
+        const CTxOut& txout = voutPayments[i];
+        txNewRet.vout.push_back(txout);
+        voutSuperblockRet.push_back(txout);
 
-            // PRINT NICE LOG OUTPUT FOR SUPERBLOCK PAYMENT
+        // PRINT NICE LOG OUTPUT FOR SUPERBLOCK PAYMENT
 
-            CTxDestination address1;
-            ExtractDestination(payment.script, address1);
-            CBitcoinAddress address2(address1);
+        CTxDestination address1;
+        ExtractDestination(txout.scriptPubKey, address1);
+        CBitcoinAddress address2(address1);
 
-            // TODO: PRINT NICE N.N Onex OUTPUT
+        // TODO: PRINT NICE N.N Onex OUTPUT
 
-            DBG( cout << "CSuperblockManager::CreateSuperblock Before LogPrintf call, nAmount = " << payment.nAmount << endl; );
-            LogPrintf("NEW Superblock : output %d (addr %s, amount %d)\n", i, address2.ToString(), payment.nAmount);
-            DBG( cout << "CSuperblockManager::CreateSuperblock After LogPrintf call " << endl; );
-        } else {
-            DBG( cout << "CSuperblockManager::CreateSuperblock Payment not found " << endl; );
-        }
+        LogPrintf("NEW Superblock : output %d (addr %s, amount %d)\n", i, address2.ToString(), txout.nValue);
     }
 
     DBG( cout << "CSuperblockManager::CreateSuperblock End" << endl; );
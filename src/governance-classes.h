@@ -47,14 +47,43 @@ private:
     typedef trigger_m_t::iterator trigger_m_it;
     typedef trigger_m_t::const_iterator trigger_m_cit;
 
+    // Best superblock for a block height, pSuperblock is NULL if there is none
+    struct best_superblock_t
+    {
+        CSuperblock_sptr pSuperblock;
+        std::vector<CTxOut> voutPayments;
+    };
+
+    typedef std::map<int, best_superblock_t> best_superblock_m_t;
+    typedef best_superblock_m_t::iterator best_superblock_m_it;
+
+    // Block height -> (enabled masternode count, triggered)
+    typedef std::map<int, std::pair<int, bool> > triggered_m_t;
+    typedef triggered_m_t::iterator triggered_m_it;
+
+    static const size_t MAX_CACHED_HEIGHTS = 16;
+
     trigger_m_t mapTrigger;
 
+    // Superblock lookups memoized per block height, only valid for nCachedStateVersion
+    uint64_t nCachedStateVersion;
+    best_superblock_m_t mapBestSuperblock;
+    triggered_m_t mapSuperblockTriggered;
+
     std::vector<CSuperblock_sptr> GetActiveTriggers();
     bool AddNewTrigger(uint256 nHash);
     void CleanAndRemove();
 
+    /// Drop memoized superblock lookups if the governance state has changed
+    void CheckCachedStateVersion();
+
 public:
-    CGovernanceTriggerManager() : mapTrigger() {}
+    CGovernanceTriggerManager()
+        : mapTrigger(),
+          nCachedStateVersion(0),
+          mapBestSuperblock(),
+          mapSuperblockTriggered()
+    {}
 };
 
 /**
@@ -67,6 +96,10 @@ class CSuperblockManager
 {
 private:
     static bool GetBestSuperblock(CSuperblock_sptr& pSuperblockRet, int nBlockHeight);
+    static bool GetBestSuperblock(CSuperblock_sptr& pSuperblockRet, std::vector<CTxOut>& voutPaymentsRet, int nBlockHeight);
+
+    static bool FindBestSuperblock(CSuperblock_sptr& pSuperblockRet, int nBlockHeight);
+    static bool FindSuperblockTrigger(int nBlockHeight);
 
 public:
 
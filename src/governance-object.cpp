@@ -103,7 +103,11 @@ bool CGovernanceObject::ProcessVote(CNode* pfrom,
         std::ostringstream ostr;
         ostr << "CGovernanceObject::ProcessVote -- Masternode index not found\n";
         exception = CGovernanceException(ostr.str(), GOVERNANCE_EXCEPTION_WARNING);
-        if(mapOrphanVotes.Insert(vote.GetVinMasternode(), vote_time_pair_t(vote, GetAdjustedTime() + GOVERNANCE_ORPHAN_EXPIRATION_TIME))) {
+        if(!governance.AddMasternodeOrphanVote(pfrom, vote)) {
+            LogPrint("gobject", ostr.str().c_str());
+            return false;
+        }
+        if(mapOrphanVotes.Insert(vote.GetVinMasternode().prevout, vote_time_pair_t(vote, GetAdjustedTime() + GOVERNANCE_ORPHAN_EXPIRATION_TIME))) {
             if(pfrom) {
                 mnodeman.AskForMN(pfrom, vote.GetVinMasternode());
             }
@@ -192,6 +196,7 @@ bool CGovernanceObject::ProcessVote(CNode* pfrom,
         fileVotes.AddVote(vote);
     }
     fDirtyCache = true;
+    governance.IncreaseStateVersion();
     return true;
 }
 
@@ -228,6 +233,7 @@ void CGovernanceObject::ClearMasternodeVotes()
 
         if(fRemove) {
             mapCurrentMNVotes.erase(it++);
+            governance.IncreaseStateVersion();
         }
         else {
             ++it;
@@ -725,35 +731,3 @@ void CGovernanceObject::swap(CGovernanceObject& first, CGovernanceObject& second
     swap(first.fDirtyCache, second.fDirtyCache);
     swap(first.fExpired, second.fExpired);
 }
-
-void CGovernanceObject::CheckOrphanVotes()
-{
-    int64_t nNow = GetAdjustedTime();
-    const vote_mcache_t::list_t& listVotes = mapOrphanVotes.GetItemList();
-    vote_mcache_t::list_cit it = listVotes.begin();
-    while(it != listVotes.end()) {
-        bool fRemove = false;
-        const CTxIn& key = it->key;
-        const vote_time_pair_t& pairVote = it->value;
-        const CGovernanceVote& vote = pairVote.first;
-        if(pairVote.second < nNow) {
-            fRemove = true;
-        }
-        else if(!mnodeman.Has(vote.GetVinMasternode())) {
-            ++it;
-            continue;
-        }
-        CGovernanceException exception;
-        if(!ProcessVote(NULL, vote, exception)) {
-            LogPrintf("CGovernanceObject::CheckOrphanVotes -- Failed to add orphan vote: %s\n", exception.what());
-        }
-        else {
-            vote.Relay();
-            fRemove = true;
-        }
-        ++it;
-        if(fRemove) {
-            mapOrphanVotes.Erase(key, pairVote);
-        }
-    }
-}
@@ -8,6 +8,7 @@
 //#define ENABLE_Onex_DEBUG
 
 #include "cachemultimap.h"
+#include "coins.h"
 #include "governance-exceptions.h"
 #include "governance-vote.h"
 #include "governance-votedb.h"
@@ -40,6 +41,10 @@ static const int64_t GOVERNANCE_FEE_CONFIRMATIONS = 6;
 static const int64_t GOVERNANCE_UPDATE_MIN = 60*60;
 static const int64_t GOVERNANCE_DELETION_DELAY = 10*60;
 static const int64_t GOVERNANCE_ORPHAN_EXPIRATION_TIME = 10*60;
+
+// LIMITS ON PENDING ORPHAN VOTES AND OBJECTS RELAYED BY PEERS
+static const int GOVERNANCE_MAX_ORPHAN_ITEMS = 500000;
+static const int GOVERNANCE_MAX_ORPHAN_ITEMS_PER_PEER = 50000;
 static const int64_t GOVERNANCE_WATCHDOG_EXPIRATION_TIME = 2*60*60;
 
 static const int GOVERNANCE_TRIGGER_EXPIRATION_BLOCKS = 576;
@@ -121,7 +126,7 @@ public: // Types
 
     typedef vote_m_t::const_iterator vote_m_cit;
 
-    typedef CacheMultiMap<CTxIn, vote_time_pair_t> vote_mcache_t;
+    typedef CacheMultiMap<COutPoint, vote_time_pair_t, uint32_t, COutPointKeyHasher> vote_mcache_t;
 
 private:
     /// critical section to protect the inner data structures
@@ -183,7 +188,7 @@ private:
 
     vote_m_t mapCurrentMNVotes;
 
-    /// Limited map of votes orphaned by MN
+    /// Limited map of votes orphaned by MN, by masternode outpoint
     vote_mcache_t mapOrphanVotes;
 
     CGovernanceObjectVoteFile fileVotes;
@@ -349,8 +354,6 @@ private:
     /// Called when MN's which have voted on this object have been removed
     void ClearMasternodeVotes();
 
-    void CheckOrphanVotes();
-
 };
 
 
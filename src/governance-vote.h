@@ -90,6 +90,8 @@ class CGovernanceVote
 
     friend bool operator<(const CGovernanceVote& vote1, const CGovernanceVote& vote2);
 
+    friend class CGovernanceObjectVoteFile;
+
 private:
     bool fValid; //if the vote is currently valid / counted
     bool fSynced; //if we've sent this to our peers
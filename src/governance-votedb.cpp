@@ -3,94 +3,223 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "governance-votedb.h"
+#include "memusage.h"
+
+#include <algorithm>
+#include <set>
+
+const uint32_t CGovernanceObjectVoteFile::INDEX_EMPTY;
 
 CGovernanceObjectVoteFile::CGovernanceObjectVoteFile()
     : nMemoryVotes(0),
-      listVotes(),
-      mapVoteIndex()
+      vecRecords(),
+      vchData(),
+      vecIndex(),
+      hasher()
 {}
 
 CGovernanceObjectVoteFile::CGovernanceObjectVoteFile(const CGovernanceObjectVoteFile& other)
     : nMemoryVotes(other.nMemoryVotes),
-      listVotes(other.listVotes),
-      mapVoteIndex()
-{
-    RebuildIndex();
-}
+      vecRecords(other.vecRecords),
+      vchData(other.vchData),
+      vecIndex(other.vecIndex),
+      hasher(other.hasher)
+{}
 
 void CGovernanceObjectVoteFile::AddVote(const CGovernanceVote& vote)
 {
-    listVotes.push_front(vote);
-    mapVoteIndex[vote.GetHash()] = listVotes.begin();
+    AppendRecord(vote, vote.GetHash());
+    InsertIndex(vecRecords.size() - 1);
     ++nMemoryVotes;
 }
 
 bool CGovernanceObjectVoteFile::HasVote(const uint256& nHash) const
 {
-    vote_m_cit it = mapVoteIndex.find(nHash);
-    if(it == mapVoteIndex.end()) {
-        return false;
-    }
-    return true;
+    return Find(nHash) != INDEX_EMPTY;
 }
 
 bool CGovernanceObjectVoteFile::GetVote(const uint256& nHash, CGovernanceVote& vote) const
 {
-    vote_m_cit it = mapVoteIndex.find(nHash);
-    if(it == mapVoteIndex.end()) {
+    uint32_t nPos = Find(nHash);
+    if(nPos == INDEX_EMPTY) {
         return false;
     }
-    vote = *(it->second);
+    vote = MakeVote(vecRecords[nPos]);
     return true;
 }
 
 std::vector<CGovernanceVote> CGovernanceObjectVoteFile::GetVotes() const
 {
     std::vector<CGovernanceVote> vecResult;
-    for(vote_l_cit it = listVotes.begin(); it != listVotes.end(); ++it) {
-        vecResult.push_back(*it);
+    vecResult.reserve(vecRecords.size());
+    for(vote_rec_v_t::const_reverse_iterator it = vecRecords.rbegin(); it != vecRecords.rend(); ++it) {
+        vecResult.push_back(MakeVote(*it));
     }
     return vecResult;
 }
 
 void CGovernanceObjectVoteFile::RemoveVotesFromMasternode(const CTxIn& vinMasternode)
 {
-    vote_l_it it = listVotes.begin();
-    while(it != listVotes.end()) {
-        if(it->GetVinMasternode() == vinMasternode) {
+    // Compact the table and side buffer in place, keeping insertion order
+    size_t nOut = 0;
+    uint32_t nDataOut = 0;
+    for(size_t i = 0; i < vecRecords.size(); ++i) {
+        const vote_rec_t& rec = vecRecords[i];
+        const unsigned char* pScriptSig = vchData.data() + rec.nDataOffset;
+        bool fRemove = (rec.outpointMasternode == vinMasternode.prevout) &&
+                       (rec.nSequence == vinMasternode.nSequence) &&
+                       (rec.nScriptSigSize == vinMasternode.scriptSig.size()) &&
+                       std::equal(vinMasternode.scriptSig.begin(), vinMasternode.scriptSig.end(), pScriptSig);
+        if(fRemove) {
             --nMemoryVotes;
-            mapVoteIndex.erase(it->GetHash());
-            listVotes.erase(it++);
+            continue;
         }
-        else {
-            ++it;
+        uint32_t nDataSize = rec.nScriptSigSize + rec.nSigSize;
+        if(nDataOut != rec.nDataOffset) {
+            std::copy(vchData.begin() + rec.nDataOffset, vchData.begin() + rec.nDataOffset + nDataSize, vchData.begin() + nDataOut);
         }
+        vecRecords[nOut] = rec;
+        vecRecords[nOut].nDataOffset = nDataOut;
+        nDataOut += nDataSize;
+        ++nOut;
     }
+    if(nOut == vecRecords.size()) {
+        return;
+    }
+    vecRecords.resize(nOut);
+    vchData.resize(nDataOut);
+    RebuildIndex(vecIndex.size());
 }
 
 CGovernanceObjectVoteFile& CGovernanceObjectVoteFile::operator=(const CGovernanceObjectVoteFile& other)
 {
     nMemoryVotes = other.nMemoryVotes;
-    listVotes = other.listVotes;
-    RebuildIndex();
+    vecRecords = other.vecRecords;
+    vchData = other.vchData;
+    vecIndex = other.vecIndex;
+    hasher = other.hasher;
     return *this;
 }
 
-void CGovernanceObjectVoteFile::RebuildIndex()
+size_t CGovernanceObjectVoteFile::GetMemoryUsage() const
+{
+    return memusage::DynamicUsage(vecRecords) + memusage::DynamicUsage(vchData) + memusage::DynamicUsage(vecIndex);
+}
+
+void CGovernanceObjectVoteFile::Clear()
 {
-    mapVoteIndex.clear();
     nMemoryVotes = 0;
-    vote_l_it it = listVotes.begin();
-    while(it != listVotes.end()) {
-        CGovernanceVote& vote = *it;
-        uint256 nHash = vote.GetHash();
-        if(mapVoteIndex.find(nHash) == mapVoteIndex.end()) {
-            mapVoteIndex[nHash] = it;
-            ++nMemoryVotes;
-            ++it;
+    vecRecords.clear();
+    vchData.clear();
+    vecIndex.clear();
+}
+
+void CGovernanceObjectVoteFile::Load(const std::vector<CGovernanceVote>& vecVotes)
+{
+    Clear();
+    // Votes are given most recent first, records are stored oldest first.
+    // When the same vote appears more than once the most recent copy is kept.
+    std::vector<uint256> vecHashes;
+    vecHashes.reserve(vecVotes.size());
+    for(size_t i = 0; i < vecVotes.size(); ++i) {
+        vecHashes.push_back(vecVotes[i].GetHash());
+    }
+    std::set<uint256> setSeen;
+    std::vector<bool> vecKeep(vecVotes.size(), false);
+    for(size_t i = 0; i < vecVotes.size(); ++i) {
+        vecKeep[i] = setSeen.insert(vecHashes[i]).second;
+    }
+    vecRecords.reserve(setSeen.size());
+    for(size_t i = vecVotes.size(); i-- > 0; ) {
+        if(vecKeep[i]) {
+            AppendRecord(vecVotes[i], vecHashes[i]);
+        }
+    }
+    nMemoryVotes = vecRecords.size();
+    RebuildIndex(0);
+}
+
+void CGovernanceObjectVoteFile::AppendRecord(const CGovernanceVote& vote, const uint256& nHash)
+{
+    vote_rec_t rec;
+    rec.nHash = nHash;
+    rec.nParentHash = vote.nParentHash;
+    rec.outpointMasternode = vote.vinMasternode.prevout;
+    rec.nSequence = vote.vinMasternode.nSequence;
+    rec.nTime = vote.nTime;
+    rec.nVoteSignal = vote.nVoteSignal;
+    rec.nVoteOutcome = vote.nVoteOutcome;
+    rec.nDataOffset = vchData.size();
+    rec.nScriptSigSize = vote.vinMasternode.scriptSig.size();
+    rec.nSigSize = vote.vchSig.size();
+    rec.fValid = vote.fValid;
+    rec.fSynced = vote.fSynced;
+    vchData.insert(vchData.end(), vote.vinMasternode.scriptSig.begin(), vote.vinMasternode.scriptSig.end());
+    vchData.insert(vchData.end(), vote.vchSig.begin(), vote.vchSig.end());
+    vecRecords.push_back(rec);
+}
+
+CGovernanceVote CGovernanceObjectVoteFile::MakeVote(const vote_rec_t& rec) const
+{
+    const unsigned char* pScriptSig = vchData.data() + rec.nDataOffset;
+    const unsigned char* pSig = pScriptSig + rec.nScriptSigSize;
+    CGovernanceVote vote;
+    vote.fValid = rec.fValid;
+    vote.fSynced = rec.fSynced;
+    vote.nVoteSignal = rec.nVoteSignal;
+    vote.vinMasternode = CTxIn(rec.outpointMasternode, CScript(pScriptSig, pSig), rec.nSequence);
+    vote.nParentHash = rec.nParentHash;
+    vote.nVoteOutcome = rec.nVoteOutcome;
+    vote.nTime = rec.nTime;
+    vote.vchSig.assign(pSig, pSig + rec.nSigSize);
+    return vote;
+}
+
+uint32_t CGovernanceObjectVoteFile::Find(const uint256& nHash) const
+{
+    if(vecIndex.empty()) {
+        return INDEX_EMPTY;
+    }
+    size_t nMask = vecIndex.size() - 1;
+    for(size_t nSlot = hasher(nHash) & nMask; ; nSlot = (nSlot + 1) & nMask) {
+        uint32_t nPos = vecIndex[nSlot];
+        if(nPos == INDEX_EMPTY) {
+            return INDEX_EMPTY;
+        }
+        if(vecRecords[nPos].nHash == nHash) {
+            return nPos;
         }
-        else {
-            listVotes.erase(it++);
+    }
+}
+
+void CGovernanceObjectVoteFile::InsertIndex(uint32_t nPos)
+{
+    // Keep the load factor at or below one half
+    if(vecRecords.size() * 2 > vecIndex.size()) {
+        RebuildIndex(vecRecords.size() * 2);
+        return;
+    }
+    size_t nMask = vecIndex.size() - 1;
+    size_t nSlot = hasher(vecRecords[nPos].nHash) & nMask;
+    while(vecIndex[nSlot] != INDEX_EMPTY) {
+        nSlot = (nSlot + 1) & nMask;
+    }
+    vecIndex[nSlot] = nPos;
+}
+
+void CGovernanceObjectVoteFile::RebuildIndex(size_t nCapacity)
+{
+    size_t nSize = INDEX_MIN_SIZE;
+    while(nSize < nCapacity || nSize < vecRecords.size() * 2) {
+        nSize <<= 1;
+    }
+    vecIndex.assign(nSize, INDEX_EMPTY);
+    size_t nMask = nSize - 1;
+    for(size_t i = 0; i < vecRecords.size(); ++i) {
+        size_t nSlot = hasher(vecRecords[i].nHash) & nMask;
+        while(vecIndex[nSlot] != INDEX_EMPTY) {
+            nSlot = (nSlot + 1) & nMask;
         }
+        vecIndex[nSlot] = i;
     }
 }
@@ -5,9 +5,9 @@
 #ifndef GOVERNANCE_VOTEDB_H
 #define GOVERNANCE_VOTEDB_H
 
-#include <list>
-#include <map>
+#include <vector>
 
+#include "cachemap.h"
 #include "governance-vote.h"
 #include "serialize.h"
 #include "uint256.h"
@@ -17,32 +17,52 @@
  * Recently received votes are held in memory until a maximum size is reached after
  * which older votes a flushed to a disk file.
  *
+ * Votes are kept in a contiguous table of fixed-size records in insertion order.
+ * The variable length parts of a vote (masternode scriptSig and signature) live
+ * in a single side buffer and records refer to them by offset. Lookups by vote
+ * hash go through an open-addressed (linear probing) index of record positions,
+ * vote hashes come from peers so the index hashes them with a random salt.
+ *
  * Note: This is a stub implementation that doesn't limit the number of votes held
  * in memory and doesn't flush to disk.
  */
 class CGovernanceObjectVoteFile
 {
-public: // Types
-    typedef std::list<CGovernanceVote> vote_l_t;
-
-    typedef vote_l_t::iterator vote_l_it;
+private:
+    struct vote_rec_t {
+        uint256 nHash;
+        uint256 nParentHash;
+        COutPoint outpointMasternode;
+        uint32_t nSequence;
+        int64_t nTime;
+        int32_t nVoteSignal;
+        int32_t nVoteOutcome;
+        uint32_t nDataOffset;
+        uint32_t nScriptSigSize;
+        uint32_t nSigSize;
+        bool fValid;
+        bool fSynced;
+    };
+
+    typedef std::vector<vote_rec_t> vote_rec_v_t;
+
+    typedef std::vector<uint32_t> index_v_t;
 
-    typedef vote_l_t::const_iterator vote_l_cit;
+    static const int MAX_MEMORY_VOTES = -1;
 
-    typedef std::map<uint256,vote_l_it> vote_m_t;
+    static const uint32_t INDEX_EMPTY = 0xffffffff;
 
-    typedef vote_m_t::iterator vote_m_it;
+    static const size_t INDEX_MIN_SIZE = 16;
 
-    typedef vote_m_t::const_iterator vote_m_cit;
+    int nMemoryVotes;
 
-private:
-    static const int MAX_MEMORY_VOTES = -1;
+    vote_rec_v_t vecRecords;
 
-    int nMemoryVotes;
+    std::vector<unsigned char> vchData;
 
-    vote_l_t listVotes;
+    index_v_t vecIndex;
 
-    vote_m_t mapVoteIndex;
+    CacheKeyHasher<uint256> hasher;
 
 public:
     CGovernanceObjectVoteFile();
@@ -68,25 +88,78 @@ public:
         return nMemoryVotes;
     }
 
+    /**
+     * Return all votes, most recently added first
+     */
     std::vector<CGovernanceVote> GetVotes() const;
 
     CGovernanceObjectVoteFile& operator=(const CGovernanceObjectVoteFile& other);
 
     void RemoveVotesFromMasternode(const CTxIn& vinMasternode);
 
-    ADD_SERIALIZE_METHODS;
+    /**
+     * Heap memory held by the vote table, side buffer and index
+     */
+    size_t GetMemoryUsage() const;
+
+    // Serialized as the vote count followed by a list of votes (most recent first),
+    // which matches the format written by earlier std::list based versions.
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        unsigned int nSize = ::GetSerializeSize(nMemoryVotes, nType, nVersion);
+        nSize += GetSizeOfCompactSize(vecRecords.size());
+        for(vote_rec_v_t::const_reverse_iterator it = vecRecords.rbegin(); it != vecRecords.rend(); ++it) {
+            nSize += ::GetSerializeSize(MakeVote(*it), nType, nVersion);
+        }
+        return nSize;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, nMemoryVotes, nType, nVersion);
+        WriteCompactSize(s, vecRecords.size());
+        for(vote_rec_v_t::const_reverse_iterator it = vecRecords.rbegin(); it != vecRecords.rend(); ++it) {
+            ::Serialize(s, MakeVote(*it), nType, nVersion);
+        }
+    }
 
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
     {
-        READWRITE(nMemoryVotes);
-        READWRITE(listVotes);
-        if(ser_action.ForRead()) {
-            RebuildIndex();
+        ::Unserialize(s, nMemoryVotes, nType, nVersion);
+        std::vector<CGovernanceVote> vecVotes;
+        unsigned int nSize = ReadCompactSize(s);
+        for(unsigned int i = 0; i < nSize; ++i) {
+            CGovernanceVote vote;
+            ::Unserialize(s, vote, nType, nVersion);
+            vecVotes.push_back(vote);
         }
+        Load(vecVotes);
     }
+
 private:
-    void RebuildIndex();
+    void Clear();
+
+    /**
+     * Replace the contents with the given votes (most recent first),
+     * dropping duplicates
+     */
+    void Load(const std::vector<CGovernanceVote>& vecVotes);
+
+    void AppendRecord(const CGovernanceVote& vote, const uint256& nHash);
+
+    CGovernanceVote MakeVote(const vote_rec_t& rec) const;
+
+    /**
+     * Return the position of the record with this hash or INDEX_EMPTY
+     */
+    uint32_t Find(const uint256& nHash) const;
+
+    void InsertIndex(uint32_t nPos);
+
+    void RebuildIndex(size_t nCapacity);
 
 };
 
@@ -24,6 +24,7 @@ CGovernanceManager::CGovernanceManager()
     : pCurrentBlockIndex(NULL),
       nTimeLastDiff(0),
       nCachedBlockHeight(0),
+      nStateVersion(0),
       mapObjects(),
       mapSeenGovernanceObjects(),
       mapMasternodeOrphanObjects(),
@@ -33,6 +34,10 @@ CGovernanceManager::CGovernanceManager()
       mapVoteToObject(MAX_CACHE_SIZE),
       mapInvalidVotes(MAX_CACHE_SIZE),
       mapOrphanVotes(MAX_CACHE_SIZE),
+      mapMasternodeOrphanVoteIndex(),
+      mapMasternodeOrphanObjectIndex(),
+      mapOrphanSources(),
+      mapOrphanCountByPeer(),
       mapLastMasternodeObject(),
       setRequestedObjects(),
       fRateChecksEnabled(true),
@@ -198,8 +203,12 @@ void CGovernanceManager::ProcessMessage(CNode* pfrom, std::string& strCommand, C
         bool fIsValid = govobj.IsValidLocally(strError, fMasternodeMissing, true);
 
         if(fMasternodeMissing) {
-            mapMasternodeOrphanObjects.insert(std::make_pair(nHash, object_time_pair_t(govobj, GetAdjustedTime() + GOVERNANCE_ORPHAN_EXPIRATION_TIME)));
-            LogPrintf("MNGOVERNANCEOBJECT -- Missing masternode for: %s, strError = %s\n", strHash, strError);
+            int64_t nExpirationTime = GetAdjustedTime() + GOVERNANCE_ORPHAN_EXPIRATION_TIME;
+            if(AcceptOrphan(pfrom, nHash, nExpirationTime)) {
+                mapMasternodeOrphanObjects.insert(std::make_pair(nHash, object_time_pair_t(govobj, nExpirationTime)));
+                mapMasternodeOrphanObjectIndex[govobj.GetMasternodeVin().prevout].insert(nHash);
+                LogPrintf("MNGOVERNANCEOBJECT -- Missing masternode for: %s, strError = %s\n", strHash, strError);
+            }
             // fIsValid must also be false here so we will return early in the next if block
         }
         if(!fIsValid) {
@@ -306,6 +315,7 @@ void CGovernanceManager::CheckOrphanVotes(CGovernanceObject& govobj, CGovernance
         }
         if(fRemove) {
             mapOrphanVotes.Erase(nHash, pairVote);
+            ForgetOrphan(vote.GetHash());
         }
     }
     fRateChecksEnabled = true;
@@ -361,6 +371,7 @@ bool CGovernanceManager::AddGovernanceObject(CGovernanceObject& govobj, bool& fA
 
     // INSERT INTO OUR GOVERNANCE OBJECT MEMORY
     mapObjects.insert(std::make_pair(nHash, govobj));
+    ++nStateVersion;
 
     // SHOULD WE ADD THIS OBJECT TO ANY OTHER MANANGERS?
 
@@ -536,6 +547,7 @@ void CGovernanceManager::UpdateCachesAndClean()
                 mapWatchdogObjects.erase(it->first);
             }
             mapObjects.erase(it++);
+            ++nStateVersion;
         } else {
             ++it;
         }
@@ -961,7 +973,12 @@ bool CGovernanceManager::ProcessVote(CNode* pfrom, const CGovernanceVote& vote,
              << ", MN outpoint = " << vote.GetVinMasternode().prevout.ToStringShort()
              << ", governance object hash = " << vote.GetParentHash().ToString() << "\n";
         exception = CGovernanceException(ostr.str(), GOVERNANCE_EXCEPTION_WARNING);
-        if(mapOrphanVotes.Insert(nHashGovobj, vote_time_pair_t(vote, GetAdjustedTime() + GOVERNANCE_ORPHAN_EXPIRATION_TIME))) {
+        int64_t nExpirationTime = GetAdjustedTime() + GOVERNANCE_ORPHAN_EXPIRATION_TIME;
+        if(!AcceptOrphan(pfrom, nHashVote, nExpirationTime)) {
+            LogPrint("gobject", ostr.str().c_str());
+            return false;
+        }
+        if(mapOrphanVotes.Insert(nHashGovobj, vote_time_pair_t(vote, nExpirationTime))) {
             RequestGovernanceObject(pfrom, nHashGovobj);
             LogPrintf(ostr.str().c_str());
         }
@@ -989,57 +1006,167 @@ bool CGovernanceManager::ProcessVote(CNode* pfrom, const CGovernanceVote& vote,
     return fOk;
 }
 
-void CGovernanceManager::CheckMasternodeOrphanVotes()
+void CGovernanceManager::CheckMasternodeOrphanVotes(const std::vector<COutPoint>& vecMasternodes)
 {
     LOCK2(cs_main, cs);
+    int64_t nNow = GetAdjustedTime();
     fRateChecksEnabled = false;
-    for(object_m_it it = mapObjects.begin(); it != mapObjects.end(); ++it) {
-        it->second.CheckOrphanVotes();
+    for(size_t i = 0; i < vecMasternodes.size(); ++i) {
+        const COutPoint& outpointMasternode = vecMasternodes[i];
+        outpoint_hash_m_it it = mapMasternodeOrphanVoteIndex.find(outpointMasternode);
+        if(it == mapMasternodeOrphanVoteIndex.end()) {
+            continue;
+        }
+        // Votes which are still orphaned after the replay put their parent back
+        hash_s_t setHashes;
+        setHashes.swap(it->second);
+        mapMasternodeOrphanVoteIndex.erase(it);
+        for(hash_s_it hit = setHashes.begin(); hit != setHashes.end(); ++hit) {
+            object_m_it oit = mapObjects.find(*hit);
+            if(oit == mapObjects.end()) {
+                continue;
+            }
+            CGovernanceObject& govobj = oit->second;
+            CheckMasternodeOrphanVotes(govobj, outpointMasternode, nNow);
+            if(govobj.mapOrphanVotes.HasKey(outpointMasternode)) {
+                mapMasternodeOrphanVoteIndex[outpointMasternode].insert(*hit);
+            }
+        }
     }
     fRateChecksEnabled = true;
 }
 
-void CGovernanceManager::CheckMasternodeOrphanObjects()
+void CGovernanceManager::CheckMasternodeOrphanVotes(CGovernanceObject& govobj, const COutPoint& outpointMasternode, int64_t nNow)
 {
-    LOCK2(cs_main, cs);
-    int64_t nNow = GetAdjustedTime();
-    fRateChecksEnabled = false;
-    object_time_m_it it = mapMasternodeOrphanObjects.begin();
-    while(it != mapMasternodeOrphanObjects.end()) {
-        object_time_pair_t& pair = it->second;
-        CGovernanceObject& govobj = pair.first;
+    std::vector<vote_time_pair_t> vecVotePairs;
+    govobj.mapOrphanVotes.GetAll(outpointMasternode, vecVotePairs);
 
-        if(pair.second < nNow) {
-            mapMasternodeOrphanObjects.erase(it++);
+    for(size_t i = 0; i < vecVotePairs.size(); ++i) {
+        bool fRemove = false;
+        const vote_time_pair_t& pairVote = vecVotePairs[i];
+        const CGovernanceVote& vote = pairVote.first;
+        if(pairVote.second < nNow) {
+            fRemove = true;
+        }
+        else if(!mnodeman.Has(CTxIn(outpointMasternode))) {
             continue;
         }
-
-        string strError;
-        bool fMasternodeMissing = false;
-        bool fIsValid = govobj.IsValidLocally(strError, fMasternodeMissing, true);
-        if(!fIsValid) {
-            if(!fMasternodeMissing) {
-                mapMasternodeOrphanObjects.erase(it++);
+        else {
+            CGovernanceException exception;
+            if(!govobj.ProcessVote(NULL, vote, exception)) {
+                LogPrintf("CGovernanceManager::CheckMasternodeOrphanVotes -- Failed to add orphan vote: %s\n", exception.what());
             }
             else {
-                ++it;
+                vote.Relay();
+                fRemove = true;
             }
-            continue;
         }
+        if(fRemove) {
+            govobj.mapOrphanVotes.Erase(outpointMasternode, pairVote);
+            ForgetOrphan(vote.GetHash());
+        }
+    }
+}
 
-        bool fAddToSeen = true;
-        if(AddGovernanceObject(govobj, fAddToSeen)) {
-            LogPrintf("CGovernanceManager::CheckMasternodeOrphanObjects -- %s new\n", govobj.GetHash().ToString());
-            govobj.Relay();
-            mapMasternodeOrphanObjects.erase(it++);
+void CGovernanceManager::CheckMasternodeOrphanObjects(const std::vector<COutPoint>& vecMasternodes)
+{
+    LOCK2(cs_main, cs);
+    int64_t nNow = GetAdjustedTime();
+    fRateChecksEnabled = false;
+    for(size_t i = 0; i < vecMasternodes.size(); ++i) {
+        const COutPoint& outpointMasternode = vecMasternodes[i];
+        outpoint_hash_m_it it = mapMasternodeOrphanObjectIndex.find(outpointMasternode);
+        if(it == mapMasternodeOrphanObjectIndex.end()) {
+            continue;
         }
-        else {
-            ++it;
+        hash_s_t setHashes;
+        setHashes.swap(it->second);
+        mapMasternodeOrphanObjectIndex.erase(it);
+        for(hash_s_it hit = setHashes.begin(); hit != setHashes.end(); ++hit) {
+            object_time_m_it oit = mapMasternodeOrphanObjects.find(*hit);
+            if(oit == mapMasternodeOrphanObjects.end()) {
+                continue;
+            }
+            if(CheckMasternodeOrphanObject(oit->second, nNow)) {
+                mapMasternodeOrphanObjects.erase(oit);
+                ForgetOrphan(*hit);
+            }
+            else {
+                mapMasternodeOrphanObjectIndex[outpointMasternode].insert(*hit);
+            }
         }
     }
     fRateChecksEnabled = true;
 }
 
+bool CGovernanceManager::CheckMasternodeOrphanObject(object_time_pair_t& pairObject, int64_t nNow)
+{
+    CGovernanceObject& govobj = pairObject.first;
+
+    if(pairObject.second < nNow) {
+        return true;
+    }
+
+    string strError;
+    bool fMasternodeMissing = false;
+    bool fIsValid = govobj.IsValidLocally(strError, fMasternodeMissing, true);
+    if(!fIsValid) {
+        return !fMasternodeMissing;
+    }
+
+    bool fAddToSeen = true;
+    if(AddGovernanceObject(govobj, fAddToSeen)) {
+        LogPrintf("CGovernanceManager::CheckMasternodeOrphanObjects -- %s new\n", govobj.GetHash().ToString());
+        govobj.Relay();
+        return true;
+    }
+    return false;
+}
+
+bool CGovernanceManager::AddMasternodeOrphanVote(CNode* pfrom, const CGovernanceVote& vote)
+{
+    LOCK(cs);
+    if(!AcceptOrphan(pfrom, vote.GetHash(), GetAdjustedTime() + GOVERNANCE_ORPHAN_EXPIRATION_TIME)) {
+        return false;
+    }
+    mapMasternodeOrphanVoteIndex[vote.GetVinMasternode().prevout].insert(vote.GetParentHash());
+    return true;
+}
+
+bool CGovernanceManager::AcceptOrphan(CNode* pfrom, const uint256& nHash, int64_t nExpirationTime)
+{
+    // Orphans we replay or create ourselves are not accounted to any peer
+    if(!pfrom) {
+        return true;
+    }
+    if(mapOrphanSources.count(nHash)) {
+        return true;
+    }
+    int& nPeerCount = mapOrphanCountByPeer[pfrom->id];
+    if(((int)mapOrphanSources.size() >= GOVERNANCE_MAX_ORPHAN_ITEMS) ||
+       (nPeerCount >= GOVERNANCE_MAX_ORPHAN_ITEMS_PER_PEER)) {
+        LogPrint("gobject", "CGovernanceManager::AcceptOrphan -- orphan limit reached, hash = %s, peer = %d, peer count = %d, total = %d\n",
+                 nHash.ToString(), pfrom->id, nPeerCount, mapOrphanSources.size());
+        return false;
+    }
+    mapOrphanSources.insert(std::make_pair(nHash, std::make_pair(pfrom->id, nExpirationTime)));
+    ++nPeerCount;
+    return true;
+}
+
+void CGovernanceManager::ForgetOrphan(const uint256& nHash)
+{
+    orphan_source_m_it it = mapOrphanSources.find(nHash);
+    if(it == mapOrphanSources.end()) {
+        return;
+    }
+    peer_count_m_it pit = mapOrphanCountByPeer.find(it->second.first);
+    if(pit != mapOrphanCountByPeer.end() && --(pit->second) <= 0) {
+        mapOrphanCountByPeer.erase(pit);
+    }
+    mapOrphanSources.erase(it);
+}
+
 void CGovernanceManager::RequestGovernanceObject(CNode* pfrom, const uint256& nHash, bool fUseFilter)
 {
     if(!pfrom) {
@@ -1238,6 +1365,7 @@ void CGovernanceManager::RebuildVoteMaps()
     for(object_m_it it = mapObjects.begin(); it != mapObjects.end(); ++it) {
         it->second.RebuildVoteMap();
     }
+    ++nStateVersion;
     mnodeman.ClearOldMasternodeIndex();
 }
 
@@ -1364,9 +1492,71 @@ void CGovernanceManager::CleanOrphanObjects()
     while(it != items.end()) {
         vote_mcache_t::list_cit prevIt = it;
         ++it;
-        const vote_time_pair_t& pairVote = prevIt->value;
-        if(pairVote.second < nNow) {
+        if(prevIt->value.second < nNow) {
+            // Erase returns the node to the pool, take the hash first
+            uint256 nVoteHash = prevIt->value.first.GetHash();
             mapOrphanVotes.Erase(prevIt->key, prevIt->value);
+            ForgetOrphan(nVoteHash);
+        }
+    }
+
+    // Expire votes from unknown masternodes held by objects
+    outpoint_hash_m_it iit = mapMasternodeOrphanVoteIndex.begin();
+    while(iit != mapMasternodeOrphanVoteIndex.end()) {
+        const COutPoint& outpointMasternode = iit->first;
+        hash_s_t& setHashes = iit->second;
+        hash_s_it hit = setHashes.begin();
+        while(hit != setHashes.end()) {
+            object_m_it oit = mapObjects.find(*hit);
+            if(oit != mapObjects.end()) {
+                CGovernanceObject& govobj = oit->second;
+                std::vector<vote_time_pair_t> vecVotePairs;
+                govobj.mapOrphanVotes.GetAll(outpointMasternode, vecVotePairs);
+                for(size_t i = 0; i < vecVotePairs.size(); ++i) {
+                    if(vecVotePairs[i].second < nNow) {
+                        govobj.mapOrphanVotes.Erase(outpointMasternode, vecVotePairs[i]);
+                        ForgetOrphan(vecVotePairs[i].first.GetHash());
+                    }
+                }
+                if(govobj.mapOrphanVotes.HasKey(outpointMasternode)) {
+                    ++hit;
+                    continue;
+                }
+            }
+            setHashes.erase(hit++);
+        }
+        if(setHashes.empty()) {
+            mapMasternodeOrphanVoteIndex.erase(iit++);
+        }
+        else {
+            ++iit;
+        }
+    }
+
+    // Expire objects from unknown masternodes
+    object_time_m_it oit = mapMasternodeOrphanObjects.begin();
+    while(oit != mapMasternodeOrphanObjects.end()) {
+        if(oit->second.second >= nNow) {
+            ++oit;
+            continue;
+        }
+        outpoint_hash_m_it idxit = mapMasternodeOrphanObjectIndex.find(oit->second.first.GetMasternodeVin().prevout);
+        if(idxit != mapMasternodeOrphanObjectIndex.end()) {
+            idxit->second.erase(oit->first);
+            if(idxit->second.empty()) {
+                mapMasternodeOrphanObjectIndex.erase(idxit);
+            }
+        }
+        ForgetOrphan(oit->first);
+        mapMasternodeOrphanObjects.erase(oit++);
+    }
+
+    // Drop accounting for orphans which were evicted from the caches
+    orphan_source_m_it sit = mapOrphanSources.begin();
+    while(sit != mapOrphanSources.end()) {
+        orphan_source_m_it prevSit = sit++;
+        if(prevSit->second.second < nNow) {
+            ForgetOrphan(prevSit->first);
         }
     }
 }
@@ -221,6 +221,20 @@ public: // Types
 
     typedef hash_time_m_t::const_iterator hash_time_m_cit;
 
+    typedef std::map<COutPoint, hash_s_t> outpoint_hash_m_t;
+
+    typedef outpoint_hash_m_t::iterator outpoint_hash_m_it;
+
+    typedef outpoint_hash_m_t::const_iterator outpoint_hash_m_cit;
+
+    typedef std::map<uint256, std::pair<NodeId, int64_t> > orphan_source_m_t;
+
+    typedef orphan_source_m_t::iterator orphan_source_m_it;
+
+    typedef std::map<NodeId, int> peer_count_m_t;
+
+    typedef peer_count_m_t::iterator peer_count_m_it;
+
 private:
     static const int MAX_CACHE_SIZE = 1000000;
 
@@ -232,6 +246,9 @@ private:
     int64_t nTimeLastDiff;
     int nCachedBlockHeight;
 
+    // Changes whenever objects, triggers or votes change
+    uint64_t nStateVersion;
+
     // keep track of the scanning errors
     object_m_t mapObjects;
 
@@ -251,6 +268,17 @@ private:
 
     vote_mcache_t mapOrphanVotes;
 
+    /// Objects holding orphan votes from masternodes we don't know yet, by masternode
+    outpoint_hash_m_t mapMasternodeOrphanVoteIndex;
+
+    /// Hashes of masternode orphan objects, by the masternode that signed them
+    outpoint_hash_m_t mapMasternodeOrphanObjectIndex;
+
+    /// Source peer and expiration time of pending orphan votes and objects
+    orphan_source_m_t mapOrphanSources;
+
+    peer_count_m_t mapOrphanCountByPeer;
+
     txout_m_t mapLastMasternodeObject;
 
     hash_s_t setRequestedObjects;
@@ -315,7 +343,12 @@ public:
         mapVoteToObject.Clear();
         mapInvalidVotes.Clear();
         mapOrphanVotes.Clear();
+        mapMasternodeOrphanVoteIndex.clear();
+        mapMasternodeOrphanObjectIndex.clear();
+        mapOrphanSources.clear();
+        mapOrphanCountByPeer.clear();
         mapLastMasternodeObject.clear();
+        ++nStateVersion;
     }
 
     std::string ToString() const;
@@ -345,9 +378,27 @@ public:
             Clear();
             return;
         }
+        if(ser_action.ForRead()) {
+            ++nStateVersion;
+        }
     }
 
     void UpdatedBlockTip(const CBlockIndex *pindex);
+    /**
+     * Version of the governance state used by superblock selection, it is
+     * increased when objects, triggers or votes are added or removed so that
+     * results derived from them can be cached until the next change
+     */
+    uint64_t GetStateVersion() const {
+        LOCK(cs);
+        return nStateVersion;
+    }
+
+    void IncreaseStateVersion() {
+        LOCK(cs);
+        ++nStateVersion;
+    }
+
     int64_t GetLastDiffTime() { return nTimeLastDiff; }
     void UpdateLastDiffTime(int64_t nTimeIn) { nTimeLastDiff = nTimeIn; }
 
@@ -380,9 +431,15 @@ public:
         return fOK;
     }
 
-    void CheckMasternodeOrphanVotes();
+    /// Replay orphan votes from the given masternodes
+    void CheckMasternodeOrphanVotes(const std::vector<COutPoint>& vecMasternodes);
+
+    /// Replay orphan objects signed by the given masternodes
+    void CheckMasternodeOrphanObjects(const std::vector<COutPoint>& vecMasternodes);
 
-    void CheckMasternodeOrphanObjects();
+    /// Called before a vote from an unknown masternode is kept as an orphan,
+    /// returns false if the orphan limits have been reached
+    bool AddMasternodeOrphanVote(CNode* pfrom, const CGovernanceVote& vote);
 
     bool AreRateChecksEnabled() const {
         LOCK(cs);
@@ -419,6 +476,16 @@ private:
 
     void CheckOrphanVotes(CGovernanceObject& govobj, CGovernanceException& exception);
 
+    void CheckMasternodeOrphanVotes(CGovernanceObject& govobj, const COutPoint& outpointMasternode, int64_t nNow);
+
+    /// Returns true if the masternode orphan object can be dropped
+    bool CheckMasternodeOrphanObject(object_time_pair_t& pairObject, int64_t nNow);
+
+    /// Account for an orphan item relayed by pfrom, returns false if over the limits
+    bool AcceptOrphan(CNode* pfrom, const uint256& nHash, int64_t nExpirationTime);
+
+    void ForgetOrphan(const uint256& nHash);
+
     void RebuildIndexes();
 
     /// Returns MN index, handling the case of index rebuilds
@@ -25,6 +25,7 @@ extern CTxMemPool mempool;
 
 bool fEnableInstantSend = true;
 int nInstantSendDepth = DEFAULT_INSTANTSEND_DEPTH;
+int nInstantSendThreads = 0;
 int nCompleteTXLocks;
 
 CInstantSend instantsend;
@@ -57,12 +58,24 @@ void CInstantSend::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataSt
         CTxLockVote vote;
         vRecv >> vote;
 
-        LOCK2(cs_main, cs_instantsend);
-
         uint256 nVoteHash = vote.GetHash();
 
-        if(mapTxLockVotes.count(nVoteHash)) return;
-        mapTxLockVotes.insert(std::make_pair(nVoteHash, vote));
+        {
+            LOCK(cs_instantsend);
+            if(mapTxLockVotes.count(nVoteHash)) return;
+            mapTxLockVotes.insert(std::make_pair(nVoteHash, vote));
+        }
+
+        if(nInstantSendThreads > 0) {
+            // Ask the sender about unknown masternodes here, verification
+            // threads have no peer to ask
+            if(!mnodeman.Has(CTxIn(vote.GetMasternodeOutpoint()))) {
+                LogPrint("instantsend", "CInstantSend::ProcessMessage -- Unknown masternode %s\n", vote.GetMasternodeOutpoint().ToStringShort());
+                mnodeman.AskForMN(pfrom, CTxIn(vote.GetMasternodeOutpoint()));
+                return;
+            }
+            if(QueueTxLockVote(vote)) return;
+        }
 
         ProcessTxLockVote(pfrom, vote);
 
@@ -79,12 +92,12 @@ bool CInstantSend::ProcessTxLockRequest(const CTxLockRequest& txLockRequest)
     // Check to see if we conflict with existing completed lock,
     // fail if so, there can't be 2 completed locks for the same outpoint
     BOOST_FOREACH(const CTxIn& txin, txLockRequest.vin) {
-        std::map<COutPoint, uint256>::iterator it = mapLockedOutpoints.find(txin.prevout);
-        if(it != mapLockedOutpoints.end()) {
+        uint256 hashLocked;
+        if(txLockIndex.GetLockedOutPointTxHash(txin.prevout, hashLocked)) {
             // Conflicting with complete lock, ignore this one
             // (this could be the one we have but we don't want to try to lock it twice anyway)
             LogPrintf("CInstantSend::ProcessTxLockRequest -- WARNING: Found conflicting completed Transaction Lock, skipping current one, txid=%s, completed lock txid=%s\n",
-                    txLockRequest.GetHash().ToString(), it->second.ToString());
+                    txLockRequest.GetHash().ToString(), hashLocked.ToString());
             return false;
         }
     }
@@ -227,6 +240,7 @@ void CInstantSend::Vote(CTxLockCandidate& txLockCandidate)
         if(itOutpointLock->second.AddVote(vote)) {
             LogPrintf("CInstantSend::Vote -- Vote created successfully, relaying: txHash=%s, outpoint=%s, vote=%s\n",
                     txHash.ToString(), itOutpointLock->first.ToStringShort(), nVoteHash.ToString());
+            RecordLockStage(txLockCandidate, TXLOCK_STAGE_VOTE_CREATED);
 
             if(itVoted == mapVotedOutpoints.end()) {
                 std::set<uint256> setHashes;
@@ -261,6 +275,15 @@ bool CInstantSend::ProcessTxLockVote(CNode* pfrom, CTxLockVote& vote)
         return false;
     }
 
+    return ProcessValidTxLockVote(vote);
+}
+
+bool CInstantSend::ProcessValidTxLockVote(CTxLockVote& vote)
+{
+    LOCK2(cs_main, cs_instantsend);
+
+    uint256 txHash = vote.GetTxHash();
+
     // Masternodes will sometimes propagate votes before the transaction is known to the client,
     // will actually process only after the lock request itself has arrived
 
@@ -347,6 +370,7 @@ bool CInstantSend::ProcessTxLockVote(CNode* pfrom, CTxLockVote& vote)
         // this should never happen
         return false;
     }
+    RecordLockStage(txLockCandidate, TXLOCK_STAGE_VOTE_RECEIVED);
 
     int nSignatures = txLockCandidate.CountVotes();
     int nSignaturesMax = txLockCandidate.txLockRequest.GetMaxSignatures();
@@ -360,6 +384,97 @@ bool CInstantSend::ProcessTxLockVote(CNode* pfrom, CTxLockVote& vote)
     return true;
 }
 
+bool CInstantSend::QueueTxLockVote(const CTxLockVote& vote)
+{
+    boost::unique_lock<boost::mutex> lock(cs_verify);
+    if(dequeVotesToVerify.size() >= VERIFY_QUEUE_SIZE) {
+        // verification threads are behind, let the caller verify it
+        return false;
+    }
+    dequeVotesToVerify.push_back(vote);
+    condVerify.notify_one();
+    return true;
+}
+
+void CInstantSend::VerifyTxLockVotes()
+{
+    std::vector<CTxLockVote> vecVotes;
+    std::vector<CTxLockVote> vecValidVotes;
+    while(true) {
+        vecVotes.clear();
+        {
+            boost::unique_lock<boost::mutex> lock(cs_verify);
+            while(dequeVotesToVerify.empty()) {
+                condVerify.wait(lock); // interruption point
+            }
+            // Leave some votes to the other threads when the queue is short,
+            // votes for one lock request tend to arrive all at once
+            size_t nBatchSize = std::min(VERIFY_BATCH_SIZE, std::max<size_t>(1, dequeVotesToVerify.size() / nInstantSendThreads));
+            while(vecVotes.size() < nBatchSize && !dequeVotesToVerify.empty()) {
+                vecVotes.push_back(dequeVotesToVerify.front());
+                dequeVotesToVerify.pop_front();
+            }
+        }
+
+        // Masternode lookup, rank and signature checks don't need cs_instantsend
+        vecValidVotes.clear();
+        for(size_t i = 0; i < vecVotes.size(); ++i) {
+            if(!vecVotes[i].IsValid(NULL)) {
+                LogPrint("instantsend", "CInstantSend::VerifyTxLockVotes -- Vote is invalid, txid=%s\n", vecVotes[i].GetTxHash().ToString());
+                continue;
+            }
+            vecValidVotes.push_back(vecVotes[i]);
+        }
+
+        if(vecValidVotes.empty()) continue;
+
+        LOCK2(cs_main, cs_instantsend);
+        for(size_t i = 0; i < vecValidVotes.size(); ++i) {
+            ProcessValidTxLockVote(vecValidVotes[i]);
+        }
+    }
+}
+
+int CInstantSend::GetMasternodeRank(const COutPoint& outpointMasternode, int nBlockHeight)
+{
+    // Every vote for a lock request ranks the same masternode list at the same
+    // height, rank them once and reuse the result until the list changes
+    int nListVersion = mnodeman.GetListVersion();
+    int64_t nNow = GetTime();
+    {
+        LOCK(cs_ranks);
+        if(nListVersion != nRanksListVersion) {
+            mapMasternodeRanks.clear();
+            nRanksListVersion = nListVersion;
+        }
+        std::map<int, std::pair<int64_t, std::map<COutPoint, int> > >::iterator it = mapMasternodeRanks.find(nBlockHeight);
+        if(it != mapMasternodeRanks.end() && nNow - it->second.first < RANK_SNAPSHOT_SECONDS) {
+            std::map<COutPoint, int>::iterator itRank = it->second.second.find(outpointMasternode);
+            return itRank == it->second.second.end() ? -1 : itRank->second;
+        }
+    }
+
+    std::vector<std::pair<int, CMasternode> > vecMasternodeRanks = mnodeman.GetMasternodeRanks(nBlockHeight, MIN_INSTANTSEND_PROTO_VERSION);
+    if(vecMasternodeRanks.empty()) {
+        // unknown block or no masternodes, nothing worth keeping
+        return -1;
+    }
+
+    std::map<COutPoint, int> mapRanks;
+    for(size_t i = 0; i < vecMasternodeRanks.size(); ++i) {
+        mapRanks.insert(std::make_pair(vecMasternodeRanks[i].second.vin.prevout, vecMasternodeRanks[i].first));
+    }
+    std::map<COutPoint, int>::iterator itRank = mapRanks.find(outpointMasternode);
+    int nRank = itRank == mapRanks.end() ? -1 : itRank->second;
+
+    LOCK(cs_ranks);
+    // the list may have changed again while we were ranking it
+    if(nListVersion == nRanksListVersion) {
+        mapMasternodeRanks[nBlockHeight] = std::make_pair(nNow, mapRanks);
+    }
+    return nRank;
+}
+
 void CInstantSend::ProcessOrphanTxLockVotes()
 {
     LOCK2(cs_main, cs_instantsend);
@@ -412,6 +527,7 @@ void CInstantSend::TryToFinalizeLockCandidate(const CTxLockCandidate& txLockCand
     if(txLockCandidate.IsAllOutPointsReady() && !IsLockedInstantSendTransaction(txHash)) {
         // we have enough votes now
         LogPrint("instantsend", "CInstantSend::TryToFinalizeLockCandidate -- Transaction Lock is ready to complete, txid=%s\n", txHash.ToString());
+        RecordLockStage(txHash, TXLOCK_STAGE_QUORUM);
         if(ResolveConflicts(txLockCandidate, Params().GetConsensus().nInstantSendKeepLock)) {
             LockTransactionInputs(txLockCandidate);
             UpdateLockedTransaction(txLockCandidate);
@@ -442,9 +558,43 @@ void CInstantSend::UpdateLockedTransaction(const CTxLockCandidate& txLockCandida
 
     GetMainSignals().NotifyTransactionLock(txLockCandidate.txLockRequest);
 
+    RecordLockStage(txHash, TXLOCK_STAGE_LOCKED);
+
     LogPrint("instantsend", "CInstantSend::UpdateLockedTransaction -- done, txid=%s\n", txHash.ToString());
 }
 
+void CInstantSend::RecordLockStage(CTxLockCandidate& txLockCandidate, txlock_stage_enum_t eStage)
+{
+    AssertLockHeld(cs_instantsend);
+
+    // every vote is counted, other stages once per lock
+    int nStageBit = 1 << eStage;
+    if(eStage != TXLOCK_STAGE_VOTE_RECEIVED && (txLockCandidate.nStagesRecorded & nStageBit)) return;
+    txLockCandidate.nStagesRecorded |= nStageBit;
+
+    vLockLatency[eStage].Add(GetTimeMillis() - txLockCandidate.nTimeReceived);
+}
+
+void CInstantSend::RecordLockStage(const uint256& txHash, txlock_stage_enum_t eStage)
+{
+    AssertLockHeld(cs_instantsend);
+
+    std::map<uint256, CTxLockCandidate>::iterator it = mapTxLockCandidates.find(txHash);
+    if(it == mapTxLockCandidates.end()) return;
+    RecordLockStage(it->second, eStage);
+}
+
+void CInstantSend::GetLockLatency(std::vector<CLatencyHistogram>& vecLatencyRet, bool fReset)
+{
+    LOCK(cs_instantsend);
+
+    vecLatencyRet.assign(vLockLatency, vLockLatency + TXLOCK_STAGE_COUNT);
+    if(!fReset) return;
+    for(int i = 0; i < TXLOCK_STAGE_COUNT; ++i) {
+        vLockLatency[i].Clear();
+    }
+}
+
 void CInstantSend::LockTransactionInputs(const CTxLockCandidate& txLockCandidate)
 {
     LOCK(cs_instantsend);
@@ -453,22 +603,20 @@ void CInstantSend::LockTransactionInputs(const CTxLockCandidate& txLockCandidate
 
     if(!txLockCandidate.IsAllOutPointsReady()) return;
 
+    std::vector<COutPoint> vecOutpoints;
     std::map<COutPoint, COutPointLock>::const_iterator it = txLockCandidate.mapOutPointLocks.begin();
 
     while(it != txLockCandidate.mapOutPointLocks.end()) {
-        mapLockedOutpoints.insert(std::make_pair(it->first, txHash));
+        vecOutpoints.push_back(it->first);
         ++it;
     }
+    txLockIndex.LockOutpoints(txHash, vecOutpoints);
     LogPrint("instantsend", "CInstantSend::LockTransactionInputs -- done, txid=%s\n", txHash.ToString());
 }
 
 bool CInstantSend::GetLockedOutPointTxHash(const COutPoint& outpoint, uint256& hashRet)
 {
-    LOCK(cs_instantsend);
-    std::map<COutPoint, uint256>::iterator it = mapLockedOutpoints.find(outpoint);
-    if(it == mapLockedOutpoints.end()) return false;
-    hashRet = it->second;
-    return true;
+    return txLockIndex.GetLockedOutPointTxHash(outpoint, hashRet);
 }
 
 bool CInstantSend::ResolveConflicts(const CTxLockCandidate& txLockCandidate, int nMaxBlocks)
@@ -593,7 +741,7 @@ void CInstantSend::CheckAndRemove()
             LogPrintf("CInstantSend::CheckAndRemove -- Removing expired Transaction Lock Candidate: txid=%s\n", txHash.ToString());
             std::map<COutPoint, COutPointLock>::iterator itOutpointLock = txLockCandidate.mapOutPointLocks.begin();
             while(itOutpointLock != txLockCandidate.mapOutPointLocks.end()) {
-                mapLockedOutpoints.erase(itOutpointLock->first);
+                txLockIndex.UnlockOutpoint(itOutpointLock->first);
                 mapVotedOutpoints.erase(itOutpointLock->first);
                 ++itOutpointLock;
             }
@@ -641,6 +789,19 @@ void CInstantSend::CheckAndRemove()
             ++itMasternodeOrphan;
         }
     }
+
+    // remove outdated masternode rank snapshots
+    {
+        LOCK(cs_ranks);
+        std::map<int, std::pair<int64_t, std::map<COutPoint, int> > >::iterator itRanks = mapMasternodeRanks.begin();
+        while(itRanks != mapMasternodeRanks.end()) {
+            if(GetTime() - itRanks->second.first >= RANK_SNAPSHOT_SECONDS) {
+                mapMasternodeRanks.erase(itRanks++);
+            } else {
+                ++itRanks;
+            }
+        }
+    }
 }
 
 bool CInstantSend::AlreadyHave(const uint256& hash)
@@ -708,24 +869,9 @@ bool CInstantSend::IsLockedInstantSendTransaction(const uint256& txHash)
     if(!fEnableInstantSend || fLargeWorkForkFound || fLargeWorkInvalidChainFound ||
         !sporkManager.IsSporkActive(SPORK_2_INSTANTSEND_ENABLED)) return false;
 
-    LOCK(cs_instantsend);
-
-    // there must be a lock candidate
-    std::map<uint256, CTxLockCandidate>::iterator itLockCandidate = mapTxLockCandidates.find(txHash);
-    if(itLockCandidate == mapTxLockCandidates.end()) return false;
-
-    // which should have outpoints
-    if(itLockCandidate->second.mapOutPointLocks.empty()) return false;
-
-    // and all of these outputs must be included in mapLockedOutpoints with correct hash
-    std::map<COutPoint, COutPointLock>::iterator itOutpointLock = itLockCandidate->second.mapOutPointLocks.begin();
-    while(itOutpointLock != itLockCandidate->second.mapOutPointLocks.end()) {
-        uint256 hashLocked;
-        if(!GetLockedOutPointTxHash(itOutpointLock->first, hashLocked) || hashLocked != txHash) return false;
-        ++itOutpointLock;
-    }
-
-    return true;
+    // There must be a completed lock for all of the inputs of this tx,
+    // the index is kept up to date when locks complete or expire
+    return txLockIndex.IsTxLocked(txHash);
 }
 
 int CInstantSend::GetTransactionLockSignatures(const uint256& txHash)
@@ -941,6 +1087,100 @@ bool CTxLockRequest::IsTimedOut() const
     return GetTime() - nTimeCreated > TIMEOUT_SECONDS;
 }
 
+//
+// CLatencyHistogram
+//
+
+void CLatencyHistogram::Add(int64_t nMillis)
+{
+    if(nMillis < 0) nMillis = 0;
+
+    int nBucket = 0;
+    while(nBucket < BUCKETS - 1 && nMillis >= (int64_t(1) << nBucket)) {
+        ++nBucket;
+    }
+    ++vBuckets[nBucket];
+
+    if(nCount == 0 || nMillis < nMin) nMin = nMillis;
+    if(nCount == 0 || nMillis > nMax) nMax = nMillis;
+    nTotal += nMillis;
+    ++nCount;
+}
+
+void CLatencyHistogram::Clear()
+{
+    nCount = 0;
+    nTotal = 0;
+    nMin = 0;
+    nMax = 0;
+    for(int i = 0; i < BUCKETS; ++i) {
+        vBuckets[i] = 0;
+    }
+}
+
+int64_t CLatencyHistogram::GetPercentile(double dFraction) const
+{
+    if(nCount == 0) return 0;
+
+    int64_t nNeeded = std::max<int64_t>(1, (int64_t)(dFraction * nCount + 0.5));
+    int64_t nSeen = 0;
+    for(int i = 0; i < BUCKETS - 1; ++i) {
+        nSeen += vBuckets[i];
+        if(nSeen >= nNeeded) {
+            return std::min(int64_t(1) << i, nMax);
+        }
+    }
+    return nMax;
+}
+
+//
+// CTxLockIndex
+//
+
+void CTxLockIndex::LockOutpoints(const uint256& txHash, const std::vector<COutPoint>& vecOutpoints)
+{
+    if(vecOutpoints.empty()) return;
+
+    boost::unique_lock<boost::shared_mutex> lock(mutex);
+
+    bool fAllLocked = true;
+    for(size_t i = 0; i < vecOutpoints.size(); ++i) {
+        std::pair<outpoint_hash_m_t::iterator, bool> ret = mapLockedOutpoints.insert(std::make_pair(vecOutpoints[i], txHash));
+        if(!ret.second && ret.first->second != txHash) {
+            fAllLocked = false;
+        }
+    }
+    if(fAllLocked) {
+        setLockedTxs.insert(txHash);
+    }
+}
+
+void CTxLockIndex::UnlockOutpoint(const COutPoint& outpoint)
+{
+    boost::unique_lock<boost::shared_mutex> lock(mutex);
+
+    outpoint_hash_m_t::iterator it = mapLockedOutpoints.find(outpoint);
+    if(it == mapLockedOutpoints.end()) return;
+    setLockedTxs.erase(it->second);
+    mapLockedOutpoints.erase(it);
+}
+
+bool CTxLockIndex::GetLockedOutPointTxHash(const COutPoint& outpoint, uint256& hashRet) const
+{
+    boost::shared_lock<boost::shared_mutex> lock(mutex);
+
+    outpoint_hash_m_t::const_iterator it = mapLockedOutpoints.find(outpoint);
+    if(it == mapLockedOutpoints.end()) return false;
+    hashRet = it->second;
+    return true;
+}
+
+bool CTxLockIndex::IsTxLocked(const uint256& txHash) const
+{
+    boost::shared_lock<boost::shared_mutex> lock(mutex);
+    return setLockedTxs.count(txHash) > 0;
+}
+
 //
 // CTxLockVote
 //
@@ -976,7 +1216,7 @@ bool CTxLockVote::IsValid(CNode* pnode) const
 
     int nLockInputHeight = nPrevoutHeight + 4;
 
-    int n = mnodeman.GetMasternodeRank(CTxIn(outpointMasternode), nLockInputHeight, MIN_INSTANTSEND_PROTO_VERSION);
+    int n = instantsend.GetMasternodeRank(outpointMasternode, nLockInputHeight);
 
     if(n == -1) {
         //can be caused by past versions trying to vote with an invalid protocol
@@ -1158,3 +1398,9 @@ void CTxLockCandidate::Relay() const
         ++itOutpointLock;
     }
 }
+
+void ThreadInstantSendVerify()
+{
+    RenameThread("onex-isverify");
+    instantsend.VerifyTxLockVotes();
+}
@@ -4,13 +4,24 @@
 #ifndef INSTANTX_H
 #define INSTANTX_H
 
+#include "cachemap.h"
+#include "coins.h"
 #include "net.h"
 #include "primitives/transaction.h"
+#include "sync.h"
 
+#include <deque>
+
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+
+class CBlockIndex;
 class CTxLockVote;
 class COutPointLock;
 class CTxLockRequest;
 class CTxLockCandidate;
+class CTxLockIndex;
 class CInstantSend;
 
 extern CInstantSend instantsend;
@@ -29,18 +40,122 @@ static const int DEFAULT_INSTANTSEND_DEPTH          = 5;
 
 static const int MIN_INSTANTSEND_PROTO_VERSION      = 70206;
 
+/** -instantsendthreads default (number of vote verification threads, 0 = verify on the message handler thread) */
+static const int DEFAULT_INSTANTSEND_THREADS        = 2;
+/** Maximum number of vote verification threads */
+static const int MAX_INSTANTSEND_THREADS            = 16;
+
 extern bool fEnableInstantSend;
 extern int nInstantSendDepth;
+extern int nInstantSendThreads;
 extern int nCompleteTXLocks;
 
+/** Run instances of this on the threads which verify InstantSend votes */
+void ThreadInstantSendVerify();
+
+/** Stages of a transaction lock, timed from the arrival of the lock request */
+enum txlock_stage_enum_t {
+    TXLOCK_STAGE_VOTE_CREATED   = 0, // our own vote was created (masternodes only)
+    TXLOCK_STAGE_VOTE_RECEIVED  = 1, // a vote was counted, recorded for every vote
+    TXLOCK_STAGE_QUORUM         = 2, // all outpoints have enough votes
+    TXLOCK_STAGE_LOCKED         = 3, // inputs are locked and the wallet was notified
+    TXLOCK_STAGE_COUNT          = 4
+};
+
+/**
+ * Latencies in milliseconds counted in power of two buckets,
+ * bucket i holds latencies below 2^i ms
+ */
+class CLatencyHistogram
+{
+public:
+    static const int BUCKETS = 20;
+
+private:
+    int64_t nCount;
+    int64_t nTotal;
+    int64_t nMin;
+    int64_t nMax;
+    int64_t vBuckets[BUCKETS];
+
+public:
+    CLatencyHistogram() { Clear(); }
+
+    void Add(int64_t nMillis);
+    void Clear();
+
+    int64_t GetCount() const { return nCount; }
+    int64_t GetMin() const { return nMin; }
+    int64_t GetMax() const { return nMax; }
+    int64_t GetAverage() const { return nCount ? nTotal / nCount : 0; }
+    /// Upper bound of the bucket holding the given fraction of the samples, capped by the max
+    int64_t GetPercentile(double dFraction) const;
+};
+
+/**
+ * Completed transaction locks, i.e. locked outpoints and the transactions
+ * which have all of their inputs locked.
+ *
+ * Written by CInstantSend when a lock completes or expires, read by the
+ * mempool, block validation and wallet code. Readers share the lock and
+ * never wait for cs_instantsend.
+ */
+class CTxLockIndex
+{
+private:
+    typedef boost::unordered_map<COutPoint, uint256, COutPointKeyHasher> outpoint_hash_m_t;
+    typedef boost::unordered_set<uint256, CacheKeyHasher<uint256> > hash_s_t;
+
+    mutable boost::shared_mutex mutex;
+
+    outpoint_hash_m_t mapLockedOutpoints; // utxo - tx hash
+    hash_s_t setLockedTxs; // fully locked tx hashes
+
+public:
+    CTxLockIndex() :
+        mutex(),
+        mapLockedOutpoints(),
+        setLockedTxs()
+        {}
+
+    /// Lock outpoints for txHash, the tx is fully locked only if none of them was locked by another tx
+    void LockOutpoints(const uint256& txHash, const std::vector<COutPoint>& vecOutpoints);
+    /// Unlock an outpoint, whichever tx it was locked for is no longer fully locked
+    void UnlockOutpoint(const COutPoint& outpoint);
+
+    bool GetLockedOutPointTxHash(const COutPoint& outpoint, uint256& hashRet) const;
+    bool IsTxLocked(const uint256& txHash) const;
+};
+
 class CInstantSend
 {
 private:
     static const int ORPHAN_VOTE_SECONDS            = 60;
+    // How long masternode ranks for a quorum height are reused at most,
+    // they are dropped earlier whenever the masternode list changes
+    static const int RANK_SNAPSHOT_SECONDS          = 60;
+    // Max number of votes a verification thread takes at once
+    static const size_t VERIFY_BATCH_SIZE           = 32;
+    // Max number of votes waiting for verification, further votes are verified in place
+    static const size_t VERIFY_QUEUE_SIZE           = 10000;
 
     // Keep track of current block index
     const CBlockIndex *pCurrentBlockIndex;
 
+    // votes waiting for verification on the worker threads
+    CWaitableCriticalSection cs_verify;
+    CConditionVariable condVerify;
+    std::deque<CTxLockVote> dequeVotesToVerify;
+
+    // masternode ranks per quorum height - (time created, mn outpoint - rank)
+    CCriticalSection cs_ranks;
+    std::map<int, std::pair<int64_t, std::map<COutPoint, int> > > mapMasternodeRanks;
+    // masternode list version the rank snapshots were taken at
+    int nRanksListVersion;
+
+    // lock latency per stage, protected by cs_instantsend
+    CLatencyHistogram vLockLatency[TXLOCK_STAGE_COUNT];
+
     // maps for AlreadyHave
     std::map<uint256, CTxLockRequest> mapLockRequestAccepted; // tx hash - tx
     std::map<uint256, CTxLockRequest> mapLockRequestRejected; // tx hash - tx
@@ -50,7 +165,8 @@ private:
     std::map<uint256, CTxLockCandidate> mapTxLockCandidates; // tx hash - lock candidate
 
     std::map<COutPoint, std::set<uint256> > mapVotedOutpoints; // utxo - tx hash set
-    std::map<COutPoint, uint256> mapLockedOutpoints; // utxo - tx hash
+
+    CTxLockIndex txLockIndex;
 
     //track masternodes who voted with no txreq (for DOS protection)
     std::map<COutPoint, int64_t> mapMasternodeOrphanVotes; // mn outpoint - time
@@ -60,6 +176,8 @@ private:
 
     //process consensus vote message
     bool ProcessTxLockVote(CNode* pfrom, CTxLockVote& vote);
+    bool ProcessValidTxLockVote(CTxLockVote& vote);
+    bool QueueTxLockVote(const CTxLockVote& vote);
     void ProcessOrphanTxLockVotes();
     bool IsEnoughOrphanVotesForTx(const CTxLockRequest& txLockRequest);
     bool IsEnoughOrphanVotesForTxAndOutPoint(const uint256& txHash, const COutPoint& outpoint);
@@ -73,6 +191,9 @@ private:
 
     bool IsInstantSendReadyToLock(const uint256 &txHash);
 
+    void RecordLockStage(CTxLockCandidate& txLockCandidate, txlock_stage_enum_t eStage);
+    void RecordLockStage(const uint256& txHash, txlock_stage_enum_t eStage);
+
 public:
     CCriticalSection cs_instantsend;
 
@@ -91,6 +212,12 @@ public:
 
     bool GetLockedOutPointTxHash(const COutPoint& outpoint, uint256& hashRet);
 
+    // rank of the masternode among enabled ones at nBlockHeight, -1 if unknown
+    int GetMasternodeRank(const COutPoint& outpointMasternode, int nBlockHeight);
+
+    // verify queued votes and apply the valid ones in batches, never returns
+    void VerifyTxLockVotes();
+
     // verify if transaction is currently locked
     bool IsLockedInstantSendTransaction(const uint256& txHash);
     // get the actual uber og accepted lock signatures
@@ -105,6 +232,9 @@ public:
 
     void UpdatedBlockTip(const CBlockIndex *pindex);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+
+    // copy of the lock latency histograms, optionally starting over
+    void GetLockLatency(std::vector<CLatencyHistogram>& vecLatencyRet, bool fReset = false);
 };
 
 class CTxLockRequest : public CTransaction
@@ -224,10 +354,16 @@ private:
 public:
     CTxLockCandidate(const CTxLockRequest& txLockRequestIn) :
         nConfirmedHeight(-1),
+        nTimeReceived(GetTimeMillis()),
+        nStagesRecorded(0),
         txLockRequest(txLockRequestIn),
         mapOutPointLocks()
         {}
 
+    // local memory only, for latency stats
+    int64_t nTimeReceived; // ms
+    int nStagesRecorded; // bit per txlock_stage_enum_t
+
     CTxLockRequest txLockRequest;
     std::map<COutPoint, COutPointLock> mapOutPointLocks;
 
@@ -77,6 +77,7 @@ bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = true;
 bool fAddressIndex = false;
+bool fAddressBalanceIndex = false;
 bool fTimestampIndex = false;
 bool fSpentIndex = false;
 bool fHavePruned = false;
@@ -1564,29 +1565,119 @@ bool GetSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value)
 }
 
 bool GetAddressIndex(uint160 addressHash, int type,
-                     std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex, int start, int end)
+                     std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex, int start, int end,
+                     const CAddressIndexKey* pkeyAfter, size_t nLimit)
 {
     if (!fAddressIndex)
         return error("address index not enabled");
 
-    if (!pblocktree->ReadAddressIndex(addressHash, type, addressIndex, start, end))
+    if (!pblocktree->ReadAddressIndex(addressHash, type, addressIndex, start, end, pkeyAfter, nLimit))
         return error("unable to get txids for address");
 
     return true;
 }
 
 bool GetAddressUnspent(uint160 addressHash, int type,
-                       std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs)
+                       std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs,
+                       const CAddressUnspentKey* pkeyAfter, size_t nLimit)
 {
     if (!fAddressIndex)
         return error("address index not enabled");
 
-    if (!pblocktree->ReadAddressUnspentIndex(addressHash, type, unspentOutputs))
+    if (!pblocktree->ReadAddressUnspentIndex(addressHash, type, unspentOutputs, pkeyAfter, nLimit))
         return error("unable to get txids for address");
 
     return true;
 }
 
+bool GetAddressBalance(uint160 addressHash, int type, CAddressBalanceValue &value)
+{
+    if (!fAddressBalanceIndex)
+        return error("address balance index not enabled");
+
+    // an address without an entry has never been used
+    if (!pblocktree->ReadAddressBalanceIndex(addressHash, type, value))
+        value.SetNull();
+
+    return true;
+}
+
+/** Height of the last block below nHeight with address index entries for the address, 0 if there is none */
+static int FindLastAddressHeight(uint160 addressHash, int type, int nHeight)
+{
+    // look back in growing windows, active addresses are found in the first one
+    for (int nWindow = 16; nHeight > 1; nWindow *= 2) {
+        int nStart = std::max(1, nHeight - nWindow);
+        std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+        pblocktree->ReadAddressIndex(addressHash, type, addressIndex, nStart, nHeight - 1);
+        if (!addressIndex.empty())
+            return addressIndex.back().first.blockHeight;
+        if (nStart == 1)
+            break;
+    }
+    return 0;
+}
+
+/**
+ * Last block whose address index entries are in the address balance index. The
+ * index is written before the coins, so after a crash the blocks up to it are
+ * connected again and must not be counted twice.
+ */
+static const CBlockIndex* pindexAddressBalanceBest = NULL;
+
+/** Whether the deltas of a block are in the address balance index already */
+static bool AddressBalancesApplied(const CBlockIndex* pindex)
+{
+    return pindexAddressBalanceBest && pindexAddressBalanceBest->GetAncestor(pindex->nHeight) == pindex;
+}
+
+/**
+ * Add the address index entries of a block to the address balance index, or
+ * take them out again when the block is disconnected. The entries of a tx are
+ * adjacent, which is used to count each tx once per address.
+ */
+static bool UpdateAddressBalances(const std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex, int nHeight, bool fDisconnect)
+{
+    std::map<std::pair<unsigned int, uint160>, CAddressBalanceValue> mapDelta;
+    std::map<std::pair<unsigned int, uint160>, uint256> mapLastTx;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = addressIndex.begin(); it != addressIndex.end(); ++it) {
+        std::pair<unsigned int, uint160> address(it->first.type, it->first.hashBytes);
+        CAddressBalanceValue& delta = mapDelta[address];
+        delta.balance += it->second;
+        if (it->second > 0)
+            delta.received += it->second;
+        uint256& hashLastTx = mapLastTx[address];
+        if (hashLastTx != it->first.txhash) {
+            hashLastTx = it->first.txhash;
+            delta.nTxCount++;
+        }
+    }
+
+    std::vector<std::pair<CAddressIndexIteratorKey, CAddressBalanceValue> > vBalances;
+    vBalances.reserve(mapDelta.size());
+    for (std::map<std::pair<unsigned int, uint160>, CAddressBalanceValue>::const_iterator it = mapDelta.begin(); it != mapDelta.end(); ++it) {
+        const CAddressBalanceValue& delta = it->second;
+        CAddressBalanceValue value;
+        if (!pblocktree->ReadAddressBalanceIndex(it->first.second, it->first.first, value))
+            value.SetNull();
+        if (!fDisconnect) {
+            value.balance += delta.balance;
+            value.received += delta.received;
+            value.nTxCount += delta.nTxCount;
+            value.nLastHeight = nHeight;
+        } else {
+            value.balance -= delta.balance;
+            value.received -= delta.received;
+            value.nTxCount -= delta.nTxCount;
+            if (value.nTxCount > 0 && value.nLastHeight >= nHeight)
+                value.nLastHeight = FindLastAddressHeight(it->first.second, it->first.first, nHeight);
+        }
+        vBalances.push_back(make_pair(CAddressIndexIteratorKey(it->first.first, it->first.second), value));
+    }
+
+    return pblocktree->UpdateAddressBalanceIndex(vBalances);
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1962,7 +2053,7 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
 
 bool CScriptCheck::operator()() {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore), &error)) {
+    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore, txdata.get()), &error)) {
         return false;
     }
     return true;
@@ -2039,13 +2130,19 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // Serialize the parts of the signature hash common to all inputs
+            // only once instead of once per input
+            boost::shared_ptr<const PrecomputedTransactionData> txdata;
+            if (tx.vin.size() > 1)
+                txdata.reset(new PrecomputedTransactionData(tx));
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
                 const CCoins* coins = inputs.AccessCoins(prevout.hash);
                 assert(coins);
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(*coins, tx, i, flags, cacheStore, txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2058,7 +2155,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
                         CScriptCheck check2(*coins, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
+                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -2329,6 +2426,13 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
         if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
             return AbortNode(state, "Failed to write address unspent index");
         }
+        if (fAddressBalanceIndex) {
+            if (pindexAddressBalanceBest != pindex)
+                return AbortNode(state, "Address balance index does not match the chainstate, you need to rebuild the database using -reindex");
+            if (!UpdateAddressBalances(addressIndex, pindex->nHeight, true))
+                return AbortNode(state, "Failed to write address balance index");
+            pindexAddressBalanceBest = pindex->pprev;
+        }
     }
 
     return fClean;
@@ -2359,11 +2463,124 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+/** Worker threads shared by the parallel parts of validation */
+static CWorkerPool validationpool(MAX_SCRIPTCHECK_THREADS);
+static CCheckQueue<CScriptCheck> scriptcheckqueue(validationpool, 128);
 
 void ThreadScriptCheck() {
     RenameThread("onex-scriptch");
-    scriptcheckqueue.Thread();
+    validationpool.Thread();
+}
+
+namespace {
+
+/** Read the coins of one txid from the database into a slot owned by the caller */
+class CCoinsPrefetch
+{
+private:
+    const CCoinsViewCache *pview;
+    uint256 txid;
+    CCoins *pcoins;
+
+public:
+    CCoinsPrefetch() : pview(NULL), pcoins(NULL) {}
+    CCoinsPrefetch(const CCoinsViewCache *pviewIn, const uint256 &txidIn, CCoins *pcoinsIn) :
+        pview(pviewIn), txid(txidIn), pcoins(pcoinsIn) {}
+
+    bool operator()() {
+        try {
+            pview->GetCoinsFromBase(txid, *pcoins);
+        } catch (const std::exception& e) {
+            // ConnectBlock reads it again and handles the error
+            LogPrint("bench", "%s: %s\n", __func__, e.what());
+        }
+        return true;
+    }
+
+    void swap(CCoinsPrefetch &check) {
+        std::swap(pview, check.pview);
+        std::swap(txid, check.txid);
+        std::swap(pcoins, check.pcoins);
+    }
+};
+
+} // anon namespace
+
+static CCheckQueue<CCoinsPrefetch> prefetchqueue(validationpool, 16);
+
+namespace {
+
+/** Check the proof of work of one header and keep its hash for later use */
+class CHeaderPoWCheck
+{
+private:
+    const CBlockHeader *pheader;
+    uint256 *phash;
+
+public:
+    CHeaderPoWCheck() : pheader(NULL), phash(NULL) {}
+    CHeaderPoWCheck(const CBlockHeader *pheaderIn, uint256 *phashIn) : pheader(pheaderIn), phash(phashIn) {}
+
+    bool operator()() {
+        *phash = pheader->GetHash();
+        return CheckProofOfWork(*phash, pheader->nBits, Params().GetConsensus());
+    }
+
+    void swap(CHeaderPoWCheck &check) {
+        std::swap(pheader, check.pheader);
+        std::swap(phash, check.phash);
+    }
+};
+
+} // anon namespace
+
+static CCheckQueue<CHeaderPoWCheck> headercheckqueue(validationpool, 8);
+
+/**
+ * Warm pcoinsTip with the coins spent by a block before it is connected. The
+ * lookups of all inputs not created in the block itself are done in parallel,
+ * instead of one blocking database read per input during ConnectBlock.
+ */
+static void PrefetchBlockInputs(const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    if (!nScriptCheckThreads)
+        return;
+
+    int64_t nTimeStart = GetTimeMicros();
+    std::set<uint256> setBlockTxids;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        setBlockTxids.insert(tx.GetHash());
+
+    std::set<uint256> setMissing;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            const uint256& hash = txin.prevout.hash;
+            if (!setBlockTxids.count(hash) && !pcoinsTip->HaveCoinsInCache(hash))
+                setMissing.insert(hash);
+        }
+    }
+    if (setMissing.empty())
+        return;
+
+    std::vector<uint256> vTxid(setMissing.begin(), setMissing.end());
+    std::vector<CCoins> vCoins(vTxid.size());
+    std::vector<CCoinsPrefetch> vChecks;
+    vChecks.reserve(vTxid.size());
+    for (unsigned int i = 0; i < vTxid.size(); i++)
+        vChecks.push_back(CCoinsPrefetch(pcoinsTip, vTxid[i], &vCoins[i]));
+
+    CCheckQueueControl<CCoinsPrefetch> control(&prefetchqueue);
+    control.Add(vChecks);
+    control.Wait();
+
+    unsigned int nAdded = 0;
+    for (unsigned int i = 0; i < vTxid.size(); i++)
+        if (pcoinsTip->AddPrefetchedCoins(vTxid[i], vCoins[i]))
+            nAdded++;
+    LogPrint("bench", "    - Prefetch %u of %u input txs: %.2fms\n", nAdded, (unsigned int)vTxid.size(), 0.001 * (GetTimeMicros() - nTimeStart));
 }
 
 //
@@ -2759,6 +2976,16 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         return state.DoS(100, false);
     int64_t nTime4 = GetTimeMicros(); nTimeVerify += nTime4 - nTime2;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime4 - nTime2), nInputs <= 1 ? 0 : 0.001 * (nTime4 - nTime2) / (nInputs-1), nTimeVerify * 0.000001);
+    if (nScriptCheckThreads && LogAcceptCategory("bench")) {
+        CWorkerPoolStats stats = validationpool.GetStats();
+        LogPrint("bench", "    - Workers: %d, jobs %u, steals %u, contended %u, sleeps %u, utilization %.1f%%\n",
+                 stats.nWorkers, stats.nJobs, stats.nSteals, stats.nContended, stats.nSleeps, 100.0 * stats.Utilization());
+    }
+    if (LogAcceptCategory("bench")) {
+        CCuckooCacheStats stats = GetSignatureCacheStats();
+        LogPrint("bench", "    - Signature cache: %u slots, hit rate %.1f%%, %u inserts, %u evicted\n",
+                 stats.nSlots, 100.0 * stats.HitRate(), stats.nInserts, stats.nEvictions);
+    }
 
     if (fJustCheck)
         return true;
@@ -2794,6 +3021,16 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
             return AbortNode(state, "Failed to write address unspent index");
         }
+
+        if (fAddressBalanceIndex) {
+            if (AddressBalancesApplied(pindex)) {
+                LogPrint("coindb", "%s: address balances of block %s are indexed already\n", __func__, pindex->GetBlockHash().ToString());
+            } else {
+                if (!UpdateAddressBalances(addressIndex, pindex->nHeight, false))
+                    return AbortNode(state, "Failed to write address balance index");
+                pindexAddressBalanceBest = pindex;
+            }
+        }
     }
 
     if (fSpentIndex)
@@ -2865,7 +3102,8 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     if (nLastSetChain == 0) {
         nLastSetChain = nNow;
     }
-    size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+    // Buffered index writes and coins still being written in the background count against the same limit
+    size_t cacheSize = pcoinsTip->DynamicMemoryUsage() + pcoinsTip->PendingWriteUsage() + pblocktree->PendingIndexUsage();
     // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
     bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCoinCacheUsage;
     // The cache is over the limit, we have to write now.
@@ -2897,7 +3135,11 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
                 vBlocks.push_back(*it);
                 setDirtyBlockIndex.erase(it++);
             }
-            if (!pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks)) {
+            // Buffered index writes go first, so the indexes on disk are never behind
+            // the coins. Blocks connected again after a crash rewrite the same tx, address
+            // and spent index entries; the balance index skips the blocks up to the
+            // recorded index best block instead of adding their deltas twice.
+            if (!pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks, pcoinsTip->GetBestBlock())) {
                 return AbortNode(state, "Files to write to block index database");
             }
         }
@@ -3461,10 +3703,10 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex *pindex) {
     return true;
 }
 
-CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
+CBlockIndex* AddToBlockIndex(const CBlockHeader& block, const uint256* phash = NULL)
 {
     // Check for duplicate
-    uint256 hash = block.GetHash();
+    uint256 hash = phash ? *phash : block.GetHash();
     BlockMap::iterator it = mapBlockIndex.find(hash);
     if (it != mapBlockIndex.end())
         return it->second;
@@ -3838,11 +4080,12 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+/** If phash is given it is the hash of block, and its proof of work was checked already */
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL, const uint256* phash=NULL)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
-    uint256 hash = block.GetHash();
+    uint256 hash = phash ? *phash : block.GetHash();
     BlockMap::iterator miSelf = mapBlockIndex.find(hash);
     CBlockIndex *pindex = NULL;
 
@@ -3859,7 +4102,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return true;
         }
 
-        if (!CheckBlockHeader(block, state))
+        if (!CheckBlockHeader(block, state, phash == NULL))
             return false;
 
         // Get prev block index
@@ -3879,7 +4122,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return false;
     }
     if (pindex == NULL)
-        pindex = AddToBlockIndex(block);
+        pindex = AddToBlockIndex(block, &hash);
 
     if (ppindex)
         *ppindex = pindex;
@@ -3986,6 +4229,10 @@ bool ProcessNewBlock(CValidationState& state, const CChainParams& chainparams, c
         CheckBlockIndex(chainparams.GetConsensus());
         if (!ret)
             return error("%s: AcceptBlock FAILED", __func__);
+
+        // only a block about to be connected is worth the cache space
+        if (pindex && pindex->pprev == chainActive.Tip())
+            PrefetchBlockInputs(*pblock);
     }
 
     if (!ActivateBestChain(state, chainparams, pblock))
@@ -4293,6 +4540,10 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("addressindex", fAddressIndex);
     LogPrintf("%s: address index %s\n", __func__, fAddressIndex ? "enabled" : "disabled");
 
+    // Check whether we have an address balance index
+    pblocktree->ReadFlag("addressbalanceindex", fAddressBalanceIndex);
+    LogPrintf("%s: address balance index %s\n", __func__, fAddressBalanceIndex ? "enabled" : "disabled");
+
     // Check whether we have a timestamp index
     pblocktree->ReadFlag("timestampindex", fTimestampIndex);
     LogPrintf("%s: timestamp index %s\n", __func__, fTimestampIndex ? "enabled" : "disabled");
@@ -4307,6 +4558,20 @@ bool static LoadBlockIndexDB()
         return true;
     chainActive.SetTip(it->second);
 
+    // Indexes are written before the coins, blocks after the coins tip get connected again
+    uint256 hashIndexBestBlock;
+    pindexAddressBalanceBest = chainActive.Tip();
+    if (pblocktree->ReadIndexBestBlock(hashIndexBestBlock) && hashIndexBestBlock != chainActive.Tip()->GetBlockHash()) {
+        LogPrintf("%s: indexes were last written at block %s, ahead of the chainstate\n", __func__, hashIndexBestBlock.ToString());
+        // the balance index adds up deltas, it skips the blocks it has seen when they are connected again
+        if (fAddressBalanceIndex) {
+            BlockMap::iterator mi = mapBlockIndex.find(hashIndexBestBlock);
+            if (mi == mapBlockIndex.end() || mi->second->GetAncestor(chainActive.Height()) != chainActive.Tip())
+                return error("%s: address balance index does not extend the chainstate, you need to rebuild the database using -reindex", __func__);
+            pindexAddressBalanceBest = mi->second;
+        }
+    }
+
     PruneBlockIndexCandidates();
 
     LogPrintf("%s: hashBestChain=%s height=%d date=%s progress=%f\n", __func__,
@@ -4412,6 +4677,7 @@ void UnloadBlockIndex()
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
+    pindexAddressBalanceBest = NULL;
     mempool.clear();
     mapOrphanTransactions.clear();
     mapOrphanTransactionsByPrev.clear();
@@ -4466,6 +4732,10 @@ bool InitBlockIndex(const CChainParams& chainparams)
     fAddressIndex = GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX);
     pblocktree->WriteFlag("addressindex", fAddressIndex);
 
+    // Use the provided setting for -addressbalanceindex in the new database
+    fAddressBalanceIndex = fAddressIndex && GetBoolArg("-addressbalanceindex", DEFAULT_ADDRESSBALANCEINDEX);
+    pblocktree->WriteFlag("addressbalanceindex", fAddressBalanceIndex);
+
     // Use the provided setting for -timestampindex in the new database
     fTimestampIndex = GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX);
     pblocktree->WriteFlag("timestampindex", fTimestampIndex);
@@ -5910,6 +6180,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Hash the headers and check their proof of work in parallel, before
+        // taking cs_main. If any fails, the checks below run in full and
+        // report the offending header.
+        std::vector<uint256> vHashes;
+        if (nScriptCheckThreads && nCount > 1) {
+            vHashes.resize(nCount);
+            std::vector<CHeaderPoWCheck> vChecks;
+            vChecks.reserve(nCount);
+            for (unsigned int n = 0; n < nCount; n++)
+                vChecks.push_back(CHeaderPoWCheck(&headers[n], &vHashes[n]));
+            CCheckQueueControl<CHeaderPoWCheck> control(&headercheckqueue);
+            control.Add(vChecks);
+            if (!control.Wait())
+                vHashes.clear();
+        }
+
         LOCK(cs_main);
 
         if (nCount == 0) {
@@ -5918,13 +6204,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         CBlockIndex *pindexLast = NULL;
-        BOOST_FOREACH(const CBlockHeader& header, headers) {
+        for (unsigned int n = 0; n < nCount; n++) {
+            const CBlockHeader& header = headers[n];
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
-            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast)) {
+            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast, vHashes.empty() ? NULL : &vHashes[n])) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
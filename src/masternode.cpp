@@ -124,6 +124,8 @@ bool CMasternode::UpdateFromNewBroadcast(CMasternodeBroadcast& mnb)
         lastPing = mnb.lastPing;
         mnodeman.mapSeenMasternodePing.insert(std::make_pair(lastPing.GetHash(), lastPing));
     }
+    // keys or protocol version may have changed even if the state did not
+    mnodeman.NotifyMasternodeChanged(vin.prevout);
     // if it matches our Masternode privkey...
     if(fMasterNode && pubKeyMasternode == activeMasternode.pubKeyMasternode) {
         nPoSeBanScore = -MASTERNODE_POSE_BAN_MAX_SCORE;
@@ -165,6 +167,15 @@ void CMasternode::Check(bool fForce)
 {
     LOCK(cs);
 
+    int nActiveStatePrev = nActiveState;
+    CheckState(fForce);
+    if(nActiveState != nActiveStatePrev) {
+        mnodeman.NotifyMasternodeChanged(vin.prevout);
+    }
+}
+
+void CMasternode::CheckState(bool fForce)
+{
     if(ShutdownRequested()) return;
 
     if(!fForce && (GetTime() - nTimeLastChecked < MASTERNODE_CHECK_SECONDS)) return;
@@ -110,9 +110,10 @@ CMasternodeMan::CMasternodeMan()
   indexMasternodes(),
   indexMasternodesOld(),
   fIndexRebuilt(false),
-  fMasternodesAdded(false),
+  vecMasternodesChanged(),
   fMasternodesRemoved(false),
   vecDirtyGovernanceObjectHashes(),
+  nListVersion(0),
   nLastWatchdogVoteTime(0),
   mapSeenMasternodeBroadcast(),
   mapSeenMasternodePing(),
@@ -128,7 +129,8 @@ bool CMasternodeMan::Add(CMasternode &mn)
         LogPrint("masternode", "CMasternodeMan::Add -- Adding new Masternode: addr=%s, %i now\n", mn.addr.ToString(), size() + 1);
         vMasternodes.push_back(mn);
         indexMasternodes.AddMasternodeVIN(mn.vin);
-        fMasternodesAdded = true;
+        vecMasternodesChanged.push_back(mn.vin.prevout);
+        nListVersion++;
         return true;
     }
 
@@ -208,6 +210,7 @@ void CMasternodeMan::CheckAndRemove()
                 it->FlagGovernanceItemsAsDirty();
                 it = vMasternodes.erase(it);
                 fMasternodesRemoved = true;
+                nListVersion++;
             } else {
                 bool fAsk = pCurrentBlockIndex &&
                             (nAskForMnbRecovery > 0) &&
@@ -358,9 +361,7 @@ void CMasternodeMan::CheckAndRemove()
         }
     }
 
-    if(fMasternodesRemoved) {
-        NotifyMasternodeUpdates();
-    }
+    NotifyMasternodeUpdates();
 }
 
 void CMasternodeMan::Clear()
@@ -376,6 +377,7 @@ void CMasternodeMan::Clear()
     nLastWatchdogVoteTime = 0;
     indexMasternodes.Clear();
     indexMasternodesOld.Clear();
+    nListVersion++;
 }
 
 int CMasternodeMan::CountMasternodes(int nProtocolVersion)
@@ -823,9 +825,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             Misbehaving(pfrom->GetId(), nDos);
         }
 
-        if(fMasternodesAdded) {
-            NotifyMasternodeUpdates();
-        }
+        NotifyMasternodeUpdates();
     } else if (strCommand == NetMsgType::MNPING) { //Masternode Ping
 
         CMasternodePing mnp;
@@ -1654,26 +1654,34 @@ void CMasternodeMan::UpdatedBlockTip(const CBlockIndex *pindex)
     }
 }
 
+void CMasternodeMan::NotifyMasternodeChanged(const COutPoint& outpoint)
+{
+    LOCK(cs);
+    nListVersion++;
+    // orphans signed by this masternode may be valid now
+    vecMasternodesChanged.push_back(outpoint);
+}
+
 void CMasternodeMan::NotifyMasternodeUpdates()
 {
     // Avoid double locking
-    bool fMasternodesAddedLocal = false;
     bool fMasternodesRemovedLocal = false;
+    std::vector<COutPoint> vecMasternodesChangedLocal;
     {
         LOCK(cs);
-        fMasternodesAddedLocal = fMasternodesAdded;
         fMasternodesRemovedLocal = fMasternodesRemoved;
+        vecMasternodesChangedLocal.swap(vecMasternodesChanged);
     }
 
-    if(fMasternodesAddedLocal) {
-        governance.CheckMasternodeOrphanObjects();
-        governance.CheckMasternodeOrphanVotes();
+    if(!vecMasternodesChangedLocal.empty()) {
+        // Only orphans waiting for one of the new or changed masternodes are replayed
+        governance.CheckMasternodeOrphanObjects(vecMasternodesChangedLocal);
+        governance.CheckMasternodeOrphanVotes(vecMasternodesChangedLocal);
     }
     if(fMasternodesRemovedLocal) {
         governance.UpdateCachesAndClean();
     }
 
     LOCK(cs);
-    fMasternodesAdded = false;
     fMasternodesRemoved = false;
 }
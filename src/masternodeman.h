@@ -142,14 +142,17 @@ private:
     /// Set when index has been rebuilt, clear when read
     bool fIndexRebuilt;
 
-    /// Set when masternodes are added, cleared when CGovernanceManager is notified
-    bool fMasternodesAdded;
+    /// Masternodes added, updated or changing their state since CGovernanceManager was last notified
+    std::vector<COutPoint> vecMasternodesChanged;
 
     /// Set when masternodes are removed, cleared when CGovernanceManager is notified
     bool fMasternodesRemoved;
 
     std::vector<uint256> vecDirtyGovernanceObjectHashes;
 
+    /// Bumped whenever masternodes are added, removed or change their state or broadcast
+    int nListVersion;
+
     int64_t nLastWatchdogVoteTime;
 
     friend class CMasternodeSync;
@@ -361,6 +364,12 @@ public:
      */
     void NotifyMasternodeUpdates();
 
+    /// Called by masternodes when their state or broadcast data changed
+    void NotifyMasternodeChanged(const COutPoint& outpoint);
+
+    /// Changes with every update of the list which can affect masternode ranks
+    int GetListVersion() { LOCK(cs); return nListVersion; }
+
 };
 
 #endif
@@ -116,6 +116,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "setban", 2 },
     { "setban", 3 },
     { "spork", 1 },
+    { "getinstantsendstats", 0 },
     { "voteraw", 1 },
     { "voteraw", 5 },
     { "getblockhashes", 0 },
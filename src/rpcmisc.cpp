@@ -7,6 +7,7 @@
 #include "base58.h"
 #include "clientversion.h"
 #include "init.h"
+#include "instantx.h"
 #include "main.h"
 #include "net.h"
 #include "netbase.h"
@@ -176,6 +177,55 @@ UniValue mnsync(const UniValue& params, bool fHelp)
     return "failure";
 }
 
+UniValue getinstantsendstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getinstantsendstats ( reset )\n"
+            "Returns InstantSend lock latency statistics per stage, measured in milliseconds\n"
+            "from the arrival of the lock request.\n"
+            "\nArguments:\n"
+            "1. reset    (boolean, optional, default=false) Clear the statistics after reading them\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"stage\": {         (string) vote_created, vote_received, quorum or locked\n"
+            "    \"count\": n,      (numeric) Number of samples\n"
+            "    \"min\": n,        (numeric) Lowest latency\n"
+            "    \"avg\": n,        (numeric) Average latency\n"
+            "    \"max\": n,        (numeric) Highest latency\n"
+            "    \"p50\": n,        (numeric) Median latency, rounded up to a power of two\n"
+            "    \"p90\": n,        (numeric) 90th percentile, rounded up to a power of two\n"
+            "    \"p99\": n         (numeric) 99th percentile, rounded up to a power of two\n"
+            "  }, ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getinstantsendstats", "")
+            + HelpExampleRpc("getinstantsendstats", "true")
+        );
+
+    bool fReset = params.size() > 0 && params[0].get_bool();
+
+    std::vector<CLatencyHistogram> vecLatency;
+    instantsend.GetLockLatency(vecLatency, fReset);
+
+    static const char* const arrStageNames[TXLOCK_STAGE_COUNT] = {"vote_created", "vote_received", "quorum", "locked"};
+
+    UniValue obj(UniValue::VOBJ);
+    for(int i = 0; i < TXLOCK_STAGE_COUNT; ++i) {
+        const CLatencyHistogram& histogram = vecLatency[i];
+        UniValue objStage(UniValue::VOBJ);
+        objStage.push_back(Pair("count", histogram.GetCount()));
+        objStage.push_back(Pair("min", histogram.GetMin()));
+        objStage.push_back(Pair("avg", histogram.GetAverage()));
+        objStage.push_back(Pair("max", histogram.GetMax()));
+        objStage.push_back(Pair("p50", histogram.GetPercentile(0.5)));
+        objStage.push_back(Pair("p90", histogram.GetPercentile(0.9)));
+        objStage.push_back(Pair("p99", histogram.GetPercentile(0.99)));
+        obj.push_back(Pair(arrStageNames[i], objStage));
+    }
+    return obj;
+}
+
 #ifdef ENABLE_WALLET
 class DescribeAddressVisitor : public boost::static_visitor<UniValue>
 {
@@ -559,6 +609,85 @@ bool getAddressesFromParams(const UniValue& params, std::vector<std::pair<uint16
     return true;
 }
 
+/**
+ * The continuation of a paged address index query: the position of the
+ * address in the request and the last index key returned for it.
+ */
+template <typename K>
+std::string encodeAddressIndexCursor(uint32_t nAddress, const K& key)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << nAddress << key;
+    return HexStr(ss.begin(), ss.end());
+}
+
+template <typename K>
+bool decodeAddressIndexCursor(const std::string& strCursor, uint32_t& nAddress, K& key)
+{
+    if (!IsHex(strCursor))
+        return false;
+    std::vector<unsigned char> data(ParseHex(strCursor));
+    CDataStream ss(data, SER_NETWORK, PROTOCOL_VERSION);
+    try {
+        ss >> nAddress >> key;
+    } catch (const std::exception&) {
+        return false;
+    }
+    return ss.empty();
+}
+
+/** Read "limit" and "cursor", returns false if the query is not paged */
+template <typename K>
+bool getPageFromParams(const UniValue& params, size_t nAddresses, size_t& nLimit, uint32_t& nAddress, K& keyAfter, bool& fKeyAfter)
+{
+    nLimit = 0;
+    nAddress = 0;
+    fKeyAfter = false;
+    if (!params[0].isObject())
+        return false;
+
+    UniValue limitValue = find_value(params[0].get_obj(), "limit");
+    if (limitValue.isNull())
+        return false;
+    if (!limitValue.isNum() || limitValue.get_int() <= 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Limit is expected to be a positive number");
+    nLimit = limitValue.get_int();
+
+    UniValue cursorValue = find_value(params[0].get_obj(), "cursor");
+    if (!cursorValue.isNull()) {
+        if (!cursorValue.isStr() || !decodeAddressIndexCursor(cursorValue.get_str(), nAddress, keyAfter) || nAddress >= nAddresses)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+        fKeyAfter = true;
+    }
+    return true;
+}
+
+/**
+ * Read up to nLimit address index entries, continuing at the cursor, and
+ * set strCursor if the page is full
+ */
+void getAddressIndexPage(const std::vector<std::pair<uint160, int> >& addresses, int start, int end,
+                         size_t nLimit, uint32_t nAddress, const CAddressIndexKey* pkeyAfter,
+                         std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex, std::string& strCursor,
+                         bool fSkipTx = false)
+{
+    for (uint32_t i = nAddress; i < addresses.size() && addressIndex.size() < nLimit; i++) {
+        size_t nWant = nLimit - addressIndex.size();
+        if (!GetAddressIndex(addresses[i].first, addresses[i].second, addressIndex, start, end, i == nAddress ? pkeyAfter : NULL, nWant)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+        }
+        if (addressIndex.size() == nLimit) {
+            CAddressIndexKey key = addressIndex.back().first;
+            if (fSkipTx) {
+                // the entries of a tx are adjacent, continue after all of them
+                key.index = std::numeric_limits<uint32_t>::max();
+                key.spending = true;
+            }
+            strCursor = encodeAddressIndexCursor(i, key);
+        }
+    }
+}
+
 bool heightSort(std::pair<CAddressUnspentKey, CAddressUnspentValue> a,
                 std::pair<CAddressUnspentKey, CAddressUnspentValue> b) {
     return a.second.blockHeight < b.second.blockHeight;
@@ -653,8 +782,10 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
             "      \"address\"  (string) The base58check encoded address\n"
             "      ,...\n"
             "    ]\n"
+            "  \"limit\" (number, optional) Return at most this many outputs, in index order, with a cursor for the rest\n"
+            "  \"cursor\" (string, optional) The cursor returned by the previous page\n"
             "}\n"
-            "\nResult\n"
+            "\nResult (without limit, with limit it is {\"utxos\": [...], \"cursor\": \"...\"}, the cursor only if there may be more)\n"
             "[\n"
             "  {\n"
             "    \"address\"  (string) The address base58check encoded\n"
@@ -678,13 +809,31 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
 
     std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentOutputs;
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (!GetAddressUnspent((*it).first, (*it).second, unspentOutputs)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    size_t nLimit;
+    uint32_t nAddress;
+    CAddressUnspentKey keyAfter;
+    bool fKeyAfter;
+    std::string strCursor;
+    bool fPaged = getPageFromParams(params, addresses.size(), nLimit, nAddress, keyAfter, fKeyAfter);
+
+    if (fPaged) {
+        for (uint32_t i = nAddress; i < addresses.size() && unspentOutputs.size() < nLimit; i++) {
+            size_t nWant = nLimit - unspentOutputs.size();
+            if (!GetAddressUnspent(addresses[i].first, addresses[i].second, unspentOutputs, (i == nAddress && fKeyAfter) ? &keyAfter : NULL, nWant)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            }
+            if (unspentOutputs.size() == nLimit)
+                strCursor = encodeAddressIndexCursor(i, unspentOutputs.back().first);
+        }
+    } else {
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            if (!GetAddressUnspent((*it).first, (*it).second, unspentOutputs)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            }
         }
-    }
 
-    std::sort(unspentOutputs.begin(), unspentOutputs.end(), heightSort);
+        std::sort(unspentOutputs.begin(), unspentOutputs.end(), heightSort);
+    }
 
     UniValue result(UniValue::VARR);
 
@@ -704,6 +853,14 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
         result.push_back(output);
     }
 
+    if (fPaged) {
+        UniValue page(UniValue::VOBJ);
+        page.push_back(Pair("utxos", result));
+        if (!strCursor.empty())
+            page.push_back(Pair("cursor", strCursor));
+        return page;
+    }
+
     return result;
 }
 
@@ -722,8 +879,10 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
             "    ]\n"
             "  \"start\" (number) The start block height\n"
             "  \"end\" (number) The end block height\n"
+            "  \"limit\" (number, optional) Return at most this many deltas, address by address, with a cursor for the rest\n"
+            "  \"cursor\" (string, optional) The cursor returned by the previous page\n"
             "}\n"
-            "\nResult:\n"
+            "\nResult (without limit, with limit it is {\"deltas\": [...], \"cursor\": \"...\"}, the cursor only if there may be more)\n"
             "[\n"
             "  {\n"
             "    \"satoshis\"  (number) The difference of satoshis\n"
@@ -761,14 +920,25 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
 
     std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (start > 0 && end > 0) {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
-        } else {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    size_t nLimit;
+    uint32_t nAddress;
+    CAddressIndexKey keyAfter;
+    bool fKeyAfter;
+    std::string strCursor;
+    bool fPaged = getPageFromParams(params, addresses.size(), nLimit, nAddress, keyAfter, fKeyAfter);
+
+    if (fPaged) {
+        getAddressIndexPage(addresses, start, end, nLimit, nAddress, fKeyAfter ? &keyAfter : NULL, addressIndex, strCursor);
+    } else {
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            if (start > 0 && end > 0) {
+                if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+                }
+            } else {
+                if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+                }
             }
         }
     }
@@ -791,6 +961,14 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
         result.push_back(delta);
     }
 
+    if (fPaged) {
+        UniValue page(UniValue::VOBJ);
+        page.push_back(Pair("deltas", result));
+        if (!strCursor.empty())
+            page.push_back(Pair("cursor", strCursor));
+        return page;
+    }
+
     return result;
 }
 
@@ -807,11 +985,15 @@ UniValue getaddressbalance(const UniValue& params, bool fHelp)
             "      \"address\"  (string) The base58check encoded address\n"
             "      ,...\n"
             "    ]\n"
+            "  \"mempool\" (boolean, optional) Also return the change from transactions in the mempool\n"
             "}\n"
             "\nResult:\n"
             "{\n"
             "  \"balance\"  (string) The current balance in satoshis\n"
             "  \"received\"  (string) The total number of satoshis received (including change)\n"
+            "  \"txcount\"  (number) The number of transactions, with addressbalanceindex only\n"
+            "  \"height\"  (number) The height of the last block with a transaction, with addressbalanceindex only\n"
+            "  \"unconfirmed_balance\"  (string) The change of the balance in the mempool in satoshis, with mempool only\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressbalance", "'{\"addresses\": [\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\"]}'")
@@ -824,27 +1006,66 @@ UniValue getaddressbalance(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
-
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    bool fMempool = false;
+    if (params[0].isObject()) {
+        UniValue mempoolValue = find_value(params[0].get_obj(), "mempool");
+        if (mempoolValue.isBool()) {
+            fMempool = mempoolValue.get_bool();
         }
     }
 
     CAmount balance = 0;
     CAmount received = 0;
+    UniValue result(UniValue::VOBJ);
 
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++) {
-        if (it->second > 0) {
-            received += it->second;
+    if (fAddressBalanceIndex) {
+        int64_t nTxCount = 0;
+        int nLastHeight = 0;
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            CAddressBalanceValue value;
+            if (!GetAddressBalance((*it).first, (*it).second, value)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            }
+            balance += value.balance;
+            received += value.received;
+            nTxCount += value.nTxCount;
+            nLastHeight = std::max(nLastHeight, value.nLastHeight);
         }
-        balance += it->second;
+        result.push_back(Pair("balance", balance));
+        result.push_back(Pair("received", received));
+        result.push_back(Pair("txcount", nTxCount));
+        result.push_back(Pair("height", nLastHeight));
+    } else {
+        std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+            }
+        }
+
+        for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++) {
+            if (it->second > 0) {
+                received += it->second;
+            }
+            balance += it->second;
+        }
+
+        result.push_back(Pair("balance", balance));
+        result.push_back(Pair("received", received));
     }
 
-    UniValue result(UniValue::VOBJ);
-    result.push_back(Pair("balance", balance));
-    result.push_back(Pair("received", received));
+    if (fMempool) {
+        std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > indexes;
+        if (!mempool.getAddressIndex(addresses, indexes)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+        }
+        CAmount unconfirmed = 0;
+        for (std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> >::const_iterator it = indexes.begin(); it != indexes.end(); it++) {
+            unconfirmed += it->second.amount;
+        }
+        result.push_back(Pair("unconfirmed_balance", unconfirmed));
+    }
 
     return result;
 
@@ -865,8 +1086,10 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
             "    ]\n"
             "  \"start\" (number) The start block height\n"
             "  \"end\" (number) The end block height\n"
+            "  \"limit\" (number, optional) Read at most this many index entries, address by address, with a cursor for the rest\n"
+            "  \"cursor\" (string, optional) The cursor returned by the previous page\n"
             "}\n"
-            "\nResult:\n"
+            "\nResult (without limit, with limit it is {\"txids\": [...], \"cursor\": \"...\"}, the cursor only if there may be more)\n"
             "[\n"
             "  \"transactionid\"  (string) The transaction id\n"
             "  ,...\n"
@@ -895,14 +1118,25 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
 
     std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (start > 0 && end > 0) {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-            }
-        } else {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    size_t nLimit;
+    uint32_t nAddress;
+    CAddressIndexKey keyAfter;
+    bool fKeyAfter;
+    std::string strCursor;
+    bool fPaged = getPageFromParams(params, addresses.size(), nLimit, nAddress, keyAfter, fKeyAfter);
+
+    if (fPaged) {
+        getAddressIndexPage(addresses, start, end, nLimit, nAddress, fKeyAfter ? &keyAfter : NULL, addressIndex, strCursor, true);
+    } else {
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            if (start > 0 && end > 0) {
+                if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+                }
+            } else {
+                if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+                }
             }
         }
     }
@@ -914,7 +1148,8 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
         int height = it->first.blockHeight;
         std::string txid = it->first.txhash.GetHex();
 
-        if (addresses.size() > 1) {
+        // a page keeps the index order
+        if (addresses.size() > 1 && !fPaged) {
             txids.insert(std::make_pair(height, txid));
         } else {
             if (txids.insert(std::make_pair(height, txid)).second) {
@@ -923,12 +1158,20 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
         }
     }
 
-    if (addresses.size() > 1) {
+    if (addresses.size() > 1 && !fPaged) {
         for (std::set<std::pair<int, std::string> >::const_iterator it=txids.begin(); it!=txids.end(); it++) {
             result.push_back(it->second);
         }
     }
 
+    if (fPaged) {
+        UniValue page(UniValue::VOBJ);
+        page.push_back(Pair("txids", result));
+        if (!strCursor.empty())
+            page.push_back(Pair("cursor", strCursor));
+        return page;
+    }
+
     return result;
 
 }
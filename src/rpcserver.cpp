@@ -352,6 +352,7 @@ static const CRPCCommand vRPCCommands[] =
     { "onex",               "voteraw",                &voteraw,                true  },
     { "onex",               "mnsync",                 &mnsync,                 true  },
     { "onex",               "spork",                  &spork,                  true  },
+    { "onex",               "getinstantsendstats",    &getinstantsendstats,    true  },
     { "onex",               "getpoolinfo",            &getpoolinfo,            true  },
 #ifdef ENABLE_WALLET
     { "onex",               "privatesend",            &privatesend,            false },
@@ -376,6 +377,7 @@ static const CRPCCommand vRPCCommands[] =
     { "wallet",             "abandontransaction",     &abandontransaction,     false },
     { "wallet",             "getunconfirmedbalance",  &getunconfirmedbalance,  false },
     { "wallet",             "getwalletinfo",          &getwalletinfo,          false },
+    { "wallet",             "getrescaninfo",          &getrescaninfo,          true  },
     { "wallet",             "importprivkey",          &importprivkey,          true  },
     { "wallet",             "importwallet",           &importwallet,           true  },
     { "wallet",             "importelectrumwallet",   &importelectrumwallet,   true  },
@@ -11,6 +11,7 @@
 #include "crypto/sha256.h"
 #include "pubkey.h"
 #include "script/script.h"
+#include "streams.h"
 #include "uint256.h"
 
 using namespace std;
@@ -1009,6 +1010,29 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
 
 namespace {
 
+/** Serialize scriptCode, skipping OP_CODESEPARATORs */
+template<typename S>
+void SerializeScriptCode(S &s, const CScript& scriptCode) {
+    CScript::const_iterator it = scriptCode.begin();
+    CScript::const_iterator itBegin = it;
+    opcodetype opcode;
+    unsigned int nCodeSeparators = 0;
+    while (scriptCode.GetOp(it, opcode)) {
+        if (opcode == OP_CODESEPARATOR)
+            nCodeSeparators++;
+    }
+    ::WriteCompactSize(s, scriptCode.size() - nCodeSeparators);
+    it = itBegin;
+    while (scriptCode.GetOp(it, opcode)) {
+        if (opcode == OP_CODESEPARATOR) {
+            s.write((char*)&itBegin[0], it-itBegin-1);
+            itBegin = it;
+        }
+    }
+    if (itBegin != scriptCode.end())
+        s.write((char*)&itBegin[0], it-itBegin);
+}
+
 /**
  * Wrapper that serializes like CTransaction, but with the modifications
  *  required for the signature hash done in-place
@@ -1032,24 +1056,7 @@ public:
     /** Serialize the passed scriptCode, skipping OP_CODESEPARATORs */
     template<typename S>
     void SerializeScriptCode(S &s, int nType, int nVersion) const {
-        CScript::const_iterator it = scriptCode.begin();
-        CScript::const_iterator itBegin = it;
-        opcodetype opcode;
-        unsigned int nCodeSeparators = 0;
-        while (scriptCode.GetOp(it, opcode)) {
-            if (opcode == OP_CODESEPARATOR)
-                nCodeSeparators++;
-        }
-        ::WriteCompactSize(s, scriptCode.size() - nCodeSeparators);
-        it = itBegin;
-        while (scriptCode.GetOp(it, opcode)) {
-            if (opcode == OP_CODESEPARATOR) {
-                s.write((char*)&itBegin[0], it-itBegin-1);
-                itBegin = it;
-            }
-        }
-        if (itBegin != scriptCode.end())
-            s.write((char*)&itBegin[0], it-itBegin);
+        ::SerializeScriptCode(s, scriptCode);
     }
 
     /** Serialize an input of txTo */
@@ -1106,7 +1113,29 @@ public:
 
 } // anon namespace
 
-uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& tx)
+{
+    CDataStream ssInputs(SER_GETHASH, 0);
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+        ssInputs << tx.vin[i].prevout << CScriptBase() << tx.vin[i].nSequence;
+    assert(ssInputs.size() == tx.vin.size() * BLANK_INPUT_SIZE);
+    vchInputs.assign(ssInputs.begin(), ssInputs.end());
+
+    CDataStream ssOutputs(SER_GETHASH, 0);
+    ssOutputs << tx.vout << tx.nLockTime;
+    vchOutputs.assign(ssOutputs.begin(), ssOutputs.end());
+
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << tx.nVersion;
+    ::WriteCompactSize(ss, tx.vin.size());
+    vPrefix.reserve(tx.vin.size());
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        vPrefix.push_back(ss);
+        ss.write((const char*)&vchInputs[i * BLANK_INPUT_SIZE], BLANK_INPUT_SIZE);
+    }
+}
+
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata)
 {
     static const uint256 one(uint256S("0000000000000000000000000000000000000000000000000000000000000001"));
     if (nIn >= txTo.vin.size()) {
@@ -1122,6 +1151,29 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
         }
     }
 
+    // Same serialization as below, with the parts shared by all inputs taken from txdata
+    if (txdata && txdata->vPrefix.size() == txTo.vin.size() &&
+        (nHashType & 0x1f) != SIGHASH_NONE && (nHashType & 0x1f) != SIGHASH_SINGLE) {
+        const size_t nInputSize = PrecomputedTransactionData::BLANK_INPUT_SIZE;
+        const char* pInputs = (const char*)&txdata->vchInputs[0];
+        CHashWriter ss(SER_GETHASH, 0);
+        if (nHashType & SIGHASH_ANYONECANPAY) {
+            ss << txTo.nVersion;
+            ::WriteCompactSize(ss, 1);
+        } else {
+            ss = txdata->vPrefix[nIn];
+        }
+        // prevout of the input being signed, followed by its script code
+        ss.write(pInputs + nIn * nInputSize, 36);
+        SerializeScriptCode(ss, scriptCode);
+        ss << txTo.vin[nIn].nSequence;
+        if (!(nHashType & SIGHASH_ANYONECANPAY))
+            ss.write(pInputs + (nIn + 1) * nInputSize, txdata->vchInputs.size() - (nIn + 1) * nInputSize);
+        ss.write((const char*)&txdata->vchOutputs[0], txdata->vchOutputs.size());
+        ss << nHashType;
+        return ss.GetHash();
+    }
+
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
@@ -1149,7 +1201,7 @@ bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn
     int nHashType = vchSig.back();
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType, txdata);
 
     if (!VerifySignature(vchSig, pubkey, sighash))
         return false;
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_SCRIPT_INTERPRETER_H
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
+#include "hash.h"
 #include "script_error.h"
 #include "primitives/transaction.h"
 
@@ -90,7 +91,29 @@ enum
 
 bool CheckSignatureEncoding(const std::vector<unsigned char> &vchSig, unsigned int flags, ScriptError* serror);
 
-uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+/**
+ * The parts of the signature hash preimage that are the same for every input
+ * of a transaction, computed once so that hashing the inputs of a transaction
+ * with many of them does not serialize the whole transaction each time. Only
+ * used for SIGHASH_ALL (with or without SIGHASH_ANYONECANPAY), the others are
+ * hashed as before. The resulting hashes are identical.
+ */
+struct PrecomputedTransactionData
+{
+    //! Size of a serialized input with its script blanked out: prevout, empty script, nSequence
+    static const size_t BLANK_INPUT_SIZE = 36 + 1 + 4;
+
+    //! Hash state after nVersion, the input count and the blanked inputs before input i
+    std::vector<CHashWriter> vPrefix;
+    //! All inputs serialized with their scripts blanked out
+    std::vector<unsigned char> vchInputs;
+    //! Output count, all outputs and nLockTime
+    std::vector<unsigned char> vchOutputs;
+
+    PrecomputedTransactionData(const CTransaction& tx);
+};
+
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata = NULL);
 
 class BaseSignatureChecker
 {
@@ -118,12 +141,13 @@ class TransactionSignatureChecker : public BaseSignatureChecker
 private:
     const CTransaction* txTo;
     unsigned int nIn;
+    const PrecomputedTransactionData* txdata;
 
 protected:
     virtual bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 
 public:
-    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn) : txTo(txToIn), nIn(nInIn) {}
+    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const PrecomputedTransactionData* txdataIn = NULL) : txTo(txToIn), nIn(nInIn), txdata(txdataIn) {}
     bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode) const;
     bool CheckLockTime(const CScriptNum& nLockTime) const;
     bool CheckSequence(const CScriptNum& nSequence) const;
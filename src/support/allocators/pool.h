@@ -0,0 +1,210 @@
+// Copyright (c) 2014-2017 The Onex Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <limits>
+#include <new>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+/**
+ * Memory for the nodes of one node based container. Single objects up to
+ * MAX_BLOCK_SIZE bytes are carved out of chunks, and released blocks are kept
+ * on a free list per size for reuse instead of being handed back to malloc.
+ * Chunks start small and double up to MAX_CHUNK_SIZE, so short lived
+ * containers stay cheap. Arrays and larger objects (e.g. the bucket array of
+ * a hash map) go to the global heap as usual.
+ *
+ * Not thread safe: all containers sharing a resource must be protected by the
+ * same lock.
+ */
+class CPoolResource : private boost::noncopyable
+{
+public:
+    static const size_t BLOCK_ALIGN = 8;
+    static const size_t MAX_BLOCK_SIZE = 256;
+    static const size_t MIN_CHUNK_SIZE = 4096;
+    static const size_t MAX_CHUNK_SIZE = 256 * 1024;
+
+private:
+    //! Size of the next chunk the blocks are carved out of
+    size_t nChunkSize;
+    //! Total size of all chunks
+    size_t nChunkUsage;
+    //! Singly linked free list per block size, indexed by size / BLOCK_ALIGN
+    std::vector<void*> vFreeLists;
+    std::vector<char*> vChunks;
+    //! Unused tail of the last chunk
+    char* pAvail;
+    size_t nAvail;
+    //! Blocks handed out and not released yet
+    size_t nBlocksUsed;
+
+    static size_t BlockSize(size_t nBytes)
+    {
+        return (nBytes + BLOCK_ALIGN - 1) / BLOCK_ALIGN * BLOCK_ALIGN;
+    }
+
+    void AllocateChunk()
+    {
+        char* pChunk = static_cast<char*>(malloc(nChunkSize));
+        if (!pChunk)
+            throw std::bad_alloc();
+        vChunks.push_back(pChunk);
+        pAvail = pChunk;
+        nAvail = nChunkSize;
+        nChunkUsage += nChunkSize;
+        if (nChunkSize < MAX_CHUNK_SIZE)
+            nChunkSize *= 2;
+    }
+
+public:
+    CPoolResource() :
+        nChunkSize(MIN_CHUNK_SIZE), nChunkUsage(0), vFreeLists(MAX_BLOCK_SIZE / BLOCK_ALIGN + 1, (void*)NULL),
+        pAvail(NULL), nAvail(0), nBlocksUsed(0)
+    {
+    }
+
+    ~CPoolResource()
+    {
+        // containers using this resource must be destroyed first
+        assert(nBlocksUsed == 0);
+        for (size_t i = 0; i < vChunks.size(); i++)
+            free(vChunks[i]);
+    }
+
+    void* Allocate(size_t nBytes, size_t nCount)
+    {
+        size_t nBlock = BlockSize(nBytes);
+        if (nCount != 1 || nBlock > MAX_BLOCK_SIZE)
+            return ::operator new(nBytes * nCount);
+        nBlocksUsed++;
+        void*& pFree = vFreeLists[nBlock / BLOCK_ALIGN];
+        if (pFree) {
+            void* p = pFree;
+            pFree = *static_cast<void**>(p);
+            return p;
+        }
+        if (nAvail < nBlock)
+            AllocateChunk();
+        void* p = pAvail;
+        pAvail += nBlock;
+        nAvail -= nBlock;
+        return p;
+    }
+
+    void Deallocate(void* p, size_t nBytes, size_t nCount)
+    {
+        size_t nBlock = BlockSize(nBytes);
+        if (nCount != 1 || nBlock > MAX_BLOCK_SIZE) {
+            ::operator delete(p);
+            return;
+        }
+        assert(nBlocksUsed > 0);
+        nBlocksUsed--;
+        void*& pFree = vFreeLists[nBlock / BLOCK_ALIGN];
+        *static_cast<void**>(p) = pFree;
+        pFree = p;
+    }
+
+    /**
+     * Hand all chunks back to the heap at once. Only possible when no block is
+     * in use, e.g. after the containers were cleared; returns whether it did.
+     * The chunk size reached so far is kept for the next fill.
+     */
+    bool Release()
+    {
+        if (nBlocksUsed != 0)
+            return false;
+        for (size_t i = 0; i < vChunks.size(); i++)
+            free(vChunks[i]);
+        std::vector<char*>().swap(vChunks);
+        std::fill(vFreeLists.begin(), vFreeLists.end(), (void*)NULL);
+        pAvail = NULL;
+        nAvail = 0;
+        nChunkUsage = 0;
+        return true;
+    }
+
+    //! Bytes of chunk memory, whether the blocks in it are in use or not
+    size_t ChunkUsage() const { return nChunkUsage; }
+    size_t BlocksUsed() const { return nBlocksUsed; }
+};
+
+/**
+ * Allocator taking its memory from a CPoolResource. A default constructed
+ * allocator has no resource and uses the global heap, so containers that do
+ * not need the pool keep working unchanged.
+ */
+template <typename T>
+class pool_allocator
+{
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind {
+        typedef pool_allocator<U> other;
+    };
+
+    pool_allocator() throw() : resource(NULL) {}
+    explicit pool_allocator(CPoolResource* resourceIn) throw() : resource(resourceIn) {}
+    template <typename U>
+    pool_allocator(const pool_allocator<U>& a) throw() : resource(a.GetResource()) {}
+
+    CPoolResource* GetResource() const { return resource; }
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+    size_type max_size() const throw() { return std::numeric_limits<size_type>::max() / sizeof(T); }
+
+    pointer allocate(size_type n, const void* hint = 0)
+    {
+        if (resource == NULL)
+            return static_cast<pointer>(::operator new(n * sizeof(T)));
+        return static_cast<pointer>(resource->Allocate(sizeof(T), n));
+    }
+
+    void deallocate(pointer p, size_type n)
+    {
+        if (resource == NULL)
+            ::operator delete(p);
+        else
+            resource->Deallocate(p, sizeof(T), n);
+    }
+
+    void construct(pointer p, const T& val) { new(static_cast<void*>(p)) T(val); }
+    void destroy(pointer p) { p->~T(); }
+
+private:
+    CPoolResource* resource;
+};
+
+template <typename T, typename U>
+inline bool operator==(const pool_allocator<T>& a, const pool_allocator<U>& b)
+{
+    return a.GetResource() == b.GetResource();
+}
+
+template <typename T, typename U>
+inline bool operator!=(const pool_allocator<T>& a, const pool_allocator<U>& b)
+{
+    return !(a == b);
+}
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOL_H
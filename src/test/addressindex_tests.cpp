@@ -0,0 +1,71 @@
+// Copyright (c) 2014-2017 The Onex Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "main.h"
+#include "script/standard.h"
+#include "test/test_onex.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(addressindex_tests, TestChain100Setup)
+
+BOOST_AUTO_TEST_CASE(addressbalance_reconnect)
+{
+    fAddressIndex = true;
+    fAddressBalanceIndex = true;
+
+    CKey key;
+    key.MakeNewKey(true);
+    uint160 addressHash = key.GetPubKey().GetID();
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+    CBlock block = CreateAndProcessBlock(std::vector<CMutableTransaction>(), scriptPubKey);
+    CAmount nReward = block.vtx[0].vout[0].nValue;
+    CAddressBalanceValue value;
+    BOOST_CHECK(GetAddressBalance(addressHash, 1, value));
+    BOOST_CHECK_EQUAL(value.balance, nReward);
+    BOOST_CHECK_EQUAL(value.nTxCount, 1);
+
+    {
+        LOCK(cs_main);
+        // the indexes have the block but the coins do not, as after a crash
+        // between the two flushes; the block gets connected again
+        CBlockIndex* pindex = chainActive.Tip();
+        CCoinsViewCache view(pcoinsTip);
+        CValidationState state;
+        bool fClean;
+        BOOST_CHECK(DisconnectBlock(block, state, pindex, view, &fClean));
+        BOOST_CHECK(fClean);
+        BOOST_CHECK(view.GetBestBlock() == pindex->pprev->GetBlockHash());
+        BOOST_CHECK(ConnectBlock(block, state, pindex, view));
+    }
+    BOOST_CHECK(GetAddressBalance(addressHash, 1, value));
+    BOOST_CHECK_EQUAL(value.balance, nReward);
+    BOOST_CHECK_EQUAL(value.nTxCount, 1);
+
+    // later blocks are counted again
+    block = CreateAndProcessBlock(std::vector<CMutableTransaction>(), scriptPubKey);
+    BOOST_CHECK(GetAddressBalance(addressHash, 1, value));
+    BOOST_CHECK_EQUAL(value.balance, nReward + block.vtx[0].vout[0].nValue);
+    BOOST_CHECK_EQUAL(value.nTxCount, 2);
+    BOOST_CHECK_EQUAL(value.nLastHeight, chainActive.Height());
+
+    // a disconnected block comes out of the balances
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(state, Params().GetConsensus(), chainActive.Tip()));
+    }
+    BOOST_CHECK(GetAddressBalance(addressHash, 1, value));
+    BOOST_CHECK_EQUAL(value.balance, nReward);
+    BOOST_CHECK_EQUAL(value.nTxCount, 1);
+
+    fAddressBalanceIndex = false;
+    fAddressIndex = false;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
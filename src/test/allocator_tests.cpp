@@ -4,9 +4,12 @@
 
 #include "util.h"
 
+#include "support/allocators/pool.h"
 #include "support/allocators/secure.h"
 #include "test/test_onex.h"
 
+#include <map>
+
 #include <boost/test/unit_test.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(allocator_tests, BasicTestingSetup)
@@ -117,4 +120,42 @@ BOOST_AUTO_TEST_CASE(test_LockedPageManagerBase)
     BOOST_CHECK((last_unlock_len & (test_page_size-1)) == 0); // always unlock entire pages
 }
 
+BOOST_AUTO_TEST_CASE(pool_allocator_test)
+{
+    CPoolResource resource;
+    {
+        typedef std::map<int, int, std::less<int>, pool_allocator<std::pair<const int, int> > > PoolMap;
+        PoolMap::allocator_type alloc(&resource);
+        PoolMap m(std::less<int>(), alloc);
+        for (int i = 0; i < 10000; i++)
+            m[i] = i;
+        BOOST_CHECK_EQUAL(resource.BlocksUsed(), 10000);
+        BOOST_CHECK(resource.ChunkUsage() >= 10000 * sizeof(std::pair<const int, int>));
+        size_t nUsage = resource.ChunkUsage();
+
+        // released nodes are reused before new chunks are taken
+        for (int i = 0; i < 10000; i += 2)
+            m.erase(i);
+        BOOST_CHECK_EQUAL(resource.BlocksUsed(), 5000);
+        for (int i = 0; i < 10000; i += 2)
+            m[i] = -i;
+        BOOST_CHECK_EQUAL(resource.ChunkUsage(), nUsage);
+        BOOST_CHECK_EQUAL(m[42], -42);
+        BOOST_CHECK_EQUAL(m[43], 43);
+
+        // chunks can only be handed back once all nodes are
+        BOOST_CHECK(!resource.Release());
+        m.clear();
+        BOOST_CHECK(resource.Release());
+        BOOST_CHECK_EQUAL(resource.ChunkUsage(), 0);
+        m[1] = 1;
+        BOOST_CHECK_EQUAL(resource.BlocksUsed(), 1);
+    }
+    BOOST_CHECK_EQUAL(resource.BlocksUsed(), 0);
+
+    // without a resource the global heap is used
+    std::vector<int, pool_allocator<int> > v(100, 1);
+    BOOST_CHECK_EQUAL(v[99], 1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,6 +2,10 @@
 
 #include "cachemap.h"
 
+#include "arith_uint256.h"
+#include "tinyformat.h"
+#include "utiltime.h"
+
 #include "test/test_onex.h"
 
 #include <boost/test/unit_test.hpp>
@@ -124,4 +128,69 @@ BOOST_AUTO_TEST_CASE(cachemap_test)
     BOOST_CHECK(Compare(mapTest1, mapTest4));
 }
 
+BOOST_AUTO_TEST_CASE(cachemap_erase_while_iterating)
+{
+    CacheMap<int,int> mapTest(10);
+    for(int i = 0; i < 10; ++i) {
+        mapTest.Insert(i, i % 2);
+    }
+
+    // erase the odd keys while walking the items, as governance does
+    const CacheMap<int,int>::list_t& listItems = mapTest.GetItemList();
+    CacheMap<int,int>::list_cit it = listItems.begin();
+    while(it != listItems.end()) {
+        if(it->value == 1) {
+            int nKey = it->key;
+            ++it;
+            mapTest.Erase(nKey);
+        }
+        else {
+            ++it;
+        }
+    }
+
+    BOOST_CHECK(mapTest.GetSize() == 5);
+    int nExpected = 8;
+    for(it = listItems.begin(); it != listItems.end(); ++it) {
+        BOOST_CHECK(it->key == nExpected);
+        nExpected -= 2;
+    }
+    BOOST_CHECK(nExpected == -2);
+}
+
+BOOST_AUTO_TEST_CASE(cachemap_benchmark)
+{
+    // rough throughput figures for a cache of the size used by governance
+    const int nMaxSize = 10000;
+    const int nCount = 100000;
+
+    std::vector<uint256> vecKeys;
+    for(int i = 0; i < nCount; ++i) {
+        vecKeys.push_back(ArithToUint256(arith_uint256(i)));
+    }
+
+    CacheMap<uint256,int> mapTest(nMaxSize);
+
+    int64_t nTimeStart = GetTimeMicros();
+    for(int i = 0; i < nCount; ++i) {
+        mapTest.Insert(vecKeys[i], i);
+    }
+    int64_t nTimeInsert = GetTimeMicros();
+
+    int nFound = 0;
+    for(int i = 0; i < nCount; ++i) {
+        int nVal = 0;
+        if(mapTest.Get(vecKeys[i], nVal)) {
+            ++nFound;
+        }
+    }
+    int64_t nTimeGet = GetTimeMicros();
+
+    BOOST_CHECK(mapTest.GetSize() == nMaxSize);
+    BOOST_CHECK(nFound == nMaxSize);
+
+    BOOST_TEST_MESSAGE(strprintf("CacheMap: %d inserts in %dus, %d lookups in %dus",
+                                 nCount, nTimeInsert - nTimeStart, nCount, nTimeGet - nTimeInsert));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
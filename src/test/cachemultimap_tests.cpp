@@ -2,6 +2,10 @@
 
 #include "cachemultimap.h"
 
+#include "arith_uint256.h"
+#include "tinyformat.h"
+#include "utiltime.h"
+
 #include "test/test_onex.h"
 
 #include <algorithm>
@@ -173,4 +177,46 @@ BOOST_AUTO_TEST_CASE(cachemultimap_test)
     BOOST_CHECK(Compare(mapTest1, mapTest4));
 }
 
+BOOST_AUTO_TEST_CASE(cachemultimap_benchmark)
+{
+    // rough throughput figures for a cache of the size used by governance
+    const int nMaxSize = 10000;
+    const int nCount = 100000;
+    const int nValuesPerKey = 10;
+
+    std::vector<uint256> vecKeys;
+    for(int i = 0; i < nCount / nValuesPerKey; ++i) {
+        vecKeys.push_back(ArithToUint256(arith_uint256(i)));
+    }
+
+    CacheMultiMap<uint256,int> mapTest(nMaxSize);
+
+    int64_t nTimeStart = GetTimeMicros();
+    for(int i = 0; i < nCount; ++i) {
+        mapTest.Insert(vecKeys[i / nValuesPerKey], i % nValuesPerKey);
+    }
+    int64_t nTimeInsert = GetTimeMicros();
+
+    int nFound = 0;
+    for(size_t i = 0; i < vecKeys.size(); ++i) {
+        std::vector<int> vecVals;
+        if(mapTest.GetAll(vecKeys[i], vecVals)) {
+            nFound += vecVals.size();
+        }
+    }
+    int64_t nTimeGet = GetTimeMicros();
+
+    for(int i = 0; i < nCount; ++i) {
+        mapTest.Erase(vecKeys[i / nValuesPerKey], i % nValuesPerKey);
+    }
+    int64_t nTimeErase = GetTimeMicros();
+
+    BOOST_CHECK(nFound == nMaxSize);
+    BOOST_CHECK(mapTest.GetSize() == 0);
+
+    BOOST_TEST_MESSAGE(strprintf("CacheMultiMap: %d inserts in %dus, %d key lookups in %dus, %d erases in %dus",
+                                 nCount, nTimeInsert - nTimeStart, vecKeys.size(), nTimeGet - nTimeInsert,
+                                 nCount, nTimeErase - nTimeGet));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,153 @@
+// Copyright (c) 2014-2017 The Onex Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+#include "test/test_onex.h"
+
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace {
+
+/** Counts its executions, fails if constructed with fOk false */
+class CCountingCheck
+{
+private:
+    bool fOk;
+    boost::mutex* pmutex;
+    int* pnCount;
+
+public:
+    CCountingCheck() : fOk(true), pmutex(NULL), pnCount(NULL) {}
+    CCountingCheck(bool fOkIn, boost::mutex* pmutexIn, int* pnCountIn) : fOk(fOkIn), pmutex(pmutexIn), pnCount(pnCountIn) {}
+
+    bool operator()()
+    {
+        boost::unique_lock<boost::mutex> lock(*pmutex);
+        (*pnCount)++;
+        return fOk;
+    }
+
+    void swap(CCountingCheck& check)
+    {
+        std::swap(fOk, check.fOk);
+        std::swap(pmutex, check.pmutex);
+        std::swap(pnCount, check.pnCount);
+    }
+};
+
+void RunChecks(CCheckQueue<CCountingCheck>* pqueue, int nRounds, bool* pfOk)
+{
+    boost::mutex mutex;
+    for (int nRound = 0; nRound < nRounds; nRound++) {
+        int nCount = 0;
+        int nAdded = 0;
+        CCheckQueueControl<CCountingCheck> control(pqueue);
+        for (int i = 0; i < 20; i++) {
+            std::vector<CCountingCheck> vChecks(i % 4, CCountingCheck(true, &mutex, &nCount));
+            nAdded += vChecks.size();
+            control.Add(vChecks);
+        }
+        if (!control.Wait() || nCount != nAdded)
+            *pfOk = false;
+    }
+}
+
+} // anon namespace
+
+BOOST_FIXTURE_TEST_SUITE(checkqueue_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(checkqueue_results)
+{
+    CWorkerPool pool(4);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 3; i++)
+        threadGroup.create_thread(boost::bind(&CWorkerPool::Thread, &pool));
+    // workers register when their thread starts running
+    while (pool.NumWorkers() < 3)
+        MilliSleep(1);
+
+    CCheckQueue<CCountingCheck> queue(pool, 16);
+    boost::mutex mutex;
+    int nCount = 0;
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks(1000, CCountingCheck(true, &mutex, &nCount));
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+        BOOST_CHECK_EQUAL(nCount, 1000);
+    }
+
+    // one failure fails the whole set, and the queue is reset for the next one
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks(100, CCountingCheck(true, &mutex, &nCount));
+        vChecks[50] = CCountingCheck(false, &mutex, &nCount);
+        control.Add(vChecks);
+        BOOST_CHECK(!control.Wait());
+    }
+    BOOST_CHECK(queue.IsIdle());
+
+    CWorkerPoolStats stats = pool.GetStats();
+    BOOST_CHECK_EQUAL(stats.nWorkers, 3);
+    BOOST_CHECK(stats.nJobs > 0);
+    BOOST_CHECK(stats.nSteals <= stats.nJobs);
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_shared_pool)
+{
+    CWorkerPool pool(8);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 4; i++)
+        threadGroup.create_thread(boost::bind(&CWorkerPool::Thread, &pool));
+
+    // two masters using the same workers at once
+    CCheckQueue<CCountingCheck> queue1(pool, 128);
+    CCheckQueue<CCountingCheck> queue2(pool, 4);
+    bool fOk1 = true, fOk2 = true;
+    boost::thread master1(boost::bind(&RunChecks, &queue1, 100, &fOk1));
+    boost::thread master2(boost::bind(&RunChecks, &queue2, 100, &fOk2));
+    master1.join();
+    master2.join();
+    BOOST_CHECK(fOk1);
+    BOOST_CHECK(fOk2);
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_no_workers)
+{
+    // the master runs everything itself
+    CWorkerPool pool;
+    CCheckQueue<CCountingCheck> queue(pool, 8);
+    bool fOk = true;
+    RunChecks(&queue, 10, &fOk);
+    BOOST_CHECK(fOk);
+    BOOST_CHECK_EQUAL(pool.GetStats().nWorkers, 0);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_restart_workers)
+{
+    // stopped workers give their slot back, so restarts do not run out of them
+    CWorkerPool pool(4);
+    CCheckQueue<CCountingCheck> queue(pool, 8);
+    for (int nRestart = 0; nRestart < 40; nRestart++) {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < 2 + nRestart % 3; i++)
+            threadGroup.create_thread(boost::bind(&CWorkerPool::Thread, &pool));
+        bool fOk = true;
+        RunChecks(&queue, 2, &fOk);
+        BOOST_CHECK(fOk);
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        BOOST_CHECK_EQUAL(pool.NumWorkers(), 0);
+    }
+    BOOST_CHECK(pool.GetStats().nJobs > 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
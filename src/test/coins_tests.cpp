@@ -347,4 +347,36 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
     BOOST_CHECK(spent_a_duplicate_coinbase);
 }
 
+BOOST_AUTO_TEST_CASE(prefetch_coins_test)
+{
+    CCoinsViewTest base;
+    uint256 txidBase = GetRandHash();
+    {
+        CCoinsViewCache cache(&base);
+        cache.ModifyNewCoins(txidBase)->vout.push_back(CTxOut(1, CScript()));
+        BOOST_CHECK(cache.Flush());
+    }
+
+    CCoinsViewCacheTest cache(&base);
+    CCoins coins;
+    BOOST_CHECK(cache.GetCoinsFromBase(txidBase, coins));
+    BOOST_CHECK(!cache.HaveCoinsInCache(txidBase));
+    BOOST_CHECK(cache.AddPrefetchedCoins(txidBase, coins));
+    BOOST_CHECK(cache.HaveCoinsInCache(txidBase));
+    cache.SelfTest();
+
+    // an entry already in the cache is newer than what was read
+    cache.ModifyCoins(txidBase)->vout[0].nValue = 2;
+    CCoins coinsStale;
+    BOOST_CHECK(cache.GetCoinsFromBase(txidBase, coinsStale));
+    BOOST_CHECK(!cache.AddPrefetchedCoins(txidBase, coinsStale));
+    BOOST_CHECK_EQUAL(cache.AccessCoins(txidBase)->vout[0].nValue, 2);
+
+    // nothing is cached for a txid the base does not have
+    CCoins coinsMissing;
+    BOOST_CHECK(!cache.GetCoinsFromBase(GetRandHash(), coinsMissing));
+    BOOST_CHECK(!cache.AddPrefetchedCoins(GetRandHash(), coinsMissing));
+    cache.SelfTest();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,150 @@
+// Copyright (c) 2014-2017 The Onex Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+#include "random.h"
+#include "test/test_onex.h"
+
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(cuckoocache_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(cuckoocache_insert_erase)
+{
+    CCuckooCache cache(1 << 16);
+    BOOST_CHECK_EQUAL(cache.Slots(), (size_t)(1 << 16) / 72 * CCuckooCache::SLOTS_PER_BUCKET);
+
+    std::vector<uint256> vEntries;
+    for (int i = 0; i < 500; i++)
+        vEntries.push_back(GetRandHash());
+    for (int i = 0; i < 500; i++)
+        cache.Insert(vEntries[i]);
+    // a quarter full, nothing is dropped
+    for (int i = 0; i < 500; i++)
+        BOOST_CHECK(cache.Contains(vEntries[i]));
+    BOOST_CHECK(!cache.Contains(GetRandHash()));
+
+    cache.Erase(vEntries[7]);
+    BOOST_CHECK(!cache.Contains(vEntries[7]));
+    cache.Insert(vEntries[7]);
+    BOOST_CHECK(cache.Contains(vEntries[7]));
+
+    CCuckooCacheStats stats = cache.GetStats();
+    BOOST_CHECK_EQUAL(stats.nInserts, 501);
+    BOOST_CHECK_EQUAL(stats.nEvictions, 0);
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_stats)
+{
+    // hits and misses are estimated from a sample of the lookups
+    CCuckooCache cache(1 << 20);
+    std::vector<uint256> vEntries;
+    for (int i = 0; i < 10000; i++) {
+        vEntries.push_back(GetRandHash());
+        cache.Insert(vEntries.back());
+    }
+    for (int i = 0; i < 10000; i++) {
+        BOOST_CHECK(cache.Contains(vEntries[i]));
+        BOOST_CHECK(!cache.Contains(GetRandHash()));
+    }
+    CCuckooCacheStats stats = cache.GetStats();
+    BOOST_CHECK(stats.nHits > 7000 && stats.nHits < 13000);
+    BOOST_CHECK(stats.nMisses > 7000 && stats.nMisses < 13000);
+    BOOST_CHECK(stats.HitRate() > 0.4 && stats.HitRate() < 0.6);
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_full)
+{
+    // inserting more entries than slots keeps the memory fixed, entries that
+    // find no free slot after a few moves are dropped, old or new
+    CCuckooCache cache(1 << 12);
+    size_t nSlots = cache.Slots();
+    std::vector<uint256> vEntries;
+    for (size_t i = 0; i < 4 * nSlots; i++) {
+        vEntries.push_back(GetRandHash());
+        cache.Insert(vEntries.back());
+    }
+    size_t nFound = 0;
+    for (size_t i = 0; i < vEntries.size(); i++)
+        nFound += cache.Contains(vEntries[i]);
+    BOOST_CHECK(nFound <= nSlots);
+    BOOST_CHECK(nFound > nSlots / 2);
+    BOOST_CHECK(cache.GetStats().nEvictions >= 3 * nSlots);
+
+    // a cache of size zero holds nothing
+    CCuckooCache empty(0);
+    empty.Insert(vEntries[0]);
+    BOOST_CHECK(!empty.Contains(vEntries[0]));
+}
+
+static void ContainsAll(const CCuckooCache* pcache, const std::vector<uint256>* pvEntries, bool* pfOk)
+{
+    for (int n = 0; n < 20; n++)
+        for (size_t i = 0; i < pvEntries->size(); i++)
+            if (!pcache->Contains((*pvEntries)[i]))
+                *pfOk = false;
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_concurrent_reads)
+{
+    // entries that are never moved stay visible to readers while other entries are inserted
+    CCuckooCache cache(1 << 22);
+    std::vector<uint256> vEntries;
+    for (int i = 0; i < 1000; i++) {
+        vEntries.push_back(GetRandHash());
+        cache.Insert(vEntries.back());
+    }
+    bool fOk[4] = {true, true, true, true};
+    boost::thread_group threads;
+    for (int i = 0; i < 4; i++)
+        threads.create_thread(boost::bind(&ContainsAll, &cache, &vEntries, &fOk[i]));
+    for (int i = 0; i < 1000; i++)
+        cache.Insert(GetRandHash());
+    threads.join_all();
+    for (int i = 0; i < 4; i++)
+        BOOST_CHECK(fOk[i]);
+}
+
+static void AlternateEntries(CCuckooCache* pcache, const uint256* pentryA, const uint256* pentryB, int nRounds, boost::atomic<bool>* pfDone)
+{
+    for (int n = 0; n < nRounds; n++) {
+        pcache->Insert(*pentryA);
+        pcache->Erase(*pentryA);
+        pcache->Insert(*pentryB);
+        pcache->Erase(*pentryB);
+    }
+    *pfDone = true;
+}
+
+static void ContainsNever(const CCuckooCache* pcache, const uint256* pentry, const boost::atomic<bool>* pfDone, bool* pfOk)
+{
+    while (!*pfDone)
+        if (pcache->Contains(*pentry))
+            *pfOk = false;
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_torn_reads)
+{
+    // a slot keeps being rewritten with A and B; a reader that loads half of
+    // each must not match the mix of the two, which was never inserted
+    CCuckooCache cache(72);
+    BOOST_CHECK_EQUAL(cache.Slots(), (size_t)CCuckooCache::SLOTS_PER_BUCKET);
+    uint256 entryA = GetRandHash(), entryB = GetRandHash(), entryMix;
+    memcpy(entryB.begin(), entryA.begin(), 16);
+    memcpy(entryMix.begin(), entryA.begin(), 24);
+    memcpy(entryMix.begin() + 24, entryB.begin() + 24, 8);
+
+    boost::atomic<bool> fDone(false);
+    bool fOk[4] = {true, true, true, true};
+    boost::thread_group threads;
+    for (int i = 0; i < 4; i++)
+        threads.create_thread(boost::bind(&ContainsNever, &cache, &entryMix, &fDone, &fOk[i]));
+    AlternateEntries(&cache, &entryA, &entryB, 200000, &fDone);
+    threads.join_all();
+    for (int i = 0; i < 4; i++)
+        BOOST_CHECK(fOk[i]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "dbwrapper.h"
+#include "main.h"
+#include "txdb.h"
 #include "uint256.h"
 #include "random.h"
 #include "test/test_onex.h"
@@ -322,6 +324,93 @@ BOOST_AUTO_TEST_CASE(iterator_string_ordering)
     }
 }
 
+// Index writes are buffered until WriteBatchSync and visible to reads before that
+BOOST_FIXTURE_TEST_CASE(blocktree_pending_index, TestingSetup)
+{
+    uint160 hashAddress(vector<unsigned char>(20, 0x42));
+    uint256 txid = GetRandHash();
+    vector<pair<CAddressIndexKey, CAmount> > vAddressIndex;
+    for (int nHeight = 1; nHeight <= 3; nHeight++)
+        vAddressIndex.push_back(make_pair(CAddressIndexKey(1, hashAddress, nHeight, 0, txid, 0, false), nHeight * COIN));
+    BOOST_CHECK(pblocktree->WriteAddressIndex(vAddressIndex));
+    BOOST_CHECK(pblocktree->PendingIndexUsage() > 0);
+
+    vector<pair<CAddressIndexKey, CAmount> > vRead;
+    BOOST_CHECK(pblocktree->ReadAddressIndex(hashAddress, 1, vRead));
+    BOOST_CHECK_EQUAL(vRead.size(), 3);
+
+    // flush, the marker records the tip
+    uint256 hashBlock = GetRandHash();
+    uint256 hashRead;
+    BOOST_CHECK(pblocktree->WriteBatchSync(vector<pair<int, const CBlockFileInfo*> >(), 0, vector<const CBlockIndex*>(), hashBlock));
+    BOOST_CHECK_EQUAL(pblocktree->PendingIndexUsage(), 0);
+    BOOST_CHECK(pblocktree->ReadIndexBestBlock(hashRead));
+    BOOST_CHECK(hashRead == hashBlock);
+    vRead.clear();
+    BOOST_CHECK(pblocktree->ReadAddressIndex(hashAddress, 1, vRead));
+    BOOST_CHECK_EQUAL(vRead.size(), 3);
+
+    // a pending erase hides the entry on disk, pending writes merge in key order
+    BOOST_CHECK(pblocktree->EraseAddressIndex(vector<pair<CAddressIndexKey, CAmount> >(1, vAddressIndex[1])));
+    BOOST_CHECK(pblocktree->WriteAddressIndex(vector<pair<CAddressIndexKey, CAmount> >(1,
+                make_pair(CAddressIndexKey(1, hashAddress, 4, 0, txid, 0, false), 4 * COIN))));
+    vRead.clear();
+    BOOST_CHECK(pblocktree->ReadAddressIndex(hashAddress, 1, vRead));
+    BOOST_CHECK_EQUAL(vRead.size(), 3);
+    if (vRead.size() == 3) {
+        BOOST_CHECK_EQUAL(vRead[0].first.blockHeight, 1);
+        BOOST_CHECK_EQUAL(vRead[1].first.blockHeight, 3);
+        BOOST_CHECK_EQUAL(vRead[2].first.blockHeight, 4);
+        BOOST_CHECK_EQUAL(vRead[2].second, 4 * COIN);
+    }
+
+    // point lookups
+    CDiskTxPos pos(CDiskBlockPos(1, 2), 3);
+    CDiskTxPos posRead;
+    BOOST_CHECK(!pblocktree->ReadTxIndex(txid, posRead));
+    BOOST_CHECK(pblocktree->WriteTxIndex(vector<pair<uint256, CDiskTxPos> >(1, make_pair(txid, pos))));
+    BOOST_CHECK(pblocktree->ReadTxIndex(txid, posRead));
+    BOOST_CHECK_EQUAL(posRead.nTxOffset, 3);
+}
 
+BOOST_FIXTURE_TEST_CASE(coinsdb_async_write, TestingSetup)
+{
+    CCoinsViewDB coinsdb(1 << 20, true);
+    coinsdb.SetAsyncWrite(true);
+
+    uint256 txid = GetRandHash();
+    uint256 hashBlock = GetRandHash();
+    {
+        CCoinsViewCache cache(&coinsdb);
+        {
+            CCoinsModifier coins = cache.ModifyNewCoins(txid);
+            coins->vout.resize(1);
+            coins->vout[0].nValue = COIN;
+            coins->nHeight = 1;
+        }
+        cache.SetBestBlock(hashBlock);
+        BOOST_CHECK(cache.Flush());
+    }
+
+    // visible while the write may still be in flight
+    CCoins coins;
+    BOOST_CHECK(coinsdb.GetCoins(txid, coins));
+    BOOST_CHECK_EQUAL(coins.vout[0].nValue, COIN);
+    BOOST_CHECK(coinsdb.GetBestBlock() == hashBlock);
+
+    // spending it waits for the previous write and erases it again
+    {
+        CCoinsViewCache cache(&coinsdb);
+        cache.ModifyCoins(txid)->Clear();
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(!coinsdb.HaveCoins(txid));
+
+    // and on disk once it is done
+    coinsdb.SetAsyncWrite(false);
+    BOOST_CHECK_EQUAL(coinsdb.PendingWriteUsage(), 0);
+    BOOST_CHECK(!coinsdb.HaveCoins(txid));
+    BOOST_CHECK(coinsdb.GetBestBlock() == hashBlock);
+}
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,123 @@
+// Copyright (c) 2014-2017 The Onex Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "arith_uint256.h"
+#include "clientversion.h"
+#include "governance-votedb.h"
+#include "streams.h"
+
+#include "test/test_onex.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(governance_votedb_tests, BasicTestingSetup)
+
+static CGovernanceVote CreateVote(int nMasternode, int nParent, vote_outcome_enum_t eOutcome)
+{
+    CTxIn vinMasternode(COutPoint(ArithToUint256(arith_uint256(nMasternode)), nMasternode));
+    CGovernanceVote vote(vinMasternode, ArithToUint256(arith_uint256(nParent)), VOTE_SIGNAL_FUNDING, eOutcome);
+    vote.SetTime(1000 + nMasternode);
+    vote.SetSignature(std::vector<unsigned char>(65, (unsigned char)nMasternode));
+    return vote;
+}
+
+static bool Compare(const CGovernanceObjectVoteFile& file1, const CGovernanceObjectVoteFile& file2)
+{
+    std::vector<CGovernanceVote> vecVotes1 = file1.GetVotes();
+    std::vector<CGovernanceVote> vecVotes2 = file2.GetVotes();
+    if(vecVotes1.size() != vecVotes2.size()) {
+        return false;
+    }
+    for(size_t i = 0; i < vecVotes1.size(); ++i) {
+        if(!(vecVotes1[i] == vecVotes2[i])) {
+            return false;
+        }
+        CGovernanceVote vote;
+        if(!file2.GetVote(vecVotes1[i].GetHash(), vote)) {
+            return false;
+        }
+        if(GetSerializeSize(vote, SER_NETWORK, PROTOCOL_VERSION) != GetSerializeSize(vecVotes1[i], SER_NETWORK, PROTOCOL_VERSION)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(governance_votedb_test)
+{
+    CGovernanceObjectVoteFile fileTest1;
+    BOOST_CHECK(fileTest1.GetVoteCount() == 0);
+
+    // add 100 votes, enough to grow the index a few times
+    std::vector<CGovernanceVote> vecVotes;
+    for(int i = 0; i < 100; ++i) {
+        vecVotes.push_back(CreateVote(i, 1, VOTE_OUTCOME_YES));
+        fileTest1.AddVote(vecVotes.back());
+    }
+    BOOST_CHECK(fileTest1.GetVoteCount() == 100);
+
+    // every vote can be found and comes back unchanged
+    for(size_t i = 0; i < vecVotes.size(); ++i) {
+        CGovernanceVote vote;
+        BOOST_CHECK(fileTest1.HasVote(vecVotes[i].GetHash()));
+        BOOST_CHECK(fileTest1.GetVote(vecVotes[i].GetHash(), vote));
+        BOOST_CHECK(vote == vecVotes[i]);
+        BOOST_CHECK(vote.GetHash() == vecVotes[i].GetHash());
+    }
+    BOOST_CHECK(!fileTest1.HasVote(CreateVote(100, 1, VOTE_OUTCOME_YES).GetHash()));
+
+    // votes are returned most recent first
+    std::vector<CGovernanceVote> vecResult = fileTest1.GetVotes();
+    BOOST_CHECK(vecResult.size() == 100);
+    BOOST_CHECK(vecResult.front() == vecVotes.back());
+    BOOST_CHECK(vecResult.back() == vecVotes.front());
+
+    // remove the votes of one masternode
+    fileTest1.RemoveVotesFromMasternode(vecVotes[42].GetVinMasternode());
+    BOOST_CHECK(fileTest1.GetVoteCount() == 99);
+    BOOST_CHECK(!fileTest1.HasVote(vecVotes[42].GetHash()));
+    for(size_t i = 0; i < vecVotes.size(); ++i) {
+        if(i == 42) continue;
+        CGovernanceVote vote;
+        BOOST_CHECK(fileTest1.GetVote(vecVotes[i].GetHash(), vote));
+        BOOST_CHECK(vote == vecVotes[i]);
+    }
+
+    // test serialization, the format is the vote count followed by a list of votes
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << fileTest1;
+    BOOST_CHECK(ss.size() == GetSerializeSize(fileTest1, SER_DISK, CLIENT_VERSION));
+
+    CDataStream ssList(SER_DISK, CLIENT_VERSION);
+    std::list<CGovernanceVote> listVotes;
+    vecResult = fileTest1.GetVotes();
+    listVotes.assign(vecResult.begin(), vecResult.end());
+    ssList << fileTest1.GetVoteCount() << listVotes;
+    BOOST_CHECK(ss.str() == ssList.str());
+
+    CGovernanceObjectVoteFile fileTest2;
+    ss >> fileTest2;
+    BOOST_CHECK(fileTest2.GetVoteCount() == 99);
+    BOOST_CHECK(Compare(fileTest1, fileTest2));
+
+    // duplicates in a serialized list are dropped on load
+    listVotes.push_back(listVotes.front());
+    CDataStream ssDup(SER_DISK, CLIENT_VERSION);
+    ssDup << (int)listVotes.size() << listVotes;
+    CGovernanceObjectVoteFile fileTest3;
+    ssDup >> fileTest3;
+    BOOST_CHECK(fileTest3.GetVoteCount() == 99);
+    BOOST_CHECK(Compare(fileTest1, fileTest3));
+
+    // test copy constructor
+    CGovernanceObjectVoteFile fileTest4(fileTest1);
+    BOOST_CHECK(Compare(fileTest1, fileTest4));
+
+    // test assignment operator
+    CGovernanceObjectVoteFile fileTest5;
+    fileTest5 = fileTest1;
+    BOOST_CHECK(Compare(fileTest1, fileTest5));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 #include "chainparams.h"
 #include "hash.h"
 #include "main.h"
+#include "memusage.h"
 #include "pow.h"
 #include "uint256.h"
 
@@ -23,6 +24,7 @@ static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
 static const char DB_ADDRESSINDEX = 'a';
 static const char DB_ADDRESSUNSPENTINDEX = 'u';
+static const char DB_ADDRESSBALANCEINDEX = 'A';
 static const char DB_TIMESTAMPINDEX = 's';
 static const char DB_SPENTINDEX = 'p';
 static const char DB_BLOCK_INDEX = 'b';
@@ -31,28 +33,155 @@ static const char DB_BEST_BLOCK = 'B';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_INDEX_BEST_BLOCK = 'I';
 
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true),
+    fAsyncWrite(false), nWritingUsage(0), fWriting(false), fWriteFailed(false)
 {
 }
 
+CCoinsViewDB::~CCoinsViewDB()
+{
+    // the last flush has to be on disk before the database is closed
+    if (writerThread.joinable())
+        writerThread.join();
+}
+
+void CCoinsViewDB::SetAsyncWrite(bool fAsync)
+{
+    WaitForWrite();
+    fAsyncWrite = fAsync;
+}
+
+void CCoinsViewDB::WaitForWrite() const
+{
+    boost::unique_lock<boost::mutex> lock(mutexWriting);
+    while (fWriting && !fWriteFailed)
+        condWriting.wait(lock);
+}
+
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
+    {
+        boost::unique_lock<boost::mutex> lock(mutexWriting);
+        if (fWriting) {
+            CCoinsMap::const_iterator it = mapWriting.find(txid);
+            if (it != mapWriting.end()) {
+                if (it->second.coins.IsPruned())
+                    return false;
+                coins = it->second.coins;
+                return true;
+            }
+        }
+    }
     return db.Read(make_pair(DB_COINS, txid), coins);
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
+    {
+        boost::unique_lock<boost::mutex> lock(mutexWriting);
+        if (fWriting) {
+            CCoinsMap::const_iterator it = mapWriting.find(txid);
+            if (it != mapWriting.end())
+                return !it->second.coins.IsPruned();
+        }
+    }
     return db.Exists(make_pair(DB_COINS, txid));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
+    {
+        boost::unique_lock<boost::mutex> lock(mutexWriting);
+        if (fWriting && !hashWriting.IsNull())
+            return hashWriting;
+    }
     uint256 hashBestChain;
     if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256();
     return hashBestChain;
 }
 
+size_t CCoinsViewDB::PendingWriteUsage() const {
+    boost::unique_lock<boost::mutex> lock(mutexWriting);
+    return nWritingUsage;
+}
+
+bool CCoinsViewDB::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    CDBBatch batch(&db.GetObfuscateKey());
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (it->second.coins.IsPruned())
+            batch.Erase(make_pair(DB_COINS, it->first));
+        else
+            batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+    }
+    if (!hashBlock.IsNull())
+        batch.Write(DB_BEST_BLOCK, hashBlock);
+    return db.WriteBatch(batch);
+}
+
+void CCoinsViewDB::ThreadWriteCoins()
+{
+    RenameThread("onex-coinsdb");
+    int64_t nStart = GetTimeMillis();
+
+    // mapWriting is not modified while fWriting is set, no lock needed to read it
+    bool fOk = false;
+    try {
+        fOk = WriteCoins(mapWriting, hashWriting);
+    } catch (const std::exception& e) {
+        LogPrintf("CCoinsViewDB::%s -- %s\n", __func__, e.what());
+    }
+
+    boost::unique_lock<boost::mutex> lock(mutexWriting);
+    if (fOk) {
+        LogPrint("coindb", "CCoinsViewDB::%s -- wrote %u transactions in %dms\n", __func__, (unsigned int)mapWriting.size(), GetTimeMillis() - nStart);
+        mapWriting.clear();
+        nWritingUsage = 0;
+        fWriting = false;
+    } else {
+        // keep serving the snapshot, the next BatchWrite reports the failure
+        LogPrintf("CCoinsViewDB::%s -- failed to write %u transactions to coin database\n", __func__, (unsigned int)mapWriting.size());
+        fWriteFailed = true;
+    }
+    condWriting.notify_all();
+}
+
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    // one snapshot at a time, this bounds the memory not on disk yet
+    WaitForWrite();
+    if (writerThread.joinable())
+        writerThread.join();
+    if (fWriteFailed)
+        return false;
+
+    if (fAsyncWrite) {
+        // hand the dirty coins to the writer and return
+        CCoinsMap mapSnapshot;
+        size_t nUsage = 0;
+        for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+            if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+                CCoinsCacheEntry& entry = mapSnapshot[it->first];
+                entry.coins.swap(it->second.coins);
+                entry.flags = it->second.flags;
+                nUsage += entry.coins.DynamicMemoryUsage();
+            }
+            CCoinsMap::iterator itOld = it++;
+            mapCoins.erase(itOld);
+        }
+        nUsage += memusage::DynamicUsage(mapSnapshot);
+
+        LogPrint("coindb", "Committing %u changed transactions to coin database in the background...\n", (unsigned int)mapSnapshot.size());
+        {
+            boost::unique_lock<boost::mutex> lock(mutexWriting);
+            mapWriting.swap(mapSnapshot);
+            hashWriting = hashBlock;
+            nWritingUsage = nUsage;
+            fWriting = true;
+        }
+        writerThread = boost::thread(boost::bind(&CCoinsViewDB::ThreadWriteCoins, this));
+        return true;
+    }
+
     CDBBatch batch(&db.GetObfuscateKey());
     size_t count = 0;
     size_t changed = 0;
@@ -75,7 +204,156 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+namespace {
+
+template <typename T>
+std::string SerializeIndexItem(const T& obj)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss.reserve(ss.GetSerializeSize(obj));
+    ss << obj;
+    return std::string(ss.begin(), ss.end());
+}
+
+template <typename T>
+bool UnserializeIndexItem(const std::string& str, T& obj)
+{
+    try {
+        CDataStream ss(str.data(), str.data() + str.size(), SER_DISK, CLIENT_VERSION);
+        ss >> obj;
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+size_t PendingEntryUsage(const std::string& strKey, const std::string& strValue)
+{
+    return memusage::MallocUsage(sizeof(memusage::stl_tree_node<CBlockTreeDB::PendingMap::value_type>)) +
+           memusage::MallocUsage(strKey.capacity()) + memusage::MallocUsage(strValue.capacity());
+}
+
+/**
+ * Iterates the block tree database with the buffered index writes applied,
+ * in key order. The caller holds cs_pending while it is in use.
+ */
+class CPendingIndexCursor
+{
+private:
+    boost::scoped_ptr<CDBIterator> pcursor;
+    const CBlockTreeDB::PendingMap& mapPending;
+    CBlockTreeDB::PendingMap::const_iterator it;
+    bool fFromPending;
+
+    // Position on the lower of the two keys, skipping buffered erases and
+    // database entries shadowed by a buffered one
+    void Settle()
+    {
+        while (it != mapPending.end()) {
+            if (pcursor->Valid()) {
+                std::string strKey = pcursor->GetKeyBytes();
+                if (strKey < it->first) {
+                    fFromPending = false;
+                    return;
+                }
+                if (strKey == it->first)
+                    pcursor->Next();
+            }
+            if (!it->second.first) {
+                fFromPending = true;
+                return;
+            }
+            ++it;
+        }
+        fFromPending = false;
+    }
+
+public:
+    CPendingIndexCursor(CDBIterator* pcursorIn, const CBlockTreeDB::PendingMap& mapPendingIn) :
+        pcursor(pcursorIn), mapPending(mapPendingIn), it(mapPendingIn.end()), fFromPending(false) {}
+
+    template <typename K> void Seek(const K& key)
+    {
+        pcursor->Seek(key);
+        it = mapPending.lower_bound(SerializeIndexItem(key));
+        Settle();
+    }
+
+    bool Valid() { return fFromPending || pcursor->Valid(); }
+
+    void Next()
+    {
+        if (fFromPending)
+            ++it;
+        else
+            pcursor->Next();
+        Settle();
+    }
+
+    template <typename K> bool GetKey(K& key)
+    {
+        return fFromPending ? UnserializeIndexItem(it->first, key) : pcursor->GetKey(key);
+    }
+
+    template <typename V> bool GetValue(V& value)
+    {
+        return fFromPending ? UnserializeIndexItem(it->second.second, value) : pcursor->GetValue(value);
+    }
+};
+
+} // anon namespace
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe), nPendingUsage(0) {
+}
+
+template <typename K, typename V>
+void CBlockTreeDB::BufferWrite(const K& key, const V& value)
+{
+    AssertLockHeld(cs_pending);
+    std::string strKey = SerializeIndexItem(key);
+    PendingMap::iterator it = mapPending.find(strKey);
+    if (it != mapPending.end()) {
+        nPendingUsage -= PendingEntryUsage(it->first, it->second.second);
+        mapPending.erase(it);
+    }
+    it = mapPending.insert(std::make_pair(strKey, std::make_pair(false, SerializeIndexItem(value)))).first;
+    nPendingUsage += PendingEntryUsage(it->first, it->second.second);
+}
+
+template <typename K>
+void CBlockTreeDB::BufferErase(const K& key)
+{
+    AssertLockHeld(cs_pending);
+    std::string strKey = SerializeIndexItem(key);
+    PendingMap::iterator it = mapPending.find(strKey);
+    if (it != mapPending.end()) {
+        nPendingUsage -= PendingEntryUsage(it->first, it->second.second);
+        mapPending.erase(it);
+    }
+    it = mapPending.insert(std::make_pair(strKey, std::make_pair(true, std::string()))).first;
+    nPendingUsage += PendingEntryUsage(it->first, it->second.second);
+}
+
+template <typename K, typename V>
+bool CBlockTreeDB::ReadIndex(const K& key, V& value) const
+{
+    {
+        LOCK(cs_pending);
+        PendingMap::const_iterator it = mapPending.find(SerializeIndexItem(key));
+        if (it != mapPending.end())
+            return !it->second.first && UnserializeIndexItem(it->second.second, value);
+    }
+    return Read(key, value);
+}
+
+size_t CBlockTreeDB::PendingIndexUsage() const
+{
+    LOCK(cs_pending);
+    return nPendingUsage;
+}
+
+bool CBlockTreeDB::ReadIndexBestBlock(uint256& hashBlock) {
+    return Read(DB_INDEX_BEST_BLOCK, hashBlock);
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -99,6 +377,8 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 }
 
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
+    // the statistics are computed from the database alone
+    WaitForWrite();
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
@@ -144,7 +424,7 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     return true;
 }
 
-bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
+bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo, const uint256& hashIndexBestBlock) {
     CDBBatch batch(&GetObfuscateKey());
     for (std::vector<std::pair<int, const CBlockFileInfo*> >::const_iterator it=fileInfo.begin(); it != fileInfo.end(); it++) {
         batch.Write(make_pair(DB_BLOCK_FILES, it->first), *it->second);
@@ -153,62 +433,95 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
         batch.Write(make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), CDiskBlockIndex(*it));
     }
-    return WriteBatch(batch, true);
+
+    // Index writes go in the same batch, the marker tells which tip they belong to
+    LOCK(cs_pending);
+    for (PendingMap::const_iterator it = mapPending.begin(); it != mapPending.end(); it++) {
+        CFlatData key((void*)it->first.data(), (void*)(it->first.data() + it->first.size()));
+        if (it->second.first)
+            batch.Erase(key);
+        else
+            batch.Write(key, CFlatData((void*)it->second.second.data(), (void*)(it->second.second.data() + it->second.second.size())));
+    }
+    if (!hashIndexBestBlock.IsNull())
+        batch.Write(DB_INDEX_BEST_BLOCK, hashIndexBestBlock);
+
+    LogPrint("coindb", "Committing %u index changes (%.1fMiB) to block tree database...\n", (unsigned int)mapPending.size(), nPendingUsage * (1.0 / (1<<20)));
+    if (!WriteBatch(batch, true))
+        return false;
+    mapPending.clear();
+    nPendingUsage = 0;
+    return true;
 }
 
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
-    return Read(make_pair(DB_TXINDEX, txid), pos);
+    return ReadIndex(make_pair(DB_TXINDEX, txid), pos);
 }
 
 bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
-    CDBBatch batch(&GetObfuscateKey());
+    LOCK(cs_pending);
     for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Write(make_pair(DB_TXINDEX, it->first), it->second);
-    return WriteBatch(batch);
+        BufferWrite(make_pair(DB_TXINDEX, it->first), it->second);
+    return true;
 }
 
 bool CBlockTreeDB::ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value) {
-    return Read(make_pair(DB_SPENTINDEX, key), value);
+    return ReadIndex(make_pair(DB_SPENTINDEX, key), value);
 }
 
 bool CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect) {
-    CDBBatch batch(&GetObfuscateKey());
+    LOCK(cs_pending);
     for (std::vector<std::pair<CSpentIndexKey,CSpentIndexValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
         if (it->second.IsNull()) {
-            batch.Erase(make_pair(DB_SPENTINDEX, it->first));
+            BufferErase(make_pair(DB_SPENTINDEX, it->first));
         } else {
-            batch.Write(make_pair(DB_SPENTINDEX, it->first), it->second);
+            BufferWrite(make_pair(DB_SPENTINDEX, it->first), it->second);
         }
     }
-    return WriteBatch(batch);
+    return true;
 }
 
 bool CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect) {
-    CDBBatch batch(&GetObfuscateKey());
+    LOCK(cs_pending);
     for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
         if (it->second.IsNull()) {
-            batch.Erase(make_pair(DB_ADDRESSUNSPENTINDEX, it->first));
+            BufferErase(make_pair(DB_ADDRESSUNSPENTINDEX, it->first));
         } else {
-            batch.Write(make_pair(DB_ADDRESSUNSPENTINDEX, it->first), it->second);
+            BufferWrite(make_pair(DB_ADDRESSUNSPENTINDEX, it->first), it->second);
         }
     }
-    return WriteBatch(batch);
+    return true;
 }
 
 bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
-                                           std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs) {
+                                           std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs,
+                                           const CAddressUnspentKey* pkeyAfter, size_t nLimit) {
 
-    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    LOCK(cs_pending);
+    boost::scoped_ptr<CPendingIndexCursor> pcursor(new CPendingIndexCursor(NewIterator(), mapPending));
 
-    pcursor->Seek(make_pair(DB_ADDRESSUNSPENTINDEX, CAddressIndexIteratorKey(type, addressHash)));
+    // Continue after pkeyAfter, which is skipped if it is still there
+    std::string strKeyAfter;
+    if (pkeyAfter) {
+        pcursor->Seek(make_pair(DB_ADDRESSUNSPENTINDEX, *pkeyAfter));
+        strKeyAfter = SerializeIndexItem(*pkeyAfter);
+    } else {
+        pcursor->Seek(make_pair(DB_ADDRESSUNSPENTINDEX, CAddressIndexIteratorKey(type, addressHash)));
+    }
 
-    while (pcursor->Valid()) {
+    size_t nCount = 0;
+    while (pcursor->Valid() && (nLimit == 0 || nCount < nLimit)) {
         boost::this_thread::interruption_point();
         std::pair<char,CAddressUnspentKey> key;
         if (pcursor->GetKey(key) && key.first == DB_ADDRESSUNSPENTINDEX && key.second.hashBytes == addressHash) {
+            if (pkeyAfter && nCount == 0 && SerializeIndexItem(key.second) == strKeyAfter) {
+                pcursor->Next();
+                continue;
+            }
             CAddressUnspentValue nValue;
             if (pcursor->GetValue(nValue)) {
                 unspentOutputs.push_back(make_pair(key.second, nValue));
+                nCount++;
                 pcursor->Next();
             } else {
                 return error("failed to get address unspent value");
@@ -222,41 +535,54 @@ bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
 }
 
 bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
-    CDBBatch batch(&GetObfuscateKey());
+    LOCK(cs_pending);
     for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Write(make_pair(DB_ADDRESSINDEX, it->first), it->second);
-    return WriteBatch(batch);
+        BufferWrite(make_pair(DB_ADDRESSINDEX, it->first), it->second);
+    return true;
 }
 
 bool CBlockTreeDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
-    CDBBatch batch(&GetObfuscateKey());
+    LOCK(cs_pending);
     for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Erase(make_pair(DB_ADDRESSINDEX, it->first));
-    return WriteBatch(batch);
+        BufferErase(make_pair(DB_ADDRESSINDEX, it->first));
+    return true;
 }
 
 bool CBlockTreeDB::ReadAddressIndex(uint160 addressHash, int type,
                                     std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
-                                    int start, int end) {
-
-    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
-
-    if (start > 0 && end > 0) {
+                                    int start, int end,
+                                    const CAddressIndexKey* pkeyAfter, size_t nLimit) {
+
+    LOCK(cs_pending);
+    boost::scoped_ptr<CPendingIndexCursor> pcursor(new CPendingIndexCursor(NewIterator(), mapPending));
+
+    // Continue after pkeyAfter, which is skipped if it is still there
+    std::string strKeyAfter;
+    if (pkeyAfter) {
+        pcursor->Seek(make_pair(DB_ADDRESSINDEX, *pkeyAfter));
+        strKeyAfter = SerializeIndexItem(*pkeyAfter);
+    } else if (start > 0 && end > 0) {
         pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorHeightKey(type, addressHash, start)));
     } else {
         pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorKey(type, addressHash)));
     }
 
-    while (pcursor->Valid()) {
+    size_t nCount = 0;
+    while (pcursor->Valid() && (nLimit == 0 || nCount < nLimit)) {
         boost::this_thread::interruption_point();
         std::pair<char,CAddressIndexKey> key;
         if (pcursor->GetKey(key) && key.first == DB_ADDRESSINDEX && key.second.hashBytes == addressHash) {
             if (end > 0 && key.second.blockHeight > end) {
                 break;
             }
+            if (pkeyAfter && nCount == 0 && SerializeIndexItem(key.second) == strKeyAfter) {
+                pcursor->Next();
+                continue;
+            }
             CAmount nValue;
             if (pcursor->GetValue(nValue)) {
                 addressIndex.push_back(make_pair(key.second, nValue));
+                nCount++;
                 pcursor->Next();
             } else {
                 return error("failed to get address index value");
@@ -269,15 +595,32 @@ bool CBlockTreeDB::ReadAddressIndex(uint160 addressHash, int type,
     return true;
 }
 
+bool CBlockTreeDB::ReadAddressBalanceIndex(uint160 addressHash, int type, CAddressBalanceValue &value) {
+    return ReadIndex(make_pair(DB_ADDRESSBALANCEINDEX, CAddressIndexIteratorKey(type, addressHash)), value);
+}
+
+bool CBlockTreeDB::UpdateAddressBalanceIndex(const std::vector<std::pair<CAddressIndexIteratorKey, CAddressBalanceValue> >&vect) {
+    LOCK(cs_pending);
+    for (std::vector<std::pair<CAddressIndexIteratorKey, CAddressBalanceValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        if (it->second.IsNull()) {
+            BufferErase(make_pair(DB_ADDRESSBALANCEINDEX, it->first));
+        } else {
+            BufferWrite(make_pair(DB_ADDRESSBALANCEINDEX, it->first), it->second);
+        }
+    }
+    return true;
+}
+
 bool CBlockTreeDB::WriteTimestampIndex(const CTimestampIndexKey &timestampIndex) {
-    CDBBatch batch(&GetObfuscateKey());
-    batch.Write(make_pair(DB_TIMESTAMPINDEX, timestampIndex), 0);
-    return WriteBatch(batch);
+    LOCK(cs_pending);
+    BufferWrite(make_pair(DB_TIMESTAMPINDEX, timestampIndex), 0);
+    return true;
 }
 
 bool CBlockTreeDB::ReadTimestampIndex(const unsigned int &high, const unsigned int &low, std::vector<uint256> &hashes) {
 
-    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    LOCK(cs_pending);
+    boost::scoped_ptr<CPendingIndexCursor> pcursor(new CPendingIndexCursor(NewIterator(), mapPending));
 
     pcursor->Seek(make_pair(DB_TIMESTAMPINDEX, CTimestampIndexIteratorKey(low)));
 
@@ -8,12 +8,15 @@
 
 #include "coins.h"
 #include "dbwrapper.h"
+#include "sync.h"
 
 #include <map>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <boost/thread.hpp>
+
 class CBlockFileInfo;
 class CBlockIndex;
 struct CDiskTxPos;
@@ -22,6 +25,7 @@ struct CAddressUnspentValue;
 struct CAddressIndexKey;
 struct CAddressIndexIteratorKey;
 struct CAddressIndexIteratorHeightKey;
+struct CAddressBalanceValue;
 struct CTimestampIndexKey;
 struct CTimestampIndexIteratorKey;
 struct CSpentIndexKey;
@@ -34,32 +38,86 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -dbasyncwrite default
+static const bool DEFAULT_DB_ASYNC_WRITE = true;
 
-/** CCoinsView backed by the coin database (chainstate/) */
+/**
+ * CCoinsView backed by the coin database (chainstate/)
+ *
+ * With async writes enabled, BatchWrite takes the dirty coins as a snapshot
+ * and a background thread writes them in one batch with the best block, so
+ * the database is always at a block boundary. Reads see the snapshot until
+ * it is on disk. One snapshot is written at a time; the next BatchWrite
+ * waits for it.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
+
+    bool fAsyncWrite;
+    boost::thread writerThread;
+
+    mutable boost::mutex mutexWriting;
+    mutable boost::condition_variable condWriting;
+    //! Coins being written by writerThread, not modified until the write is done
+    CCoinsMap mapWriting;
+    uint256 hashWriting;
+    size_t nWritingUsage;
+    bool fWriting;
+    bool fWriteFailed;
+
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
+    void ThreadWriteCoins();
+    //! Wait until the snapshot is on disk (or failed to write)
+    void WaitForWrite() const;
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~CCoinsViewDB();
+
+    //! Write flushed coins from a background thread
+    void SetAsyncWrite(bool fAsync);
 
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats) const;
+    size_t PendingWriteUsage() const;
 };
 
-/** Access to the block database (blocks/index/) */
+/**
+ * Access to the block database (blocks/index/)
+ *
+ * Writes to the tx, address, spent and timestamp indexes are buffered in
+ * memory and go to disk with the next WriteBatchSync, in the same batch as
+ * the block index and a marker of the chain tip they are valid for. Reads
+ * see the buffered entries on top of the database.
+ */
 class CBlockTreeDB : public CDBWrapper
 {
 public:
     CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+    //! Serialized key -> (erase, serialized value) of a buffered index write
+    typedef std::map<std::string, std::pair<bool, std::string> > PendingMap;
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
+
+    mutable CCriticalSection cs_pending;
+    PendingMap mapPending;
+    size_t nPendingUsage;
+
+    template <typename K, typename V> void BufferWrite(const K& key, const V& value);
+    template <typename K> void BufferErase(const K& key);
+    template <typename K, typename V> bool ReadIndex(const K& key, V& value) const;
 public:
-    bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
+    bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo, const uint256& hashIndexBestBlock);
+    //! Memory used by index writes that are not on disk yet
+    size_t PendingIndexUsage() const;
+    //! The chain tip the indexes on disk were last flushed at
+    bool ReadIndexBestBlock(uint256& hashBlock);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
     bool ReadLastBlockFile(int &nFile);
     bool WriteReindexing(bool fReindex);
@@ -70,12 +128,16 @@ public:
     bool UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect);
     bool UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect);
     bool ReadAddressUnspentIndex(uint160 addressHash, int type,
-                                 std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect);
+                                 std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect,
+                                 const CAddressUnspentKey* pkeyAfter = NULL, size_t nLimit = 0);
     bool WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
     bool EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
     bool ReadAddressIndex(uint160 addressHash, int type,
                           std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
-                          int start = 0, int end = 0);
+                          int start = 0, int end = 0,
+                          const CAddressIndexKey* pkeyAfter = NULL, size_t nLimit = 0);
+    bool ReadAddressBalanceIndex(uint160 addressHash, int type, CAddressBalanceValue &value);
+    bool UpdateAddressBalanceIndex(const std::vector<std::pair<CAddressIndexIteratorKey, CAddressBalanceValue> >&vect);
     bool WriteTimestampIndex(const CTimestampIndexKey &timestampIndex);
     bool ReadTimestampIndex(const unsigned int &high, const unsigned int &low, std::vector<uint256> &vect);
     bool WriteFlag(const std::string &name, bool fValue);
@@ -306,6 +306,20 @@ bool CCryptoKeyStore::AddKeyPubKey(const CKey& key, const CPubKey &pubkey)
 }
 
 
+bool CCryptoKeyStore::EncryptKey(const CKey& key, const CPubKey &pubkey, std::vector<unsigned char> &vchCryptedSecret) const
+{
+    // Copy the master key so that keys can be encrypted on several threads at once
+    CKeyingMaterial vMasterKeyCopy;
+    {
+        LOCK(cs_KeyStore);
+        if (!IsCrypted() || IsLocked(true))
+            return false;
+        vMasterKeyCopy = vMasterKey;
+    }
+    CKeyingMaterial vchSecret(key.begin(), key.end());
+    return EncryptSecret(vMasterKeyCopy, vchSecret, pubkey.GetHash(), vchCryptedSecret);
+}
+
 bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
     {
@@ -182,6 +182,8 @@ public:
 
     virtual bool AddCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret);
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
+    //! Encrypt a key with the master key without adding it, fails when not crypted or locked
+    bool EncryptKey(const CKey& key, const CPubKey &pubkey, std::vector<unsigned char> &vchCryptedSecret) const;
     bool HaveKey(const CKeyID &address) const
     {
         {
@@ -73,6 +73,49 @@ std::string DecodeDumpString(const std::string &str) {
     return ret.str();
 }
 
+/**
+ * Holds cs_main and cs_wallet while an import adds its keys or scripts.
+ * Rescan() releases them before it scans, the rescan takes them per block so
+ * other calls are answered meanwhile. Only one rescan runs at a time, so an
+ * import which rescans is refused while another rescan is running.
+ */
+class CImportScope
+{
+private:
+    CWalletRescanReserver reserver;
+    bool fLocked;
+
+    CImportScope(const CImportScope&);
+    void operator=(const CImportScope&);
+
+    void Unlock()
+    {
+        if (!fLocked)
+            return;
+        LEAVE_CRITICAL_SECTION(pwalletMain->cs_wallet);
+        LEAVE_CRITICAL_SECTION(cs_main);
+        fLocked = false;
+    }
+
+public:
+    explicit CImportScope(bool fRescan) : reserver(pwalletMain), fLocked(false)
+    {
+        if (fRescan && !reserver.Reserve())
+            throw JSONRPCError(RPC_WALLET_ERROR, "Wallet is currently rescanning, wait for it to finish");
+        ENTER_CRITICAL_SECTION(cs_main);
+        ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet);
+        fLocked = true;
+    }
+
+    ~CImportScope() { Unlock(); }
+
+    void Rescan(CBlockIndex* pindexStart, bool fUpdate = false)
+    {
+        Unlock();
+        pwalletMain->ScanForWalletTransactions(pindexStart, fUpdate, reserver);
+    }
+};
+
 UniValue importprivkey(const UniValue& params, bool fHelp)
 {
     if (!EnsureWalletIsAvailable(fHelp))
@@ -99,15 +142,6 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
         );
 
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
-
-    EnsureWalletIsUnlocked();
-
-    string strSecret = params[0].get_str();
-    string strLabel = "";
-    if (params.size() > 1)
-        strLabel = params[1].get_str();
-
     // Whether to perform rescan after import
     bool fRescan = true;
     if (params.size() > 2)
@@ -116,6 +150,15 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
     if (fRescan && fPruneMode)
         throw JSONRPCError(RPC_WALLET_ERROR, "Rescan is disabled in pruned mode");
 
+    CImportScope importScope(fRescan);
+
+    EnsureWalletIsUnlocked();
+
+    string strSecret = params[0].get_str();
+    string strLabel = "";
+    if (params.size() > 1)
+        strLabel = params[1].get_str();
+
     CBitcoinSecret vchSecret;
     bool fGood = vchSecret.SetString(strSecret);
 
@@ -144,7 +187,7 @@ UniValue importprivkey(const UniValue& params, bool fHelp)
         pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
 
         if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+            importScope.Rescan(chainActive.Genesis(), true);
         }
     }
 
@@ -221,7 +264,7 @@ UniValue importaddress(const UniValue& params, bool fHelp)
     if (params.size() > 3)
         fP2SH = params[3].get_bool();
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CImportScope importScope(fRescan);
 
     CBitcoinAddress address(params[0].get_str());
     if (address.IsValid()) {
@@ -237,7 +280,7 @@ UniValue importaddress(const UniValue& params, bool fHelp)
 
     if (fRescan)
     {
-        pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+        importScope.Rescan(chainActive.Genesis(), true);
         pwalletMain->ReacceptWalletTransactions();
     }
 
@@ -287,14 +330,14 @@ UniValue importpubkey(const UniValue& params, bool fHelp)
     if (!pubKey.IsFullyValid())
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Pubkey is not a valid public key");
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CImportScope importScope(fRescan);
 
     ImportAddress(CBitcoinAddress(pubKey.GetID()), strLabel);
     ImportScript(GetScriptForRawPubKey(pubKey), strLabel, false);
 
     if (fRescan)
     {
-        pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+        importScope.Rescan(chainActive.Genesis(), true);
         pwalletMain->ReacceptWalletTransactions();
     }
 
@@ -325,7 +368,7 @@ UniValue importwallet(const UniValue& params, bool fHelp)
     if (fPruneMode)
         throw JSONRPCError(RPC_WALLET_ERROR, "Importing wallets is disabled in pruned mode");
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CImportScope importScope(true);
 
     EnsureWalletIsUnlocked();
 
@@ -400,7 +443,7 @@ UniValue importwallet(const UniValue& params, bool fHelp)
         pwalletMain->nTimeFirstKey = nTimeBegin;
 
     LogPrintf("Rescanning last %i blocks\n", chainActive.Height() - pindex->nHeight + 1);
-    pwalletMain->ScanForWalletTransactions(pindex);
+    importScope.Rescan(pindex);
     pwalletMain->MarkDirty();
 
     if (!fGood)
@@ -433,7 +476,7 @@ UniValue importelectrumwallet(const UniValue& params, bool fHelp)
     if (fPruneMode)
         throw JSONRPCError(RPC_WALLET_ERROR, "Importing wallets is disabled in pruned mode");
 
-    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CImportScope importScope(true);
 
     EnsureWalletIsUnlocked();
 
@@ -535,7 +578,7 @@ UniValue importelectrumwallet(const UniValue& params, bool fHelp)
         pwalletMain->nTimeFirstKey = nTimeBegin;
 
     LogPrintf("Rescanning %i blocks\n", chainActive.Height() - nStartHeight + 1);
-    pwalletMain->ScanForWalletTransactions(chainActive[nStartHeight], true);
+    importScope.Rescan(chainActive[nStartHeight], true);
 
     if (!fGood)
         throw JSONRPCError(RPC_WALLET_ERROR, "Error adding some keys to wallet");
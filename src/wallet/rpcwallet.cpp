@@ -2404,6 +2404,53 @@ UniValue getwalletinfo(const UniValue& params, bool fHelp)
     return obj;
 }
 
+UniValue getrescaninfo(const UniValue& params, bool fHelp)
+{
+    if (!EnsureWalletIsAvailable(fHelp))
+        return NullUniValue;
+
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrescaninfo\n"
+            "Returns the progress of the running wallet rescan, or of the last one if none is running.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"scanning\": true|false,    (boolean) whether a rescan is running\n"
+            "  \"start_height\": xxxx,      (numeric) the height the rescan started at\n"
+            "  \"height\": xxxx,            (numeric) the last height added to the wallet\n"
+            "  \"tip_height\": xxxx,        (numeric) the chain height the rescan is scanning up to\n"
+            "  \"progress\": x.xxx,         (numeric) the fraction of the blocks scanned so far\n"
+            "  \"found\": xxxx,             (numeric) the number of transactions added or updated\n"
+            "  \"duration\": xxxx,          (numeric) the seconds spent scanning\n"
+            "  \"eta\": xxxx                (numeric) the estimated seconds left, only while scanning\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getrescaninfo", "")
+            + HelpExampleRpc("getrescaninfo", "")
+        );
+
+    // Deliberately no cs_main or cs_wallet, a rescan may be holding them
+    CRescanProgress progress = pwalletMain->GetRescanProgress();
+
+    int nTotal = progress.nTipHeight - progress.nStartHeight + 1;
+    int nDone = progress.nHeight < progress.nStartHeight ? 0 : progress.nHeight - progress.nStartHeight + 1;
+    int64_t nDuration = 0;
+    if (progress.nStartTime)
+        nDuration = (progress.fScanning ? GetTime() : progress.nEndTime) - progress.nStartTime;
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("scanning",      progress.fScanning));
+    obj.push_back(Pair("start_height",  progress.nStartHeight));
+    obj.push_back(Pair("height",        progress.nHeight));
+    obj.push_back(Pair("tip_height",    progress.nTipHeight));
+    obj.push_back(Pair("progress",      nTotal > 0 ? std::min(1.0, (double)nDone / nTotal) : 1.0));
+    obj.push_back(Pair("found",         progress.nFound));
+    obj.push_back(Pair("duration",      nDuration));
+    if (progress.fScanning)
+        obj.push_back(Pair("eta",       nDone > 0 ? (int64_t)((double)nDuration * std::max(0, nTotal - nDone) / nDone) : -1));
+    return obj;
+}
+
 UniValue keepass(const UniValue& params, bool fHelp) {
     string strCommand;
 
@@ -3,6 +3,12 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "wallet/wallet.h"
+#include "base58.h"
+#include "consensus/validation.h"
+#include "darksend.h"
+#include "main.h"
+#include "script/interpreter.h"
+#include "script/standard.h"
 
 #include <set>
 #include <stdint.h>
@@ -14,6 +20,8 @@
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
+extern CWallet* pwalletMain;
+
 // how many times to run all the tests to have a chance to catch errors that only show up with particular random shuffles
 #define RUN_TESTS 100
 
@@ -361,4 +369,495 @@ BOOST_AUTO_TEST_CASE(ApproximateBestSubset)
     BOOST_CHECK_EQUAL(setCoinsRet.size(), 101);
 }
 
+static CMutableTransaction make_rounds_tx(const CScript& scriptPubKey, const COutPoint& prevout, const std::vector<CAmount>& vecAmounts)
+{
+    CMutableTransaction tx;
+    tx.vin.push_back(CTxIn(prevout));
+    BOOST_FOREACH(CAmount nAmount, vecAmounts)
+        tx.vout.push_back(CTxOut(nAmount, scriptPubKey));
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(privatesend_rounds)
+{
+    CWallet walletRounds;
+    CKey key;
+    key.MakeNewKey(true);
+    walletRounds.AddKeyPubKey(key, key.GetPubKey());
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+    std::vector<CAmount> vecDenominationsOld = vecPrivateSendDenominations;
+    vecPrivateSendDenominations.clear();
+    vecPrivateSendDenominations.push_back((1 * COIN) + 1000);
+    vecPrivateSendDenominations.push_back((.1 * COIN) + 100);
+    CAmount nDenom = vecPrivateSendDenominations[0];
+
+    LOCK(walletRounds.cs_wallet);
+
+    // funded from outside, denominated: the first one in the chain
+    std::vector<CAmount> vecDenoms(2, nDenom);
+    CMutableTransaction txPrev = make_rounds_tx(scriptPubKey, COutPoint(GetRandHash(), 0), vecDenoms);
+    walletRounds.AddToWallet(CWalletTx(&walletRounds, txPrev), true, NULL);
+    BOOST_CHECK_EQUAL(walletRounds.GetRealInputPrivateSendRounds(CTxIn(txPrev.GetHash(), 0)), 0);
+
+    // each mixing tx adds a round, up to 16
+    std::vector<uint256> vecHashes;
+    for (int i = 0; i < 20; i++) {
+        txPrev = make_rounds_tx(scriptPubKey, COutPoint(txPrev.GetHash(), 1), vecDenoms);
+        walletRounds.AddToWallet(CWalletTx(&walletRounds, txPrev), true, NULL);
+        vecHashes.push_back(txPrev.GetHash());
+    }
+    BOOST_CHECK_EQUAL(walletRounds.GetRealInputPrivateSendRounds(CTxIn(vecHashes[2], 0)), 3);
+    BOOST_CHECK_EQUAL(walletRounds.GetRealInputPrivateSendRounds(CTxIn(vecHashes[19], 1)), 16);
+    BOOST_CHECK_EQUAL(walletRounds.GetRealInputPrivateSendRounds(CTxIn(vecHashes[14], 1)), 15);
+
+    // non-denominated, collateral and mixed outputs
+    std::vector<CAmount> vecMixed;
+    vecMixed.push_back(nDenom);
+    vecMixed.push_back(3 * COIN);
+    vecMixed.push_back(PRIVATESEND_COLLATERAL * 2);
+    CMutableTransaction txMixed = make_rounds_tx(scriptPubKey, COutPoint(vecHashes[5], 0), vecMixed);
+    walletRounds.AddToWallet(CWalletTx(&walletRounds, txMixed), true, NULL);
+    BOOST_CHECK_EQUAL(walletRounds.GetRealInputPrivateSendRounds(CTxIn(txMixed.GetHash(), 0)), 0);
+    BOOST_CHECK_EQUAL(walletRounds.GetRealInputPrivateSendRounds(CTxIn(txMixed.GetHash(), 1)), -2);
+    BOOST_CHECK_EQUAL(walletRounds.GetRealInputPrivateSendRounds(CTxIn(txMixed.GetHash(), 2)), -3);
+    BOOST_CHECK_EQUAL(walletRounds.GetRealInputPrivateSendRounds(CTxIn(GetRandHash(), 0)), -1);
+
+    // a parent showing up after its child invalidates the cached rounds
+    CMutableTransaction txParent = make_rounds_tx(scriptPubKey, COutPoint(vecHashes[9], 0), vecDenoms);
+    CMutableTransaction txChild = make_rounds_tx(scriptPubKey, COutPoint(txParent.GetHash(), 0), vecDenoms);
+    walletRounds.AddToWallet(CWalletTx(&walletRounds, txChild), true, NULL);
+    BOOST_CHECK_EQUAL(walletRounds.GetRealInputPrivateSendRounds(CTxIn(txChild.GetHash(), 0)), 0);
+    walletRounds.AddToWallet(CWalletTx(&walletRounds, txParent), true, NULL);
+    BOOST_CHECK_EQUAL(walletRounds.GetRealInputPrivateSendRounds(CTxIn(txChild.GetHash(), 0)), 12);
+
+    vecPrivateSendDenominations = vecDenominationsOld;
+}
+
+BOOST_AUTO_TEST_CASE(wallet_db_batch)
+{
+    LOCK(pwalletMain->cs_wallet);
+
+    // no batch, every operation gets a handle of its own
+    BOOST_CHECK(pwalletMain->GetBatchDB() == NULL);
+
+    std::set<int64_t> setPoolBefore(pwalletMain->setKeyPool);
+    {
+        CWalletDBBatch batch(pwalletMain);
+        CWalletDB* pwalletdb = pwalletMain->GetBatchDB();
+        BOOST_CHECK(pwalletdb != NULL);
+        BOOST_CHECK(CWalletDBScope(pwalletMain).get() == pwalletdb);
+
+        // nested batches share the handle of the outermost one
+        {
+            CWalletDBBatch batchInner(pwalletMain);
+            BOOST_CHECK(pwalletMain->GetBatchDB() == pwalletdb);
+        }
+        BOOST_CHECK(pwalletMain->GetBatchDB() == pwalletdb);
+
+        pwalletMain->TopUpKeyPool(pwalletMain->setKeyPool.size() + 10);
+
+        // writes are visible through the batch before the commit
+        CKeyPool keypool;
+        BOOST_CHECK(pwalletdb->ReadPool(*pwalletMain->setKeyPool.rbegin(), keypool));
+    }
+    BOOST_CHECK(pwalletMain->GetBatchDB() == NULL);
+    BOOST_CHECK(pwalletMain->setKeyPool.size() > setPoolBefore.size());
+
+    // and committed once the batch is closed
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+    BOOST_FOREACH(int64_t nIndex, pwalletMain->setKeyPool) {
+        CKeyPool keypool;
+        BOOST_CHECK(walletdb.ReadPool(nIndex, keypool));
+        BOOST_CHECK(pwalletMain->HaveKey(keypool.vchPubKey.GetID()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(keypool_parallel_topup)
+{
+    LOCK(pwalletMain->cs_wallet);
+
+    // large enough to be generated on several threads and written in two batches
+    unsigned int nTarget = pwalletMain->setKeyPool.size() + KEYPOOL_BATCH_SIZE + 100;
+    BOOST_CHECK(pwalletMain->TopUpKeyPool(nTarget));
+    BOOST_CHECK_EQUAL(pwalletMain->setKeyPool.size(), nTarget + 1);
+
+    // pool indexes stay consecutive and every key is distinct and ours
+    std::set<CKeyID> setKeyIDs;
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+    int64_t nExpected = *pwalletMain->setKeyPool.begin();
+    BOOST_FOREACH(int64_t nIndex, pwalletMain->setKeyPool) {
+        BOOST_CHECK_EQUAL(nIndex, nExpected++);
+        CKeyPool keypool;
+        BOOST_CHECK(walletdb.ReadPool(nIndex, keypool));
+        BOOST_CHECK(pwalletMain->HaveKey(keypool.vchPubKey.GetID()));
+        BOOST_CHECK(pwalletMain->mapKeyMetadata.count(keypool.vchPubKey.GetID()));
+        BOOST_CHECK(setKeyIDs.insert(keypool.vchPubKey.GetID()).second);
+    }
+}
+
+static CMutableTransaction make_coinbase_spend(const CTransaction& txCoinbase, const CKey& keyCoinbase, const CScript& scriptPubKey, CAmount nValue)
+{
+    CScript scriptCoinbase = CScript() << ToByteVector(keyCoinbase.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction tx;
+    tx.vin.push_back(CTxIn(txCoinbase.GetHash(), 0));
+    tx.vout.push_back(CTxOut(nValue, scriptPubKey));
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptCoinbase, tx, 0, SIGHASH_ALL);
+    BOOST_CHECK(keyCoinbase.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig << vchSig;
+    return tx;
+}
+
+// The balances kept up to date by the wallet hooks must match a full recompute
+static void check_balance_ledger()
+{
+    CWalletBalance balance = pwalletMain->GetBalances();
+    pwalletMain->MarkDirty();
+    CWalletBalance balanceFull = pwalletMain->GetBalances();
+    BOOST_CHECK_EQUAL(balance.nTrusted, balanceFull.nTrusted);
+    BOOST_CHECK_EQUAL(balance.nUnconfirmed, balanceFull.nUnconfirmed);
+    BOOST_CHECK_EQUAL(balance.nImmature, balanceFull.nImmature);
+    BOOST_CHECK_EQUAL(balance.nWatchOnlyTrusted, balanceFull.nWatchOnlyTrusted);
+    BOOST_CHECK_EQUAL(balance.nWatchOnlyUnconfirmed, balanceFull.nWatchOnlyUnconfirmed);
+    BOOST_CHECK_EQUAL(balance.nWatchOnlyImmature, balanceFull.nWatchOnlyImmature);
+    BOOST_CHECK_EQUAL(balance.nAnonymized, balanceFull.nAnonymized);
+    BOOST_CHECK_EQUAL(balance.nDenominatedConfirmed, balanceFull.nDenominatedConfirmed);
+    BOOST_CHECK_EQUAL(balance.nDenominatedUnconfirmed, balanceFull.nDenominatedUnconfirmed);
+}
+
+BOOST_FIXTURE_TEST_CASE(wallet_balance_ledger, TestChain100Setup)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript scriptOther = GetScriptForDestination(CKeyID(uint160(std::vector<unsigned char>(20, 1))));
+    CScript scriptCoinbase = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    {
+        LOCK(pwalletMain->cs_wallet);
+        pwalletMain->AddKeyPubKey(key, key.GetPubKey());
+        pwalletMain->AddKeyPubKey(coinbaseKey, coinbaseKey.GetPubKey());
+    }
+
+    // immature coinbases found by a rescan
+    pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+    BOOST_CHECK(pwalletMain->GetImmatureBalance() > 0);
+    check_balance_ledger();
+
+    // a spend entering the mempool
+    CMutableTransaction txSpend = make_coinbase_spend(coinbaseTxns[0], coinbaseKey, scriptPubKey, 1 * COIN);
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, txSpend, false, NULL, true, false));
+    }
+    check_balance_ledger();
+
+    // a new tip confirms it and matures a coinbase
+    std::vector<CMutableTransaction> vecTxs(1, txSpend);
+    CreateAndProcessBlock(vecTxs, scriptCoinbase);
+    BOOST_CHECK(pwalletMain->GetBalance() > 0);
+    check_balance_ledger();
+
+    // a wallet tx conflicted by a block
+    CMutableTransaction txConflicted = make_coinbase_spend(coinbaseTxns[1], coinbaseKey, scriptPubKey, 1 * COIN);
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        CWalletDB walletdb(pwalletMain->strWalletFile);
+        BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, txConflicted), false, &walletdb));
+    }
+    check_balance_ledger();
+    vecTxs[0] = make_coinbase_spend(coinbaseTxns[1], coinbaseKey, scriptOther, 1 * COIN);
+    CreateAndProcessBlock(vecTxs, scriptCoinbase);
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        BOOST_CHECK(pwalletMain->mapWallet[txConflicted.GetHash()].GetDepthInMainChain() < 0);
+    }
+    check_balance_ledger();
+
+    // an abandoned wallet tx
+    CMutableTransaction txAbandoned = make_coinbase_spend(coinbaseTxns[3], coinbaseKey, scriptPubKey, 1 * COIN);
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        CWalletDB walletdb(pwalletMain->strWalletFile);
+        BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, txAbandoned), false, &walletdb));
+    }
+    BOOST_CHECK(pwalletMain->AbandonTransaction(txAbandoned.GetHash()));
+    check_balance_ledger();
+
+    // a spend evicted from the mempool, of the last mature coinbase
+    CMutableTransaction txEvicted = make_coinbase_spend(coinbaseTxns[2], coinbaseKey, scriptPubKey, 1 * COIN);
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, txEvicted, false, NULL, true, false));
+    }
+    check_balance_ledger();
+    CAmount nBalanceBefore = pwalletMain->GetBalance() + pwalletMain->GetUnconfirmedBalance();
+    {
+        LOCK(cs_main);
+        std::list<CTransaction> listRemoved;
+        mempool.remove(txEvicted, listRemoved, true);
+        BOOST_CHECK_EQUAL(listRemoved.size(), 1U);
+    }
+    BOOST_CHECK(pwalletMain->GetBalance() + pwalletMain->GetUnconfirmedBalance() < nBalanceBefore);
+    check_balance_ledger();
+}
+
+// AvailableCoins as a scan over every wallet tx, without the unspent index
+static std::set<COutPoint> scan_available_coins()
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    std::set<COutPoint> setCoins;
+    for (std::map<uint256, CWalletTx>::const_iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it) {
+        const CWalletTx& wtx = it->second;
+        if (!CheckFinalTx(wtx) || !wtx.IsTrusted())
+            continue;
+        if (wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0)
+            continue;
+        if (wtx.GetDepthInMainChain(false) == 0 && !wtx.InMempool())
+            continue;
+        for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+            if (!pwalletMain->IsSpent(it->first, i) && pwalletMain->IsMine(wtx.vout[i]) != ISMINE_NO &&
+                    !pwalletMain->IsLockedCoin(it->first, i) && wtx.vout[i].nValue > 0)
+                setCoins.insert(COutPoint(it->first, i));
+        }
+    }
+    return setCoins;
+}
+
+// SelectCoinsGrouppedByAddresses(fSkipDenominated=false, fAnonymizable=false) as a scan over every wallet tx
+static std::map<CBitcoinAddress, CAmount> scan_grouped_coins()
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    std::map<CBitcoinAddress, CAmount> mapTally;
+    for (std::map<uint256, CWalletTx>::const_iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it) {
+        const CWalletTx& wtx = it->second;
+        if ((wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0) || !wtx.IsTrusted())
+            continue;
+        for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+            CTxDestination address;
+            if (!ExtractDestination(wtx.vout[i].scriptPubKey, address))
+                continue;
+            if (!(::IsMine(*pwalletMain, address) & ISMINE_SPENDABLE))
+                continue;
+            if (pwalletMain->IsSpent(it->first, i) || pwalletMain->IsLockedCoin(it->first, i))
+                continue;
+            mapTally[address] += wtx.vout[i].nValue;
+        }
+    }
+    return mapTally;
+}
+
+static void check_unspent_index()
+{
+    std::vector<COutput> vCoinsIndexed;
+    pwalletMain->AvailableCoins(vCoinsIndexed, true);
+    std::set<COutPoint> setCoinsIndexed;
+    BOOST_FOREACH(const COutput& out, vCoinsIndexed)
+        setCoinsIndexed.insert(COutPoint(out.tx->GetHash(), out.i));
+    BOOST_CHECK(setCoinsIndexed == scan_available_coins());
+
+    std::vector<CompactTallyItem> vecTally;
+    pwalletMain->SelectCoinsGrouppedByAddresses(vecTally, false, false);
+    std::map<CBitcoinAddress, CAmount> mapTallyIndexed;
+    BOOST_FOREACH(const CompactTallyItem& item, vecTally)
+        mapTallyIndexed[item.address] = item.nAmount;
+    BOOST_CHECK(mapTallyIndexed == scan_grouped_coins());
+}
+
+BOOST_FIXTURE_TEST_CASE(wallet_unspent_index, TestChain100Setup)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript scriptOther = GetScriptForDestination(CKeyID(uint160(std::vector<unsigned char>(20, 1))));
+    CScript scriptCoinbase = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    {
+        LOCK(pwalletMain->cs_wallet);
+        pwalletMain->AddKeyPubKey(key, key.GetPubKey());
+        pwalletMain->AddKeyPubKey(coinbaseKey, coinbaseKey.GetPubKey());
+    }
+
+    pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+    check_unspent_index();
+
+    // unconfirmed in the mempool, then confirmed
+    CMutableTransaction txSpend = make_coinbase_spend(coinbaseTxns[0], coinbaseKey, scriptPubKey, 1 * COIN);
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, txSpend, false, NULL, true, false));
+    }
+    check_unspent_index();
+    std::vector<CMutableTransaction> vecTxs(1, txSpend);
+    CreateAndProcessBlock(vecTxs, scriptCoinbase);
+    check_unspent_index();
+    BOOST_CHECK_EQUAL(scan_available_coins().count(COutPoint(txSpend.GetHash(), 0)), 1U);
+
+    // spent by a wallet tx, and available again once that one is abandoned
+    CMutableTransaction txChild;
+    txChild.vin.push_back(CTxIn(txSpend.GetHash(), 0));
+    txChild.vout.push_back(CTxOut(1 * COIN, scriptOther));
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        CWalletDB walletdb(pwalletMain->strWalletFile);
+        BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, txChild), false, &walletdb));
+    }
+    check_unspent_index();
+    BOOST_CHECK_EQUAL(scan_available_coins().count(COutPoint(txSpend.GetHash(), 0)), 0U);
+    BOOST_CHECK(pwalletMain->AbandonTransaction(txChild.GetHash()));
+    check_unspent_index();
+    BOOST_CHECK_EQUAL(scan_available_coins().count(COutPoint(txSpend.GetHash(), 0)), 1U);
+
+    // locked coins
+    {
+        LOCK(pwalletMain->cs_wallet);
+        COutPoint outpoint(txSpend.GetHash(), 0);
+        pwalletMain->LockCoin(outpoint);
+    }
+    check_unspent_index();
+
+    // and after a rebuild of the index
+    pwalletMain->MarkDirty();
+    check_unspent_index();
+}
+
+// The pairwise merge GetAddressGroupings used before the union-find
+static std::set< std::set<CTxDestination> > merge_address_groupings()
+{
+    std::set< std::set<CTxDestination> > groupings;
+    for (std::map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it) {
+        const CWalletTx& wtx = it->second;
+        std::set<CTxDestination> grouping;
+        CTxDestination address;
+        BOOST_FOREACH(const CTxIn& txin, wtx.vin) {
+            if (!pwalletMain->IsMine(txin))
+                continue;
+            if (ExtractDestination(pwalletMain->mapWallet[txin.prevout.hash].vout[txin.prevout.n].scriptPubKey, address))
+                grouping.insert(address);
+        }
+        if (!grouping.empty()) {
+            BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+                if (pwalletMain->IsChange(txout) && ExtractDestination(txout.scriptPubKey, address))
+                    grouping.insert(address);
+            groupings.insert(grouping);
+        }
+        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+            if (pwalletMain->IsMine(txout) && ExtractDestination(txout.scriptPubKey, address))
+                groupings.insert(std::set<CTxDestination>(&address, &address + 1));
+    }
+
+    std::set< std::set<CTxDestination> > ret;
+    BOOST_FOREACH(const std::set<CTxDestination>& grouping, groupings) {
+        std::set<CTxDestination> merged(grouping);
+        std::set< std::set<CTxDestination> > unhit;
+        BOOST_FOREACH(const std::set<CTxDestination>& group, ret) {
+            bool fHit = false;
+            BOOST_FOREACH(const CTxDestination& address, group)
+                fHit |= merged.count(address) > 0;
+            if (fHit)
+                merged.insert(group.begin(), group.end());
+            else
+                unhit.insert(group);
+        }
+        unhit.insert(merged);
+        ret.swap(unhit);
+    }
+    return ret;
+}
+
+static uint256 add_grouping_tx(const std::vector<COutPoint>& vecPrevouts, const std::vector<CScript>& vecScripts)
+{
+    CMutableTransaction tx;
+    BOOST_FOREACH(const COutPoint& prevout, vecPrevouts)
+        tx.vin.push_back(CTxIn(prevout));
+    BOOST_FOREACH(const CScript& script, vecScripts)
+        tx.vout.push_back(CTxOut(1 * COIN, script));
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+    BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, tx), false, &walletdb));
+    return tx.GetHash();
+}
+
+BOOST_FIXTURE_TEST_CASE(wallet_rescan_reserver, TestChain100Setup)
+{
+    {
+        LOCK(pwalletMain->cs_wallet);
+        pwalletMain->AddKeyPubKey(coinbaseKey, coinbaseKey.GetPubKey());
+    }
+
+    {
+        CWalletRescanReserver reserver(pwalletMain);
+        BOOST_CHECK(reserver.Reserve());
+
+        // only one rescan at a time
+        CWalletRescanReserver reserverOther(pwalletMain);
+        BOOST_CHECK(!reserverOther.Reserve());
+        BOOST_CHECK_EQUAL(pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true), -1);
+
+        // the holder of the reservation scans
+        BOOST_CHECK(pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true, reserver) > 0);
+    }
+
+    // released with the reserver
+    BOOST_CHECK(pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true) >= 0);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_address_groupings)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    // addresses in the address book receive, the others are change
+    std::vector<CScript> vecScripts;
+    for (int i = 0; i < 7; i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        pwalletMain->AddKeyPubKey(key, key.GetPubKey());
+        vecScripts.push_back(GetScriptForDestination(key.GetPubKey().GetID()));
+        if (i < 2)
+            pwalletMain->SetAddressBook(key.GetPubKey().GetID(), "", "receive");
+    }
+    CScript scriptOther = GetScriptForDestination(CKeyID(uint160(std::vector<unsigned char>(20, 1))));
+
+    // unlinked funding txs
+    std::vector<COutPoint> vecPrevouts(1, COutPoint(GetRandHash(), 0));
+    uint256 hashFundA = add_grouping_tx(vecPrevouts, std::vector<CScript>(1, vecScripts[0]));
+    vecPrevouts[0] = COutPoint(GetRandHash(), 0);
+    uint256 hashFundB = add_grouping_tx(vecPrevouts, std::vector<CScript>(1, vecScripts[1]));
+    vecPrevouts[0] = COutPoint(GetRandHash(), 0);
+    add_grouping_tx(vecPrevouts, std::vector<CScript>(1, vecScripts[2]));
+    BOOST_CHECK(pwalletMain->GetAddressGroupings() == merge_address_groupings());
+    BOOST_CHECK_EQUAL(pwalletMain->GetAddressGroupings().size(), 3U);
+
+    // a spend of both links them with its change, a spend of the change extends that
+    vecPrevouts[0] = COutPoint(hashFundA, 0);
+    vecPrevouts.push_back(COutPoint(hashFundB, 0));
+    std::vector<CScript> vecOutputs;
+    vecOutputs.push_back(vecScripts[3]);
+    vecOutputs.push_back(scriptOther);
+    uint256 hashSpend = add_grouping_tx(vecPrevouts, vecOutputs);
+    vecPrevouts.assign(1, COutPoint(hashSpend, 0));
+    add_grouping_tx(vecPrevouts, std::vector<CScript>(1, vecScripts[4]));
+    BOOST_CHECK(pwalletMain->GetAddressGroupings() == merge_address_groupings());
+    BOOST_CHECK_EQUAL(pwalletMain->GetAddressGroupings().size(), 2U);
+
+    // a child added before its parent needs the rebuild
+    CMutableTransaction txParent;
+    txParent.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+    txParent.vout.push_back(CTxOut(1 * COIN, vecScripts[5]));
+    vecPrevouts.assign(1, COutPoint(txParent.GetHash(), 0));
+    add_grouping_tx(vecPrevouts, std::vector<CScript>(1, vecScripts[6]));
+    BOOST_CHECK(pwalletMain->GetAddressGroupings() == merge_address_groupings());
+    {
+        CWalletDB walletdb(pwalletMain->strWalletFile);
+        BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, txParent), false, &walletdb));
+    }
+    BOOST_CHECK(pwalletMain->GetAddressGroupings() == merge_address_groupings());
+    BOOST_CHECK_EQUAL(pwalletMain->GetAddressGroupings().size(), 3U);
+
+    pwalletMain->MarkDirty();
+    BOOST_CHECK(pwalletMain->GetAddressGroupings() == merge_address_groupings());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -144,9 +144,9 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
-        return CWalletDB(strWalletFile).WriteKey(pubkey,
-                                                 secret.GetPrivKey(),
-                                                 mapKeyMetadata[pubkey.GetID()]);
+        return CWalletDBScope(this)->WriteKey(pubkey,
+                                              secret.GetPrivKey(),
+                                              mapKeyMetadata[pubkey.GetID()]);
     }
     return true;
 }
@@ -165,9 +165,9 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
                                                         vchCryptedSecret,
                                                         mapKeyMetadata[vchPubKey.GetID()]);
         else
-            return CWalletDB(strWalletFile).WriteCryptedKey(vchPubKey,
-                                                            vchCryptedSecret,
-                                                            mapKeyMetadata[vchPubKey.GetID()]);
+            return CWalletDBScope(this)->WriteCryptedKey(vchPubKey,
+                                                         vchCryptedSecret,
+                                                         mapKeyMetadata[vchPubKey.GetID()]);
     }
     return false;
 }
@@ -193,7 +193,7 @@ bool CWallet::AddCScript(const CScript& redeemScript)
         return false;
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
+    return CWalletDBScope(this)->WriteCScript(Hash160(redeemScript), redeemScript);
 }
 
 bool CWallet::LoadCScript(const CScript& redeemScript)
@@ -220,7 +220,7 @@ bool CWallet::AddWatchOnly(const CScript &dest)
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteWatchOnly(dest);
+    return CWalletDBScope(this)->WriteWatchOnly(dest);
 }
 
 bool CWallet::RemoveWatchOnly(const CScript &dest)
@@ -231,7 +231,7 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
     if (!HaveWatchOnly())
         NotifyWatchonlyChanged(false);
     if (fFileBacked)
-        if (!CWalletDB(strWalletFile).EraseWatchOnly(dest))
+        if (!CWalletDBScope(this)->EraseWatchOnly(dest))
             return false;
 
     return true;
@@ -361,8 +361,15 @@ bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase,
 
 void CWallet::SetBestChain(const CBlockLocator& loc)
 {
-    CWalletDB walletdb(strWalletFile);
-    walletdb.WriteBestBlock(loc);
+    CWalletDBScope(this)->WriteBestBlock(loc);
+}
+
+void CWallet::UpdatedBlockTip(const CBlockIndex *pindex)
+{
+    // depth and maturity of every wallet tx changed, the balances follow the
+    // tip in SyncTransaction which sees every connected and disconnected block
+    LOCK(cs_wallet);
+    fAddressBalancesCached = false;
 }
 
 bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn, bool fExplicit)
@@ -382,11 +389,12 @@ bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn,
 
     if (fFileBacked)
     {
-        CWalletDB* pwalletdb = pwalletdbIn ? pwalletdbIn : new CWalletDB(strWalletFile);
-        if (nWalletVersion > 40000)
-            pwalletdb->WriteMinVersion(nWalletVersion);
-        if (!pwalletdbIn)
-            delete pwalletdb;
+        if (nWalletVersion > 40000) {
+            if (pwalletdbIn)
+                pwalletdbIn->WriteMinVersion(nWalletVersion);
+            else
+                CWalletDBScope(this)->WriteMinVersion(nWalletVersion);
+        }
     }
 
     return true;
@@ -602,6 +610,8 @@ bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
         if (fFileBacked)
         {
             assert(!pwalletdbEncryption);
+            // encryption needs a database transaction of its own
+            assert(nWalletDBBatchDepth == 0);
             pwalletdbEncryption = new CWalletDB(strWalletFile);
             if (!pwalletdbEncryption->TxnBegin()) {
                 delete pwalletdbEncryption;
@@ -670,21 +680,93 @@ int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     if (pwalletdb) {
         pwalletdb->WriteOrderPosNext(nOrderPosNext);
     } else {
-        CWalletDB(strWalletFile).WriteOrderPosNext(nOrderPosNext);
+        CWalletDBScope(this)->WriteOrderPosNext(nOrderPosNext);
     }
     return nRet;
 }
 
+CWalletDB* CWallet::GetBatchDB()
+{
+    // A batch holds cs_wallet while open, so if the lock can be taken here
+    // either this thread owns the batch or there is none
+    TRY_LOCK(cs_wallet, lockWallet);
+    if (!lockWallet || nWalletDBBatchDepth == 0 || !fFileBacked)
+        return NULL;
+    if (!pwalletdbBatch) {
+        pwalletdbBatch = new CWalletDB(strWalletFile, "r+", !GetBoolArg("-flushwallet", DEFAULT_FLUSHWALLET));
+        if (!pwalletdbBatch->TxnBegin())
+            LogPrintf("CWallet::GetBatchDB -- failed to begin a database transaction, writes are not batched\n");
+    }
+    return pwalletdbBatch;
+}
+
+CWalletDBBatch::CWalletDBBatch(CWallet* pwalletIn, bool fFlushOnCommit)
+    : pwallet(pwalletIn),
+      lockWallet(pwalletIn->cs_wallet, "cs_wallet", __FILE__, __LINE__)
+{
+    ++pwallet->nWalletDBBatchDepth;
+    if (fFlushOnCommit)
+        pwallet->fWalletDBBatchFlush = true;
+}
+
+CWalletDBBatch::~CWalletDBBatch()
+{
+    if (--pwallet->nWalletDBBatchDepth > 0)
+        return;
+    bool fFlush = pwallet->fWalletDBBatchFlush;
+    pwallet->fWalletDBBatchFlush = false;
+    if (!pwallet->pwalletdbBatch)
+        return;
+    if (!pwallet->pwalletdbBatch->TxnCommit())
+        LogPrintf("CWalletDBBatch -- failed to commit the database transaction\n");
+    else if (fFlush)
+        pwallet->pwalletdbBatch->Flush();
+    delete pwallet->pwalletdbBatch;
+    pwallet->pwalletdbBatch = NULL;
+}
+
+CWalletDBScope::CWalletDBScope(CWallet* pwallet, bool fFlushOnClose)
+    : pwalletdbOwn(NULL),
+      pwalletdb(pwallet->GetBatchDB())
+{
+    if (!pwalletdb)
+        pwalletdb = pwalletdbOwn = new CWalletDB(pwallet->strWalletFile, "r+", fFlushOnClose);
+}
+
+bool CWalletRescanReserver::Reserve()
+{
+    assert(!fReserved);
+    LOCK(pwallet->cs_rescan);
+    if (pwallet->fScanningWallet)
+        return false;
+    pwallet->fScanningWallet = fReserved = true;
+    return true;
+}
+
+CWalletRescanReserver::~CWalletRescanReserver()
+{
+    if (!fReserved)
+        return;
+    LOCK(pwallet->cs_rescan);
+    pwallet->fScanningWallet = false;
+}
+
 void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        // ownership of inputs may have changed (e.g. imported keys)
+        mapOutpointRoundsCache.Clear();
+        fUnspentCoinsDirty = true;
+        fAddressGroupingsDirty = true;
     }
 
     fAnonymizableTallyCached = false;
     fAnonymizableTallyCachedNonDenom = false;
+    fBalanceCached = false;
+    fAddressBalancesCached = false;
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb)
@@ -698,6 +780,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         wtx.BindWallet(this);
         wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
         AddToSpends(hash);
+        InvalidatePrivateSendRounds(hash);
+        UpdateUnspentCoins(wtx);
+        fAddressGroupingsDirty = true;
+        fBalanceCached = false;
         BOOST_FOREACH(const CTxIn& txin, wtx.vin) {
             if (mapWallet.count(txin.prevout.hash)) {
                 CWalletTx& prevtx = mapWallet[txin.prevout.hash];
@@ -766,6 +852,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
                              wtxIn.hashBlock.ToString());
             }
             AddToSpends(hash);
+            InvalidatePrivateSendRounds(hash);
+            UpdateUnspentCoins(wtx);
+            AddToAddressGroupings(wtx);
         }
 
         bool fUpdated = false;
@@ -820,6 +909,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
 
         fAnonymizableTallyCached = false;
         fAnonymizableTallyCachedNonDenom = false;
+        UpdateBalances(hash);
+        fAddressBalancesCached = false;
 
     }
     return true;
@@ -860,9 +951,9 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
 
             // Do not flush the wallet here for performance reasons
             // this is safe, as in case of a crash, we rescan the necessary blocks on startup through our SetBestChain-mechanism
-            CWalletDB walletdb(strWalletFile, "r+", false);
+            CWalletDBScope walletdb(this, false);
 
-            return AddToWallet(wtx, false, &walletdb);
+            return AddToWallet(wtx, false, walletdb.get());
         }
     }
     return false;
@@ -873,7 +964,7 @@ bool CWallet::AbandonTransaction(const uint256& hashTx)
     LOCK2(cs_main, cs_wallet);
 
     // Do not flush the wallet here for performance reasons
-    CWalletDB walletdb(strWalletFile, "r+", false);
+    CWalletDBScope walletdb(this, false);
 
     std::set<uint256> todo;
     std::set<uint256> done;
@@ -903,7 +994,8 @@ bool CWallet::AbandonTransaction(const uint256& hashTx)
             wtx.nIndex = -1;
             wtx.setAbandoned();
             wtx.MarkDirty();
-            wtx.WriteToDisk(&walletdb);
+            wtx.WriteToDisk(walletdb.get());
+            UpdateBalances(now);
             NotifyTransactionChanged(this, wtx.GetHash(), CT_UPDATED);
             // Iterate over all its outputs, and mark transactions in the wallet that spend them abandoned too
             TxSpends::const_iterator iter = mapTxSpends.lower_bound(COutPoint(hashTx, 0));
@@ -923,8 +1015,11 @@ bool CWallet::AbandonTransaction(const uint256& hashTx)
         }
     }
 
+    // outputs spent by abandoned txes are available again
+    fUnspentCoinsDirty = true;
     fAnonymizableTallyCached = false;
     fAnonymizableTallyCachedNonDenom = false;
+    fAddressBalancesCached = false;
 
     return true;
 }
@@ -948,7 +1043,7 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
         return;
 
     // Do not flush the wallet here for performance reasons
-    CWalletDB walletdb(strWalletFile, "r+", false);
+    CWalletDBScope walletdb(this, false);
 
     std::set<uint256> todo;
     std::set<uint256> done;
@@ -968,7 +1063,8 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
             wtx.nIndex = -1;
             wtx.hashBlock = hashBlock;
             wtx.MarkDirty();
-            wtx.WriteToDisk(&walletdb);
+            wtx.WriteToDisk(walletdb.get());
+            UpdateBalances(now);
             // Iterate over all its outputs, and mark transactions in the wallet that spend them conflicted too
             TxSpends::const_iterator iter = mapTxSpends.lower_bound(COutPoint(now, 0));
             while (iter != mapTxSpends.end() && iter->first.hash == now) {
@@ -987,14 +1083,23 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
         }
     }
 
+    // outputs spent by conflicted txes are available again
+    fUnspentCoinsDirty = true;
     fAnonymizableTallyCached = false;
     fAnonymizableTallyCachedNonDenom = false;
+    fAddressBalancesCached = false;
 }
 
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
 {
     LOCK2(cs_main, cs_wallet);
 
+    // called for every tx of a connected or disconnected block
+    UpdateBalancesForTip();
+
+    // and the mempool, which the txs of a connected block just left
+    UpdateBalancesForMempool();
+
     if (!AddToWalletIfInvolvingMe(tx, pblock, true))
         return; // Not one of ours
 
@@ -1009,6 +1114,14 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
 
     fAnonymizableTallyCached = false;
     fAnonymizableTallyCachedNonDenom = false;
+    fAddressBalancesCached = false;
+}
+
+void CWallet::TransactionRemovedFromMempool(const CTransaction& tx)
+{
+    // the mempool lock is held, leave the wallet alone until the next read or hook
+    LOCK(cs_mempoolRemoved);
+    setMempoolRemoved.insert(tx.GetHash());
 }
 
 
@@ -1043,90 +1156,142 @@ CAmount CWallet::GetDebit(const CTxIn &txin, const isminefilter& filter) const
     return 0;
 }
 
-// Recursively determine the rounds of a given input (How deep is the PrivateSend chain for a given input)
-int CWallet::GetRealInputPrivateSendRounds(CTxIn txin, int nRounds) const
+int CWallet::GetOutputPrivateSendRounds(const CWalletTx& wtx, unsigned int nOut, int nTxRounds) const
 {
-    static std::map<uint256, CMutableTransaction> mDenomWtxes;
+    // bounds check
+    if (nOut >= wtx.vout.size()) {
+        // should never actually hit this
+        return -4;
+    }
 
-    if(nRounds >= 16) return 15; // 16 rounds max
+    if (IsCollateralAmount(wtx.vout[nOut].nValue)) {
+        return -3;
+    }
 
-    uint256 hash = txin.prevout.hash;
-    unsigned int nout = txin.prevout.n;
+    //make sure the final output is non-denominate
+    if (!IsDenominatedAmount(wtx.vout[nOut].nValue)) { //NOT DENOM
+        return -2;
+    }
 
-    const CWalletTx* wtx = GetWalletTx(hash);
-    if(wtx != NULL)
-    {
-        std::map<uint256, CMutableTransaction>::const_iterator mdwi = mDenomWtxes.find(hash);
-        if (mdwi == mDenomWtxes.end()) {
-            // not known yet, let's add it
-            LogPrint("privatesend", "GetRealInputPrivateSendRounds INSERTING %s\n", hash.ToString());
-            mDenomWtxes[hash] = CMutableTransaction(*wtx);
-        } else if(mDenomWtxes[hash].vout[nout].nRounds != -10) {
-            // found and it's not an initial value, just return it
-            return mDenomWtxes[hash].vout[nout].nRounds;
+    BOOST_FOREACH(const CTxOut& out, wtx.vout) {
+        // this one is denominated but there is another non-denominated output found in the same tx
+        if (!IsDenominatedAmount(out.nValue)) {
+            return 0;
         }
+    }
 
+    // only denoms here, the rounds come from the inputs
+    return nTxRounds;
+}
 
-        // bounds check
-        if (nout >= wtx->vout.size()) {
-            // should never actually hit this
-            LogPrint("privatesend", "GetRealInputPrivateSendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, -4);
-            return -4;
-        }
+// Determine the rounds of a given input (How deep is the PrivateSend chain for a given input).
+// In-wallet ancestors are walked depth first on an explicit stack and every output of
+// a resolved tx is cached, so each wallet tx is evaluated at most once.
+int CWallet::GetRealInputPrivateSendRounds(const CTxIn& txin) const
+{
+    LOCK(cs_wallet);
+
+    int nRoundsRet = -10;
+    if (mapOutpointRoundsCache.Get(txin.prevout, nRoundsRet)) {
+        return nRoundsRet;
+    }
 
-        if (IsCollateralAmount(wtx->vout[nout].nValue)) {
-            mDenomWtxes[hash].vout[nout].nRounds = -3;
-            LogPrint("privatesend", "GetRealInputPrivateSendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
+    const CWalletTx* wtx = GetWalletTx(txin.prevout.hash);
+    if (wtx == NULL) {
+        return -1;
+    }
+
+    nRoundsRet = GetOutputPrivateSendRounds(*wtx, txin.prevout.n, -10);
+    if (nRoundsRet != -10) {
+        if (nRoundsRet != -4) {
+            mapOutpointRoundsCache.Insert(txin.prevout, nRoundsRet);
+        }
+        return nRoundsRet;
+    }
+
+    // Fully denominated txes waiting for the rounds of their inputs
+    struct frame_t {
+        const CWalletTx* pwtx;
+        size_t nIn;
+        int nShortest; // -10 until a denominated input is found
+        frame_t(const CWalletTx* pwtxIn) : pwtx(pwtxIn), nIn(0), nShortest(-10) {}
+    };
+    std::vector<frame_t> vecStack;
+    vecStack.push_back(frame_t(wtx));
+
+    while (true) {
+        frame_t& frame = vecStack.back();
+        const CWalletTx* pwtxPrev = NULL;
+        for (; frame.nIn < frame.pwtx->vin.size(); ++frame.nIn) {
+            const CTxIn& txinNext = frame.pwtx->vin[frame.nIn];
+            if (!IsMine(txinNext)) continue;
+            int n;
+            if (!mapOutpointRoundsCache.Get(txinNext.prevout, n)) {
+                pwtxPrev = GetWalletTx(txinNext.prevout.hash);
+                n = GetOutputPrivateSendRounds(*pwtxPrev, txinNext.prevout.n, -10);
+                if (n == -10) break;
+                pwtxPrev = NULL;
+                mapOutpointRoundsCache.Insert(txinNext.prevout, n);
+            }
+            // denom found, keep the shortest chain
+            if (n >= 0 && (n < frame.nShortest || frame.nShortest == -10)) {
+                frame.nShortest = n;
+            }
+        }
+        if (pwtxPrev != NULL) {
+            vecStack.push_back(frame_t(pwtxPrev));
+            continue;
         }
 
-        //make sure the final output is non-denominate
-        if (!IsDenominatedAmount(wtx->vout[nout].nValue)) { //NOT DENOM
-            mDenomWtxes[hash].vout[nout].nRounds = -2;
-            LogPrint("privatesend", "GetRealInputPrivateSendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
+        // +1 to the shortest chain but only 16 rounds max allowed, 0 if we are the first one in that chain
+        int nTxRounds = frame.nShortest == -10 ? 0 : std::min(frame.nShortest + 1, 16);
+        const CWalletTx* pwtxDone = frame.pwtx;
+        uint256 hash = pwtxDone->GetHash();
+        for (unsigned int i = 0; i < pwtxDone->vout.size(); ++i) {
+            mapOutpointRoundsCache.Insert(COutPoint(hash, i), GetOutputPrivateSendRounds(*pwtxDone, i, nTxRounds));
         }
+        LogPrint("privatesend", "GetRealInputPrivateSendRounds UPDATED   %s %3d\n", hash.ToString(), nTxRounds);
+        vecStack.pop_back();
 
-        bool fAllDenoms = true;
-        BOOST_FOREACH(CTxOut out, wtx->vout) {
-            fAllDenoms = fAllDenoms && IsDenominatedAmount(out.nValue);
+        if (vecStack.empty()) {
+            return GetOutputPrivateSendRounds(*pwtxDone, txin.prevout.n, nTxRounds);
         }
 
-        // this one is denominated but there is another non-denominated output found in the same tx
-        if (!fAllDenoms) {
-            mDenomWtxes[hash].vout[nout].nRounds = 0;
-            LogPrint("privatesend", "GetRealInputPrivateSendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
-
-        int nShortest = -10; // an initial value, should be no way to get this by calculations
-        bool fDenomFound = false;
-        // only denoms here so let's look up
-        BOOST_FOREACH(CTxIn txinNext, wtx->vin) {
-            if (IsMine(txinNext)) {
-                int n = GetRealInputPrivateSendRounds(txinNext, nRounds + 1);
-                // denom found, find the shortest chain or initially assign nShortest with the first found value
-                if(n >= 0 && (n < nShortest || nShortest == -10)) {
-                    nShortest = n;
-                    fDenomFound = true;
-                }
-            }
+        // hand the result to the tx spending it directly, the cache may have pruned it already
+        frame_t& frameParent = vecStack.back();
+        int n = GetOutputPrivateSendRounds(*pwtxDone, frameParent.pwtx->vin[frameParent.nIn].prevout.n, nTxRounds);
+        if (n >= 0 && (n < frameParent.nShortest || frameParent.nShortest == -10)) {
+            frameParent.nShortest = n;
         }
-        mDenomWtxes[hash].vout[nout].nRounds = fDenomFound
-                ? (nShortest >= 15 ? 16 : nShortest + 1) // good, we a +1 to the shortest one but only 16 rounds max allowed
-                : 0;            // too bad, we are the fist one in that chain
-        LogPrint("privatesend", "GetRealInputPrivateSendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-        return mDenomWtxes[hash].vout[nout].nRounds;
+        ++frameParent.nIn;
     }
+}
+
+void CWallet::InvalidatePrivateSendRounds(const uint256& hash)
+{
+    AssertLockHeld(cs_wallet);
 
-    return nRounds - 1;
+    if (mapOutpointRoundsCache.GetSize() == 0) return;
+
+    // Rounds of the wallet txes spending this one were computed without it
+    TxSpends::const_iterator it = mapTxSpends.lower_bound(COutPoint(hash, 0));
+    if (it != mapTxSpends.end() && it->first.hash == hash) {
+        LogPrint("privatesend", "CWallet::InvalidatePrivateSendRounds -- %s has in-wallet descendants, clearing cache\n", hash.ToString());
+        mapOutpointRoundsCache.Clear();
+        // anonymized credits and balances were computed with the old rounds
+        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+            item.second.MarkDirty();
+        fBalanceCached = false;
+        fAnonymizableTallyCached = false;
+        fAnonymizableTallyCachedNonDenom = false;
+    }
 }
 
 // respect current settings
 int CWallet::GetInputPrivateSendRounds(CTxIn txin) const
 {
     LOCK(cs_wallet);
-    int realPrivateSendRounds = GetRealInputPrivateSendRounds(txin, 0);
+    int realPrivateSendRounds = GetRealInputPrivateSendRounds(txin);
     return realPrivateSendRounds > nPrivateSendRounds ? nPrivateSendRounds : realPrivateSendRounds;
 }
 
@@ -1385,52 +1550,282 @@ bool CWalletTx::WriteToDisk(CWalletDB *pwalletdb)
     return pwalletdb->WriteTx(GetHash(), *this);
 }
 
+namespace {
+
+/** A block read ahead of the rescan, with the txs paying one of our scripts flagged */
+struct CRescanBlock
+{
+    size_t nIndex;
+    bool fRead;
+    bool fReady;
+    CBlock block;
+    std::vector<bool> vecPaysMe;
+
+    CRescanBlock() : nIndex(0), fRead(false), fReady(false) {}
+
+    void Swap(CRescanBlock& other)
+    {
+        std::swap(nIndex, other.nIndex);
+        std::swap(fRead, other.fRead);
+        std::swap(fReady, other.fReady);
+        std::swap(block, other.block);
+        vecPaysMe.swap(other.vecPaysMe);
+    }
+};
+
+/**
+ * Reads the blocks of a rescan on worker threads, at most
+ * RESCAN_PREFETCH_BLOCKS ahead of the block being committed, and
+ * matches their outputs against the wallet scripts. Blocks are handed
+ * out in chain order. Workers only take the keystore lock.
+ */
+class CRescanPrefetcher
+{
+private:
+    const CWallet& wallet;
+    const std::vector<std::pair<CBlockIndex*, CDiskBlockPos> >& vecBlocks;
+    std::vector<CRescanBlock> vecSlots;
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condCommit;
+    size_t nNext;
+    size_t nCommitted;
+    bool fQuit;
+    boost::thread_group threadGroup;
+
+    void Worker()
+    {
+        RenameThread("onex-rescan");
+        const Consensus::Params& consensusParams = Params().GetConsensus();
+        while (true) {
+            size_t nIndex;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fQuit && nNext < vecBlocks.size() && nNext >= nCommitted + vecSlots.size())
+                    condWorker.wait(lock);
+                if (fQuit || nNext >= vecBlocks.size())
+                    return;
+                nIndex = nNext++;
+            }
+
+            CRescanBlock item;
+            item.nIndex = nIndex;
+            item.fRead = ReadBlockFromDisk(item.block, vecBlocks[nIndex].second, consensusParams) &&
+                         item.block.GetHash() == vecBlocks[nIndex].first->GetBlockHash();
+            if (item.fRead) {
+                item.vecPaysMe.resize(item.block.vtx.size());
+                for (size_t i = 0; i < item.block.vtx.size(); i++) {
+                    BOOST_FOREACH(const CTxOut& txout, item.block.vtx[i].vout) {
+                        if (wallet.IsMine(txout) != ISMINE_NO) {
+                            item.vecPaysMe[i] = true;
+                            break;
+                        }
+                    }
+                }
+            }
+            item.fReady = true;
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                vecSlots[nIndex % vecSlots.size()].Swap(item);
+            }
+            condCommit.notify_all();
+        }
+    }
+
+public:
+    CRescanPrefetcher(const CWallet& walletIn, const std::vector<std::pair<CBlockIndex*, CDiskBlockPos> >& vecBlocksIn, int nThreads)
+        : wallet(walletIn),
+          vecBlocks(vecBlocksIn),
+          vecSlots(std::min<size_t>(RESCAN_PREFETCH_BLOCKS, vecBlocksIn.size())),
+          nNext(0),
+          nCommitted(0),
+          fQuit(false)
+    {
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CRescanPrefetcher::Worker, this));
+    }
+
+    ~CRescanPrefetcher()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+        }
+        condWorker.notify_all();
+        threadGroup.join_all();
+    }
+
+    /** Wait for the block at nIndex, which must be the next one in order */
+    void Get(size_t nIndex, CRescanBlock& item)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            CRescanBlock& slot = vecSlots[nIndex % vecSlots.size()];
+            while (!(slot.fReady && slot.nIndex == nIndex))
+                condCommit.wait(lock);
+            item.Swap(slot);
+            slot.fReady = false;
+            nCommitted = nIndex + 1;
+        }
+        condWorker.notify_all();
+    }
+};
+
+} // anon namespace
+
+bool CWallet::IsSpendRelevant(const CTransaction& tx) const
+{
+    AssertLockHeld(cs_wallet);
+    if (mapWallet.count(tx.GetHash()))
+        return true;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+        if (mapWallet.count(txin.prevout.hash) || mapTxSpends.count(txin.prevout))
+            return true;
+    }
+    return false;
+}
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
+ *
+ * Blocks are read and matched against our scripts on prefetch threads,
+ * cs_main and cs_wallet are only taken to add the txs of one block, so
+ * the node keeps running while the wallet catches up. Whether a tx spends
+ * from us depends on the txs found before it, so that part of the check
+ * is done in order under the locks.
  */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
+    CWalletRescanReserver reserver(this);
+    if (!reserver.Reserve()) {
+        LogPrintf("CWallet::ScanForWalletTransactions -- another rescan is running\n");
+        return -1;
+    }
+    return ScanForWalletTransactions(pindexStart, fUpdate, reserver);
+}
+
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, const CWalletRescanReserver& reserver)
+{
+    assert(reserver.IsReserved());
+
     int ret = 0;
     int64_t nNow = GetTime();
     const CChainParams& chainParams = Params();
+    int nThreads = std::max(1, std::min(GetNumCores(), MAX_RESCAN_THREADS));
 
     CBlockIndex* pindex = pindexStart;
+    double dProgressStart;
+    double dProgressTip;
     {
-        LOCK2(cs_main, cs_wallet);
+        LOCK(cs_main);
 
         // no need to read and scan block, if block was created before
         // our wallet birthday (as adjusted for block time variability)
         while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
-        while (pindex)
+        dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
+
+        {
+            LOCK(cs_rescan);
+            rescanProgress = CRescanProgress();
+            rescanProgress.fScanning = true;
+            rescanProgress.nStartHeight = pindex ? pindex->nHeight : chainActive.Height();
+            rescanProgress.nTipHeight = chainActive.Height();
+            rescanProgress.nStartTime = GetTime();
+        }
+    }
+
+    ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+    while (pindex)
+    {
+        std::vector<std::pair<CBlockIndex*, CDiskBlockPos> > vecBlocks;
+        {
+            LOCK(cs_main);
+            for (CBlockIndex* pindexBatch = pindex; pindexBatch && vecBlocks.size() < RESCAN_BATCH_BLOCKS; pindexBatch = chainActive.Next(pindexBatch))
+                vecBlocks.push_back(std::make_pair(pindexBatch, pindexBatch->GetBlockPos()));
+            {
+                LOCK(cs_rescan);
+                rescanProgress.nTipHeight = chainActive.Height();
+            }
+        }
+        if (vecBlocks.empty())
+            break;
+
+        CRescanPrefetcher prefetcher(*this, vecBlocks, std::min<int>(nThreads, vecBlocks.size()));
+        for (size_t i = 0; i < vecBlocks.size() && pindex; i++)
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+            pindex = vecBlocks[i].first;
+            CRescanBlock item;
+            prefetcher.Get(i, item);
+
+            {
+                LOCK2(cs_main, cs_wallet);
+
+                // the block was disconnected since the batch was taken, the
+                // wallet hears about the new chain through SyncTransaction
+                if (!chainActive.Contains(pindex)) {
+                    pindex = NULL;
+                    break;
+                }
+
+                if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                    ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+
+                if (!item.fRead) {
+                    ReadBlockFromDisk(item.block, pindex, chainParams.GetConsensus());
+                    item.vecPaysMe.assign(item.block.vtx.size(), true);
+                }
+                // one database transaction for all our txs in the block
+                CWalletDBBatch batch(this);
+                for (size_t j = 0; j < item.block.vtx.size(); j++)
+                {
+                    const CTransaction& tx = item.block.vtx[j];
+                    if (!item.vecPaysMe[j] && !IsSpendRelevant(tx))
+                        continue;
+                    if (AddToWalletIfInvolvingMe(tx, &item.block, fUpdate))
+                        ret++;
+                }
+            }
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex, Params().GetConsensus());
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                LOCK(cs_rescan);
+                rescanProgress.nHeight = pindex->nHeight;
+                rescanProgress.nFound = ret;
             }
-            pindex = chainActive.Next(pindex);
+
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
                 LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
             }
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+
+        if (pindex) {
+            // continue with any blocks connected meanwhile
+            LOCK(cs_main);
+            pindex = chainActive.Next(pindex);
+        }
+    }
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+
+    {
+        LOCK(cs_rescan);
+        rescanProgress.fScanning = false;
+        rescanProgress.nEndTime = GetTime();
     }
     return ret;
 }
 
+CRescanProgress CWallet::GetRescanProgress() const
+{
+    LOCK(cs_rescan);
+    return rescanProgress;
+}
+
 void CWallet::ReacceptWalletTransactions()
 {
     // If transactions aren't being broadcasted, don't let them into local mempool either
@@ -1840,20 +2235,177 @@ void CWallet::ResendWalletTransactions(int64_t nBestBlockTime)
  */
 
 
-CAmount CWallet::GetBalance() const
+CWalletBalance CWallet::GetTxBalance(const CWalletTx& wtx, bool& fVolatileRet) const
 {
-    CAmount nTotal = 0;
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    CWalletBalance balance;
+    int nDepth = wtx.GetDepthInMainChain();
+    if (wtx.IsTrusted()) {
+        balance.nTrusted = wtx.GetAvailableCredit();
+        balance.nWatchOnlyTrusted = wtx.GetAvailableWatchOnlyCredit();
+        if (!fLiteMode)
+            balance.nAnonymized = wtx.GetAnonymizedCredit();
+    } else if (nDepth == 0 && wtx.InMempool()) {
+        balance.nUnconfirmed = wtx.GetAvailableCredit();
+        balance.nWatchOnlyUnconfirmed = wtx.GetAvailableWatchOnlyCredit();
+    }
+    balance.nImmature = wtx.GetImmatureCredit();
+    balance.nWatchOnlyImmature = wtx.GetImmatureWatchOnlyCredit();
+    if (!fLiteMode) {
+        balance.nDenominatedConfirmed = wtx.GetDenominatedCredit(false);
+        balance.nDenominatedUnconfirmed = wtx.GetDenominatedCredit(true);
+    }
+
+    // a new tip can confirm, finalize or mature it
+    fVolatileRet = nDepth == 0 || wtx.GetBlocksToMaturity() > 0;
+    return balance;
+}
+
+void CWallet::UpdateTxBalance(const uint256& hashTx) const
+{
+    std::map<uint256, CWalletBalance>::iterator it = mapTxBalances.find(hashTx);
+    if (it != mapTxBalances.end()) {
+        balanceCached -= it->second;
+        mapTxBalances.erase(it);
+    }
+    setBalanceVolatile.erase(hashTx);
+
+    std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
+    if (mi == mapWallet.end())
+        return;
+    bool fVolatile;
+    CWalletBalance balance = GetTxBalance(mi->second, fVolatile);
+    balanceCached += balance;
+    mapTxBalances.insert(std::make_pair(hashTx, balance));
+    if (fVolatile)
+        setBalanceVolatile.insert(hashTx);
+}
+
+void CWallet::RecomputeBalances() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    int64_t nTimeStart = GetTimeMicros();
+
+    balanceCached = CWalletBalance();
+    mapTxBalances.clear();
+    setBalanceVolatile.clear();
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+        LOCK(cs_mempoolRemoved);
+        setMempoolRemoved.clear();
+    }
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateTxBalance(it->first);
+    pindexBalanceTip = chainActive.Tip();
+    nBalancePrivateSendRounds = nPrivateSendRounds;
+    fBalanceCached = true;
+
+    LogPrint("bench", "CWallet::RecomputeBalances -- %u txes, %.2fms\n", mapWallet.size(), (GetTimeMicros() - nTimeStart) * 0.001);
+}
+
+void CWallet::UpdateBalancesForTip() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (!fBalanceCached || chainActive.Tip() == pindexBalanceTip)
+        return;
+
+    // Going back can make mature coinbases immature again, start over
+    if (pindexBalanceTip == NULL || chainActive.Tip() == NULL ||
+            chainActive.Tip()->GetAncestor(pindexBalanceTip->nHeight) != pindexBalanceTip) {
+        RecomputeBalances();
+        return;
+    }
+
+    std::vector<uint256> vHashes(setBalanceVolatile.begin(), setBalanceVolatile.end());
+    BOOST_FOREACH(const uint256& hash, vHashes)
+        UpdateTxBalance(hash);
+    pindexBalanceTip = chainActive.Tip();
+}
+
+bool CWallet::HaveMempoolRemoved() const
+{
+    LOCK(cs_mempoolRemoved);
+    return !setMempoolRemoved.empty();
+}
+
+void CWallet::UpdateBalancesForMempool() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    std::set<uint256> setRemoved;
+    {
+        LOCK(cs_mempoolRemoved);
+        setRemoved.swap(setMempoolRemoved);
+    }
+    // without a cache the next read recomputes everything anyway
+    if (!fBalanceCached)
+        return;
+
+    // an evicted tx is no longer unconfirmed balance, its inputs stay spent
+    BOOST_FOREACH(const uint256& hash, setRemoved)
+        if (mapTxBalances.count(hash))
+            UpdateTxBalance(hash);
+}
+
+void CWallet::UpdateBalances(const uint256& hashTx)
+{
+    // without a cache the next read recomputes everything anyway
+    if (!fBalanceCached)
+        return;
+
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    UpdateBalancesForTip();
+
+    std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
+    if (mi == mapWallet.end())
+        return;
+    UpdateTxBalance(hashTx);
+
+    // the available credit of the txs it spends changed
+    BOOST_FOREACH(const CTxIn& txin, mi->second.vin) {
+        std::map<uint256, CWalletTx>::iterator mip = mapWallet.find(txin.prevout.hash);
+        if (mip != mapWallet.end()) {
+            mip->second.MarkDirty();
+            UpdateTxBalance(mip->first);
         }
     }
 
-    return nTotal;
+    // unconfirmed txs spending it may be trusted now
+    TxSpends::const_iterator iter = mapTxSpends.lower_bound(COutPoint(hashTx, 0));
+    while (iter != mapTxSpends.end() && iter->first.hash == hashTx) {
+        UpdateTxBalance(iter->second);
+        ++iter;
+    }
+}
+
+CWalletBalance CWallet::GetBalances() const
+{
+    {
+        LOCK(cs_wallet);
+        if (fBalanceCached && nBalancePrivateSendRounds == nPrivateSendRounds && !HaveMempoolRemoved())
+            return balanceCached;
+    }
+
+    // after loading, MarkDirty, a change of the PrivateSend rounds or mempool removals
+    LOCK2(cs_main, cs_wallet);
+    if (!fBalanceCached || nBalancePrivateSendRounds != nPrivateSendRounds)
+        RecomputeBalances();
+    else
+        UpdateBalancesForMempool();
+    return balanceCached;
+}
+
+CAmount CWallet::GetBalance() const
+{
+    return GetBalances().nTrusted;
 }
 
 CAmount CWallet::GetAnonymizableBalance(bool fSkipDenominated) const
@@ -1880,19 +2432,7 @@ CAmount CWallet::GetAnonymizedBalance() const
 {
     if(fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAnonymizedCredit();
-        }
-    }
-
-    return nTotal;
+    return GetBalances().nAnonymized;
 }
 
 // Note: calculated including unconfirmed,
@@ -1990,92 +2530,33 @@ CAmount CWallet::GetDenominatedBalance(bool unconfirmed) const
 {
     if(fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-
-            nTotal += pcoin->GetDenominatedCredit(unconfirmed);
-        }
-    }
-
-    return nTotal;
-}
+    CWalletBalance balance = GetBalances();
+    return unconfirmed ? balance.nDenominatedUnconfirmed : balance.nDenominatedConfirmed;
+}
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nUnconfirmed;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nImmature;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    return GetBalances().nWatchOnlyTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nWatchOnlyUnconfirmed;
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nWatchOnlyImmature;
 }
 
 void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl, bool fIncludeZeroValue, AvailableCoinsType nCoinType, bool fUseInstantSend) const
@@ -2084,60 +2565,178 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+
+        if (fUnspentCoinsDirty)
+            RebuildUnspentCoins();
+
+        // The index is ordered by outpoint, so the outputs of a tx are next to each other
+        const CWalletTx* pcoin = NULL;
+        bool fAvailableTx = false;
+        int nDepth = 0;
+        for (map<COutPoint, isminetype>::const_iterator it = mapUnspentCoins.begin(); it != mapUnspentCoins.end(); ++it)
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const uint256& wtxid = it->first.hash;
+            unsigned int i = it->first.n;
 
-            if (!CheckFinalTx(*pcoin))
+            if (pcoin == NULL || pcoin->GetHash() != wtxid) {
+                map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(wtxid);
+                if (mi == mapWallet.end())
+                    continue;
+                pcoin = &(*mi).second;
+                fAvailableTx = IsAvailableTx(pcoin, fOnlyConfirmed, fUseInstantSend, nDepth);
+            }
+            if (!fAvailableTx)
                 continue;
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
+            bool found = false;
+            if(nCoinType == ONLY_DENOMINATED) {
+                found = IsDenominatedAmount(pcoin->vout[i].nValue);
+            } else if(nCoinType == ONLY_NOT1000IFMN) {
+                found = !(fMasterNode && pcoin->vout[i].nValue == 5000*COIN);
+            } else if(nCoinType == ONLY_NONDENOMINATED_NOT1000IFMN) {
+                if (IsCollateralAmount(pcoin->vout[i].nValue)) continue; // do not use collateral amounts
+                found = !IsDenominatedAmount(pcoin->vout[i].nValue);
+                if(found && fMasterNode) found = pcoin->vout[i].nValue != 5000*COIN; // do not use Hot MN funds
+            } else if(nCoinType == ONLY_1000) {
+                found = pcoin->vout[i].nValue == 5000*COIN;
+            } else if(nCoinType == ONLY_PRIVATESEND_COLLATERAL) {
+                found = IsCollateralAmount(pcoin->vout[i].nValue);
+            } else {
+                found = true;
+            }
+            if(!found) continue;
+
+            isminetype mine = it->second;
+            if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
+                (!IsLockedCoin(wtxid, i) || nCoinType == ONLY_1000) &&
+                (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
+                (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(wtxid, i)))
+                    vCoins.push_back(COutput(pcoin, i, nDepth,
+                                             ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
+                                              (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO)));
+        }
+    }
+}
+
+bool CWallet::IsAvailableTx(const CWalletTx* pcoin, bool fOnlyConfirmed, bool fUseInstantSend, int& nDepthRet) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (!CheckFinalTx(*pcoin))
+        return false;
+
+    if (fOnlyConfirmed && !pcoin->IsTrusted())
+        return false;
+
+    if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+        return false;
+
+    nDepthRet = pcoin->GetDepthInMainChain(false);
+    // do not use IX for inputs that have less then INSTANTSEND_CONFIRMATIONS_REQUIRED blockchain confirmations
+    if (fUseInstantSend && nDepthRet < INSTANTSEND_CONFIRMATIONS_REQUIRED)
+        return false;
+
+    // We should not consider coins which aren't at least in our mempool
+    // It's possible for these to be conflicted via ancestors which we may never be able to detect
+    if (nDepthRet == 0 && !pcoin->InMempool())
+        return false;
+
+    return true;
+}
+
+void CWallet::AvailablePrivateSendCoins(vector<COutput>& vCoins, const vector<CAmount>& vecAmounts, bool fOnlyConfirmed) const
+{
+    vCoins.clear();
+
+    LOCK2(cs_main, cs_wallet);
+
+    if (fUnspentCoinsDirty)
+        RebuildUnspentCoins();
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+    BOOST_FOREACH(CAmount nAmount, vecAmounts) {
+        map<CAmount, set<COutPoint> >::const_iterator mi = mapPrivateSendCoins.find(nAmount);
+        if (mi == mapPrivateSendCoins.end())
+            continue;
+
+        BOOST_FOREACH(const COutPoint& outpoint, mi->second) {
+            map<uint256, CWalletTx>::const_iterator it = mapWallet.find(outpoint.hash);
+            if (it == mapWallet.end())
                 continue;
+            const CWalletTx* pcoin = &(*it).second;
 
-            int nDepth = pcoin->GetDepthInMainChain(false);
-            // do not use IX for inputs that have less then INSTANTSEND_CONFIRMATIONS_REQUIRED blockchain confirmations
-            if (fUseInstantSend && nDepth < INSTANTSEND_CONFIRMATIONS_REQUIRED)
+            int nDepth;
+            if (!IsAvailableTx(pcoin, fOnlyConfirmed, false, nDepth))
                 continue;
 
-            // We should not consider coins which aren't at least in our mempool
-            // It's possible for these to be conflicted via ancestors which we may never be able to detect
-            if (nDepth == 0 && !pcoin->InMempool())
+            map<COutPoint, isminetype>::const_iterator mit = mapUnspentCoins.find(outpoint);
+            if (mit == mapUnspentCoins.end())
                 continue;
+            isminetype mine = mit->second;
+            if (!IsSpent(outpoint.hash, outpoint.n) && !IsLockedCoin(outpoint.hash, outpoint.n))
+                vCoins.push_back(COutput(pcoin, outpoint.n, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
+        }
+    }
+}
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                bool found = false;
-                if(nCoinType == ONLY_DENOMINATED) {
-                    found = IsDenominatedAmount(pcoin->vout[i].nValue);
-                } else if(nCoinType == ONLY_NOT1000IFMN) {
-                    found = !(fMasterNode && pcoin->vout[i].nValue == 5000*COIN);
-                } else if(nCoinType == ONLY_NONDENOMINATED_NOT1000IFMN) {
-                    if (IsCollateralAmount(pcoin->vout[i].nValue)) continue; // do not use collateral amounts
-                    found = !IsDenominatedAmount(pcoin->vout[i].nValue);
-                    if(found && fMasterNode) found = pcoin->vout[i].nValue != 5000*COIN; // do not use Hot MN funds
-                } else if(nCoinType == ONLY_1000) {
-                    found = pcoin->vout[i].nValue == 5000*COIN;
-                } else if(nCoinType == ONLY_PRIVATESEND_COLLATERAL) {
-                    found = IsCollateralAmount(pcoin->vout[i].nValue);
-                } else {
-                    found = true;
-                }
-                if(!found) continue;
-
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    (!IsLockedCoin((*it).first, i) || nCoinType == ONLY_1000) &&
-                    (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected((*it).first, i)))
-                        vCoins.push_back(COutput(pcoin, i, nDepth,
-                                                 ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
-                                                  (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO)));
-            }
+void CWallet::UpdateUnspentCoins(const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet);
+
+    // will be rebuilt from scratch anyway
+    if (fUnspentCoinsDirty)
+        return;
+
+    BOOST_FOREACH(const CTxIn& txin, wtx.vin) {
+        map<COutPoint, isminetype>::iterator mi = mapUnspentCoins.find(txin.prevout);
+        if (mi == mapUnspentCoins.end())
+            continue;
+        mapUnspentCoins.erase(mi);
+        CAmount nAmount = mapWallet[txin.prevout.hash].vout[txin.prevout.n].nValue;
+        map<CAmount, set<COutPoint> >::iterator it = mapPrivateSendCoins.find(nAmount);
+        if (it != mapPrivateSendCoins.end())
+            it->second.erase(txin.prevout);
+    }
+
+    uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        isminetype mine = IsMine(wtx.vout[i]);
+        if (mine == ISMINE_NO)
+            continue;
+        COutPoint outpoint(hash, i);
+        // already spent by a wallet tx we have seen before this one
+        if (mapTxSpends.count(outpoint))
+            continue;
+        mapUnspentCoins[outpoint] = mine;
+        if (IsPrivateSendAmount(wtx.vout[i].nValue))
+            mapPrivateSendCoins[wtx.vout[i].nValue].insert(outpoint);
+    }
+}
+
+void CWallet::RebuildUnspentCoins() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    int64_t nTimeStart = GetTimeMillis();
+
+    mapUnspentCoins.clear();
+    mapPrivateSendCoins.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
+        const CWalletTx& wtx = (*it).second;
+        for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+            isminetype mine = IsMine(wtx.vout[i]);
+            if (mine == ISMINE_NO || IsSpent(it->first, i))
+                continue;
+            COutPoint outpoint(it->first, i);
+            mapUnspentCoins.insert(mapUnspentCoins.end(), std::make_pair(outpoint, mine));
+            if (IsPrivateSendAmount(wtx.vout[i].nValue))
+                mapPrivateSendCoins[wtx.vout[i].nValue].insert(outpoint);
         }
     }
+    fUnspentCoinsDirty = false;
+
+    LogPrint("selectcoins", "CWallet::RebuildUnspentCoins -- %u txes, %u outputs, %dms\n", mapWallet.size(), mapUnspentCoins.size(), GetTimeMillis() - nTimeStart);
 }
 
 static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
@@ -2488,11 +3087,6 @@ bool CWallet::SelectCoinsByDenominations(int nDenom, CAmount nValueMin, CAmount
     vCoinsRet.clear();
     nValueRet = 0;
 
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, NULL, false, ONLY_DENOMINATED);
-
-    std::random_shuffle(vCoins.rbegin(), vCoins.rend(), GetRandInt);
-
     // ( bit on if present )
     // bit 0 - 100ONEX+1
     // bit 1 - 10ONEX+1
@@ -2504,6 +3098,17 @@ bool CWallet::SelectCoinsByDenominations(int nDenom, CAmount nValueMin, CAmount
         return false;
     }
 
+    // only look at the requested denominations
+    std::vector<CAmount> vecAmounts;
+    BOOST_FOREACH(int nBit, vecBits) {
+        vecAmounts.push_back(vecPrivateSendDenominations[nBit]);
+    }
+
+    vector<COutput> vCoins;
+    AvailablePrivateSendCoins(vCoins, vecAmounts);
+
+    std::random_shuffle(vCoins.rbegin(), vCoins.rend(), GetRandInt);
+
     int nDenomResult = 0;
 
     InsecureRand insecureRand;
@@ -2572,13 +3177,25 @@ bool CWallet::SelectCoinsGrouppedByAddresses(std::vector<CompactTallyItem>& vecT
 
     // Tally
     map<CBitcoinAddress, CompactTallyItem> mapTally;
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-        const CWalletTx& wtx = (*it).second;
-
-        if(wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0) continue;
-        if(!fAnonymizable && !wtx.IsTrusted()) continue;
+    if (fUnspentCoinsDirty)
+        RebuildUnspentCoins();
+    // outputs of a tx are adjacent in mapUnspentCoins, check the tx only once
+    const CWalletTx* pcoin = NULL;
+    bool fSkipTx = false;
+    for (map<COutPoint, isminetype>::const_iterator it = mapUnspentCoins.begin(); it != mapUnspentCoins.end(); ++it) {
+        if (pcoin == NULL || pcoin->GetHash() != it->first.hash) {
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(it->first.hash);
+            if (mi == mapWallet.end())
+                continue;
+            pcoin = &(*mi).second;
+            fSkipTx = (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0) ||
+                      (!fAnonymizable && !pcoin->IsTrusted());
+        }
+        if (fSkipTx) continue;
 
-        for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        const CWalletTx& wtx = *pcoin;
+        unsigned int i = it->first.n;
+        {
             CTxDestination address;
             if (!ExtractDestination(wtx.vout[i].scriptPubKey, address)) continue;
 
@@ -2645,7 +3262,11 @@ bool CWallet::SelectCoinsDark(CAmount nValueMin, CAmount nValueMax, std::vector<
     nValueRet = 0;
 
     vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl, false, nPrivateSendRoundsMin < 0 ? ONLY_NONDENOMINATED_NOT1000IFMN : ONLY_DENOMINATED);
+    if (nPrivateSendRoundsMin < 0) {
+        AvailableCoins(vCoins, true, coinControl, false, ONLY_NONDENOMINATED_NOT1000IFMN);
+    } else {
+        AvailablePrivateSendCoins(vCoins, vecPrivateSendDenominations);
+    }
 
     //order the array so largest nondenom are first, then denominations, then very small inputs.
     sort(vCoins.rbegin(), vCoins.rend(), CompareByPriority());
@@ -2678,20 +3299,16 @@ bool CWallet::GetCollateralTxIn(CTxIn& txinRet, CAmount& nValueRet) const
 {
     vector<COutput> vCoins;
 
-    AvailableCoins(vCoins);
+    AvailablePrivateSendCoins(vCoins, GetCollateralAmounts());
 
-    BOOST_FOREACH(const COutput& out, vCoins)
-    {
-        if(IsCollateralAmount(out.tx->vout[out.i].nValue))
-        {
-            txinRet = CTxIn(out.tx->GetHash(), out.i);
-            txinRet.prevPubKey = out.tx->vout[out.i].scriptPubKey; // the inputs PubKey
-            nValueRet = out.tx->vout[out.i].nValue;
-            return true;
-        }
-    }
+    if (vCoins.empty())
+        return false;
 
-    return false;
+    const COutput& out = vCoins[0];
+    txinRet = CTxIn(out.tx->GetHash(), out.i);
+    txinRet.prevPubKey = out.tx->vout[out.i].scriptPubKey; // the inputs PubKey
+    nValueRet = out.tx->vout[out.i].nValue;
+    return true;
 }
 
 bool CWallet::GetMasternodeVinAndKeys(CTxIn& txinRet, CPubKey& pubKeyRet, CKey& keyRet, std::string strTxHash, std::string strOutputIndex)
@@ -2753,26 +3370,28 @@ bool CWallet::GetVinAndKeysFromOutput(COutput out, CTxIn& txinRet, CPubKey& pubK
 
 int CWallet::CountInputsWithAmount(CAmount nInputAmount)
 {
+    if (!IsDenominatedAmount(nInputAmount))
+        return 0;
+
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted()){
-                int nDepth = pcoin->GetDepthInMainChain(false);
 
-                for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                    COutput out = COutput(pcoin, i, nDepth, true);
-                    CTxIn txin = CTxIn(out.tx->GetHash(), out.i);
+        if (fUnspentCoinsDirty)
+            RebuildUnspentCoins();
 
-                    if(out.tx->vout[out.i].nValue != nInputAmount) continue;
-                    if(!IsDenominatedAmount(pcoin->vout[i].nValue)) continue;
-                    if(IsSpent(out.tx->GetHash(), i) || IsMine(pcoin->vout[i]) != ISMINE_SPENDABLE || !IsDenominated(txin)) continue;
+        map<CAmount, set<COutPoint> >::const_iterator mi = mapPrivateSendCoins.find(nInputAmount);
+        if (mi == mapPrivateSendCoins.end())
+            return 0;
 
-                    nTotal++;
-                }
-            }
+        BOOST_FOREACH(const COutPoint& outpoint, mi->second) {
+            map<uint256, CWalletTx>::const_iterator it = mapWallet.find(outpoint.hash);
+            if (it == mapWallet.end() || !it->second.IsTrusted())
+                continue;
+            if (IsSpent(outpoint.hash, outpoint.n) || IsMine(it->second.vout[outpoint.n]) != ISMINE_SPENDABLE)
+                continue;
+
+            nTotal++;
         }
     }
 
@@ -2782,7 +3401,7 @@ int CWallet::CountInputsWithAmount(CAmount nInputAmount)
 bool CWallet::HasCollateralInputs(bool fOnlyConfirmed) const
 {
     vector<COutput> vCoins;
-    AvailableCoins(vCoins, fOnlyConfirmed, NULL, false, ONLY_PRIVATESEND_COLLATERAL);
+    AvailablePrivateSendCoins(vCoins, GetCollateralAmounts(), fOnlyConfirmed);
 
     return !vCoins.empty();
 }
@@ -2795,6 +3414,14 @@ bool CWallet::IsCollateralAmount(CAmount nInputAmount) const
             nInputAmount %  PRIVATESEND_COLLATERAL == 0;
 }
 
+std::vector<CAmount> CWallet::GetCollateralAmounts() const
+{
+    std::vector<CAmount> vecAmounts;
+    for (CAmount nAmount = PRIVATESEND_COLLATERAL * 2; nAmount <= PRIVATESEND_COLLATERAL * 4; nAmount += PRIVATESEND_COLLATERAL)
+        vecAmounts.push_back(nAmount);
+    return vecAmounts;
+}
+
 bool CWallet::CreateCollateralTransaction(CMutableTransaction& txCollateral, std::string& strReason)
 {
     txCollateral.vin.clear();
@@ -3241,17 +3868,17 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std:
         LOCK2(cs_main, cs_wallet);
         LogPrintf("CommitTransaction:\n%s", wtxNew.ToString());
         {
-            // This is only to keep the database open to defeat the auto-flush for the
-            // duration of this scope.  This is the only place where this optimization
-            // maybe makes sense; please don't do it anywhere else.
-            CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile,"r+") : NULL;
+            // Write the spent key and the new tx in one batch, which has to
+            // be on disk before the tx is relayed
+            CWalletDBBatch batch(this, true);
+            CWalletDBScope walletdb(this);
 
             // Take key pair from key pool so it won't be used again
             reservekey.KeepKey();
 
             // Add tx to wallet, because if it has change it's also ours,
             // otherwise just for transaction history.
-            AddToWallet(wtxNew, false, pwalletdb);
+            AddToWallet(wtxNew, false, walletdb.get());
 
             // Notify that old coins are spent
             set<uint256> updated_hahes;
@@ -3265,8 +3892,6 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std:
                 NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 updated_hahes.insert(txin.prevout.hash);
             }
-            if (fFileBacked)
-                delete pwalletdb;
         }
 
         // Track how many getdata requests our transaction gets
@@ -3385,6 +4010,9 @@ bool CWallet::SetAddressBook(const CTxDestination& address, const string& strNam
         LOCK(cs_wallet); // mapAddressBook
         std::map<CTxDestination, CAddressBookData>::iterator mi = mapAddressBook.find(address);
         fUpdated = mi != mapAddressBook.end();
+        // a new entry can turn an output that was counted as change into a payment
+        if (!fUpdated && addressGroupings.Contains(address))
+            fAddressGroupingsDirty = true;
         mapAddressBook[address].name = strName;
         if (!strPurpose.empty()) /* update purpose only if requested */
             mapAddressBook[address].purpose = strPurpose;
@@ -3393,9 +4021,9 @@ bool CWallet::SetAddressBook(const CTxDestination& address, const string& strNam
                              strPurpose, (fUpdated ? CT_UPDATED : CT_NEW) );
     if (!fFileBacked)
         return false;
-    if (!strPurpose.empty() && !CWalletDB(strWalletFile).WritePurpose(CBitcoinAddress(address).ToString(), strPurpose))
+    if (!strPurpose.empty() && !CWalletDBScope(this)->WritePurpose(CBitcoinAddress(address).ToString(), strPurpose))
         return false;
-    return CWalletDB(strWalletFile).WriteName(CBitcoinAddress(address).ToString(), strName);
+    return CWalletDBScope(this)->WriteName(CBitcoinAddress(address).ToString(), strName);
 }
 
 bool CWallet::DelAddressBook(const CTxDestination& address)
@@ -3409,31 +4037,104 @@ bool CWallet::DelAddressBook(const CTxDestination& address)
             std::string strAddress = CBitcoinAddress(address).ToString();
             BOOST_FOREACH(const PAIRTYPE(string, string) &item, mapAddressBook[address].destdata)
             {
-                CWalletDB(strWalletFile).EraseDestData(strAddress, item.first);
+                CWalletDBScope(this)->EraseDestData(strAddress, item.first);
             }
         }
         mapAddressBook.erase(address);
+        if (addressGroupings.Contains(address))
+            fAddressGroupingsDirty = true;
     }
 
     NotifyAddressBookChanged(this, address, "", ::IsMine(*this, address) != ISMINE_NO, "", CT_DELETED);
 
     if (!fFileBacked)
         return false;
-    CWalletDB(strWalletFile).ErasePurpose(CBitcoinAddress(address).ToString());
-    return CWalletDB(strWalletFile).EraseName(CBitcoinAddress(address).ToString());
+    CWalletDBScope(this)->ErasePurpose(CBitcoinAddress(address).ToString());
+    return CWalletDBScope(this)->EraseName(CBitcoinAddress(address).ToString());
 }
 
 bool CWallet::SetDefaultKey(const CPubKey &vchPubKey)
 {
     if (fFileBacked)
     {
-        if (!CWalletDB(strWalletFile).WriteDefaultKey(vchPubKey))
+        if (!CWalletDBScope(this)->WriteDefaultKey(vchPubKey))
             return false;
     }
     vchDefaultKey = vchPubKey;
     return true;
 }
 
+namespace {
+
+void GenerateKeyRange(const CCryptoKeyStore* pkeystore, std::vector<CGeneratedKey>* pvecKeys, size_t nBegin, size_t nEnd, bool fCompressed, bool fCrypted, int* pnFailed)
+{
+    for (size_t i = nBegin; i < nEnd; i++) {
+        CGeneratedKey& key = (*pvecKeys)[i];
+        key.secret.MakeNewKey(fCompressed);
+        key.pubkey = key.secret.GetPubKey();
+        assert(key.secret.VerifyPubKey(key.pubkey));
+        if (fCrypted) {
+            if (!pkeystore->EncryptKey(key.secret, key.pubkey, key.vchCryptedSecret)) {
+                *pnFailed = 1;
+                return;
+            }
+            key.secret = CKey();
+        }
+    }
+}
+
+} // anon namespace
+
+bool CWallet::GenerateKeys(unsigned int nCount, bool fCompressed, std::vector<CGeneratedKey>& vecKeysRet) const
+{
+    vecKeysRet.assign(nCount, CGeneratedKey());
+    bool fCrypted = IsCrypted();
+
+    // a thread for every 64 keys at most, small top-ups stay on this thread
+    int nThreads = std::max(1, std::min<int>(std::min(GetNumCores(), MAX_KEYPOOL_THREADS), nCount / 64));
+    std::vector<int> vecFailed(nThreads, 0);
+    if (nThreads == 1) {
+        GenerateKeyRange(this, &vecKeysRet, 0, nCount, fCompressed, fCrypted, &vecFailed[0]);
+    } else {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&GenerateKeyRange, this, &vecKeysRet, (size_t)nCount * i / nThreads, (size_t)nCount * (i + 1) / nThreads, fCompressed, fCrypted, &vecFailed[i]));
+        threadGroup.join_all();
+    }
+    return std::find(vecFailed.begin(), vecFailed.end(), 1) == vecFailed.end();
+}
+
+bool CWallet::AddKeysToKeyPool(const std::vector<CGeneratedKey>& vecKeys)
+{
+    AssertLockHeld(cs_wallet);
+    if (vecKeys.empty())
+        return true;
+
+    // the wallet may have been encrypted since the keys were generated
+    if (IsCrypted() == vecKeys[0].vchCryptedSecret.empty())
+        return false;
+
+    CWalletDBBatch batch(this);
+    CWalletDBScope walletdb(this);
+
+    int64_t nBegin = setKeyPool.empty() ? 1 : *setKeyPool.rbegin() + 1;
+    int64_t nIndex = nBegin;
+    int64_t nCreationTime = GetTime();
+    BOOST_FOREACH(const CGeneratedKey& key, vecKeys)
+    {
+        mapKeyMetadata[key.pubkey.GetID()] = CKeyMetadata(nCreationTime);
+        if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
+            nTimeFirstKey = nCreationTime;
+
+        bool fAdded = key.vchCryptedSecret.empty() ? AddKeyPubKey(key.secret, key.pubkey) : AddCryptedKey(key.pubkey, key.vchCryptedSecret);
+        if (!fAdded || !walletdb->WritePool(nIndex, CKeyPool(key.pubkey)))
+            return false;
+        setKeyPool.insert(nIndex++);
+    }
+    LogPrintf("keypool added keys %d-%d, size=%u\n", nBegin, nIndex - 1, setKeyPool.size());
+    return true;
+}
+
 /**
  * Mark old keypool keys as used,
  * and generate all new keys
@@ -3442,9 +4143,12 @@ bool CWallet::NewKeyPool()
 {
     {
         LOCK(cs_wallet);
-        CWalletDB walletdb(strWalletFile);
-        BOOST_FOREACH(int64_t nIndex, setKeyPool)
-            walletdb.ErasePool(nIndex);
+        {
+            CWalletDBBatch batch(this);
+            CWalletDBScope walletdb(this);
+            BOOST_FOREACH(int64_t nIndex, setKeyPool)
+                walletdb->ErasePool(nIndex);
+        }
         setKeyPool.clear();
         fEnablePrivateSend = false;
         nKeysLeftSinceAutoBackup = 0;
@@ -3453,11 +4157,14 @@ bool CWallet::NewKeyPool()
             return false;
 
         int64_t nKeys = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t)0);
-        for (int i = 0; i < nKeys; i++)
+        bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
+        if (fCompressed)
+            SetMinVersion(FEATURE_COMPRPUBKEY);
+        for (int64_t i = 0; i < nKeys; i += KEYPOOL_BATCH_SIZE)
         {
-            int64_t nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
+            std::vector<CGeneratedKey> vecKeys;
+            if (!GenerateKeys(std::min<int64_t>(KEYPOOL_BATCH_SIZE, nKeys - i), fCompressed, vecKeys) || !AddKeysToKeyPool(vecKeys))
+                throw runtime_error("NewKeyPool(): writing generated keys failed");
         }
         LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
     }
@@ -3472,8 +4179,6 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         if (IsLocked(true))
             return false;
 
-        CWalletDB walletdb(strWalletFile);
-
         // Top up key pool
         unsigned int nTargetSize;
         if (kpSize > 0)
@@ -3481,16 +4186,17 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         else
             nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t) 0);
 
+        bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
+        if (fCompressed && setKeyPool.size() < (nTargetSize + 1))
+            SetMinVersion(FEATURE_COMPRPUBKEY);
+
+        // keys are generated in parallel and written in batches
         while (setKeyPool.size() < (nTargetSize + 1))
         {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
+            std::vector<CGeneratedKey> vecKeys;
+            if (!GenerateKeys(std::min<unsigned int>(KEYPOOL_BATCH_SIZE, nTargetSize + 1 - setKeyPool.size()), fCompressed, vecKeys) || !AddKeysToKeyPool(vecKeys))
                 throw runtime_error("TopUpKeyPool(): writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
-            double dProgress = 100.f * nEnd / (nTargetSize + 1);
+            double dProgress = 100.f * setKeyPool.size() / (nTargetSize + 1);
             std::string strMsg = strprintf(_("Loading wallet... (%3.2f %%)"), dProgress);
             uiInterface.InitMessage(strMsg);
         }
@@ -3498,6 +4204,60 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
     return true;
 }
 
+void CWallet::TopUpKeyPoolInBackground()
+{
+    {
+        LOCK(cs_wallet);
+        if (IsLocked(true) || setKeyPool.size() >= nKeyPoolLowWater)
+            return;
+    }
+
+    unsigned int nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t) 0);
+    while (true)
+    {
+        boost::this_thread::interruption_point();
+
+        unsigned int nCount;
+        bool fCompressed;
+        {
+            LOCK(cs_wallet);
+            if (IsLocked(true) || setKeyPool.size() >= (nTargetSize + 1))
+                return;
+            nCount = std::min<unsigned int>(KEYPOOL_BATCH_SIZE, nTargetSize + 1 - setKeyPool.size());
+            fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
+        }
+
+        // the slow part, the wallet stays usable meanwhile
+        std::vector<CGeneratedKey> vecKeys;
+        if (!GenerateKeys(nCount, fCompressed, vecKeys))
+            return;
+
+        LOCK(cs_wallet);
+        if (fCompressed)
+            SetMinVersion(FEATURE_COMPRPUBKEY);
+        if (!AddKeysToKeyPool(vecKeys)) {
+            LogPrintf("CWallet::TopUpKeyPoolInBackground -- adding generated keys failed\n");
+            return;
+        }
+    }
+}
+
+void ThreadTopUpKeyPool(CWallet* pwallet)
+{
+    RenameThread("onex-keypool");
+
+    {
+        LOCK(pwallet->cs_wallet);
+        pwallet->nKeyPoolLowWater = GetArg("-keypoollowwater", DEFAULT_KEYPOOL_LOW_WATER);
+    }
+
+    while (true)
+    {
+        MilliSleep(1000);
+        pwallet->TopUpKeyPoolInBackground();
+    }
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -3505,18 +4265,19 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
     {
         LOCK(cs_wallet);
 
-        if (!IsLocked(true))
+        // with a background top-up only an empty pool is refilled here
+        if (!IsLocked(true) && (nKeyPoolLowWater == 0 || setKeyPool.empty()))
             TopUpKeyPool();
 
         // Get the oldest key
         if(setKeyPool.empty())
             return;
 
-        CWalletDB walletdb(strWalletFile);
+        CWalletDBScope walletdb(this);
 
         nIndex = *(setKeyPool.begin());
         setKeyPool.erase(setKeyPool.begin());
-        if (!walletdb.ReadPool(nIndex, keypool))
+        if (!walletdb->ReadPool(nIndex, keypool))
             throw runtime_error("ReserveKeyFromKeyPool(): read failed");
         if (!HaveKey(keypool.vchPubKey.GetID()))
             throw runtime_error("ReserveKeyFromKeyPool(): unknown key in key pool");
@@ -3530,8 +4291,7 @@ void CWallet::KeepKey(int64_t nIndex)
     // Remove from key pool
     if (fFileBacked)
     {
-        CWalletDB walletdb(strWalletFile);
-        walletdb.ErasePool(nIndex);
+        CWalletDBScope(this)->ErasePool(nIndex);
         nKeysLeftSinceAutoBackup = nWalletBackups ? nKeysLeftSinceAutoBackup - 1 : 0;
     }
     LogPrintf("keypool keep %d\n", nIndex);
@@ -3579,135 +4339,174 @@ int64_t CWallet::GetOldestKeyPoolTime()
 
 std::map<CTxDestination, CAmount> CWallet::GetAddressBalances()
 {
+    // Only the first lookups right after startup see IBD, don't take cs_main otherwise
+    bool fInitialDownload = IsInitialBlockDownload();
+    unsigned int nMempoolUpdated = mempool.GetTransactionsUpdated();
+    {
+        LOCK(cs_wallet);
+        if (fAddressBalancesCached && !fInitialDownload && nAddressBalancesMempoolUpdated == nMempoolUpdated)
+            return mapAddressBalancesCached;
+    }
+
     map<CTxDestination, CAmount> balances;
 
     {
-        LOCK(cs_wallet);
-        BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
-        {
-            CWalletTx *pcoin = &walletEntry.second;
+        LOCK2(cs_main, cs_wallet);
+        nMempoolUpdated = mempool.GetTransactionsUpdated();
 
-            if (!CheckFinalTx(*pcoin) || !pcoin->IsTrusted())
-                continue;
+        // Only unspent outputs add to a balance
+        if (fUnspentCoinsDirty)
+            RebuildUnspentCoins();
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+        const CWalletTx* pcoin = NULL;
+        bool fAvailable = false;
+        for (map<COutPoint, isminetype>::const_iterator it = mapUnspentCoins.begin(); it != mapUnspentCoins.end(); ++it)
+        {
+            const COutPoint& outpoint = it->first;
+            if (!pcoin || pcoin->GetHash() != outpoint.hash) {
+                // outputs are ordered by tx, check each tx once
+                pcoin = &mapWallet[outpoint.hash];
+                fAvailable = CheckFinalTx(*pcoin) && pcoin->IsTrusted() &&
+                             !(pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0) &&
+                             pcoin->GetDepthInMainChain() >= (pcoin->IsFromMe(ISMINE_ALL) ? 0 : 1);
+            }
+            if (!fAvailable)
                 continue;
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? 0 : 1))
+            CTxDestination addr;
+            if(!ExtractDestination(pcoin->vout[outpoint.n].scriptPubKey, addr))
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-            {
-                CTxDestination addr;
-                if (!IsMine(pcoin->vout[i]))
-                    continue;
-                if(!ExtractDestination(pcoin->vout[i].scriptPubKey, addr))
-                    continue;
-
-                CAmount n = IsSpent(walletEntry.first, i) ? 0 : pcoin->vout[i].nValue;
-
-                if (!balances.count(addr))
-                    balances[addr] = 0;
-                balances[addr] += n;
-            }
+            if (!IsSpent(outpoint.hash, outpoint.n))
+                balances[addr] += pcoin->vout[outpoint.n].nValue;
         }
+
+        mapAddressBalancesCached = balances;
+        fAddressBalancesCached = true;
+        nAddressBalancesMempoolUpdated = nMempoolUpdated;
     }
 
     return balances;
 }
 
-set< set<CTxDestination> > CWallet::GetAddressGroupings()
+void CAddressGroupings::Clear()
 {
-    AssertLockHeld(cs_wallet); // mapWallet
-    set< set<CTxDestination> > groupings;
-    set<CTxDestination> grouping;
+    mapIndex.clear();
+    vecAddresses.clear();
+    vecParent.clear();
+    vecSize.clear();
+}
 
-    BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
-    {
-        CWalletTx *pcoin = &walletEntry.second;
+uint32_t CAddressGroupings::Add(const CTxDestination& address)
+{
+    std::pair<std::map<CTxDestination, uint32_t>::iterator, bool> ret = mapIndex.insert(std::make_pair(address, (uint32_t)vecAddresses.size()));
+    if (ret.second) {
+        vecAddresses.push_back(address);
+        vecParent.push_back(ret.first->second);
+        vecSize.push_back(1);
+    }
+    return ret.first->second;
+}
 
-        if (pcoin->vin.size() > 0)
-        {
-            bool any_mine = false;
-            // group all input addresses with each other
-            BOOST_FOREACH(CTxIn txin, pcoin->vin)
-            {
-                CTxDestination address;
-                if(!IsMine(txin)) /* If this input isn't mine, ignore it */
-                    continue;
-                if(!ExtractDestination(mapWallet[txin.prevout.hash].vout[txin.prevout.n].scriptPubKey, address))
-                    continue;
-                grouping.insert(address);
-                any_mine = true;
-            }
+uint32_t CAddressGroupings::Find(uint32_t n)
+{
+    while (vecParent[n] != n) {
+        vecParent[n] = vecParent[vecParent[n]];
+        n = vecParent[n];
+    }
+    return n;
+}
 
-            // group change with input addresses
-            if (any_mine)
-            {
-               BOOST_FOREACH(CTxOut txout, pcoin->vout)
-                   if (IsChange(txout))
-                   {
-                       CTxDestination txoutAddr;
-                       if(!ExtractDestination(txout.scriptPubKey, txoutAddr))
-                           continue;
-                       grouping.insert(txoutAddr);
-                   }
-            }
-            if (grouping.size() > 0)
-            {
-                groupings.insert(grouping);
-                grouping.clear();
-            }
-        }
+void CAddressGroupings::Group(const std::vector<CTxDestination>& vecGroup)
+{
+    if (vecGroup.empty())
+        return;
+    uint32_t nRoot = Find(Add(vecGroup[0]));
+    for (size_t i = 1; i < vecGroup.size(); i++) {
+        uint32_t nOther = Find(Add(vecGroup[i]));
+        if (nOther == nRoot)
+            continue;
+        if (vecSize[nOther] > vecSize[nRoot])
+            std::swap(nOther, nRoot);
+        vecParent[nOther] = nRoot;
+        vecSize[nRoot] += vecSize[nOther];
+    }
+}
 
-        // group lone addrs by themselves
-        for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-            if (IsMine(pcoin->vout[i]))
-            {
-                CTxDestination address;
-                if(!ExtractDestination(pcoin->vout[i].scriptPubKey, address))
-                    continue;
-                grouping.insert(address);
-                groupings.insert(grouping);
-                grouping.clear();
-            }
+std::set< std::set<CTxDestination> > CAddressGroupings::GetGroupings()
+{
+    std::map<uint32_t, std::set<CTxDestination> > mapGroups;
+    for (uint32_t n = 0; n < vecAddresses.size(); n++)
+        mapGroups[Find(n)].insert(vecAddresses[n]);
+
+    std::set< std::set<CTxDestination> > ret;
+    for (std::map<uint32_t, std::set<CTxDestination> >::const_iterator it = mapGroups.begin(); it != mapGroups.end(); ++it)
+        ret.insert(it->second);
+    return ret;
+}
+
+void CWallet::AddToAddressGroupings(const CWalletTx& wtx)
+{
+    AssertLockHeld(cs_wallet);
+
+    // will be rebuilt from scratch anyway
+    if (fAddressGroupingsDirty)
+        return;
+
+    // wallet txs spending this one were grouped without their inputs being ours
+    TxSpends::const_iterator it = mapTxSpends.lower_bound(COutPoint(wtx.GetHash(), 0));
+    if (it != mapTxSpends.end() && it->first.hash == wtx.GetHash()) {
+        fAddressGroupingsDirty = true;
+        return;
     }
 
-    set< set<CTxDestination>* > uniqueGroupings; // a set of pointers to groups of addresses
-    map< CTxDestination, set<CTxDestination>* > setmap;  // map addresses to the unique group containing it
-    BOOST_FOREACH(set<CTxDestination> grouping, groupings)
-    {
-        // make a set of all the groups hit by this new group
-        set< set<CTxDestination>* > hits;
-        map< CTxDestination, set<CTxDestination>* >::iterator it;
-        BOOST_FOREACH(CTxDestination address, grouping)
-            if ((it = setmap.find(address)) != setmap.end())
-                hits.insert((*it).second);
+    GroupAddresses(wtx);
+}
 
-        // merge all hit groups into a new single group and delete old groups
-        set<CTxDestination>* merged = new set<CTxDestination>(grouping);
-        BOOST_FOREACH(set<CTxDestination>* hit, hits)
-        {
-            merged->insert(hit->begin(), hit->end());
-            uniqueGroupings.erase(hit);
-            delete hit;
-        }
-        uniqueGroupings.insert(merged);
+void CWallet::GroupAddresses(const CWalletTx& wtx)
+{
+    std::vector<CTxDestination> vecGroup;
+    CTxDestination address;
 
-        // update setmap
-        BOOST_FOREACH(CTxDestination element, *merged)
-            setmap[element] = merged;
+    // group all input addresses with each other
+    BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+    {
+        if(!IsMine(txin)) /* If this input isn't mine, ignore it */
+            continue;
+        if(!ExtractDestination(mapWallet[txin.prevout.hash].vout[txin.prevout.n].scriptPubKey, address))
+            continue;
+        vecGroup.push_back(address);
     }
 
-    set< set<CTxDestination> > ret;
-    BOOST_FOREACH(set<CTxDestination>* uniqueGrouping, uniqueGroupings)
+    // group change with input addresses
+    if (!vecGroup.empty())
     {
-        ret.insert(*uniqueGrouping);
-        delete uniqueGrouping;
+        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+            if (IsChange(txout) && ExtractDestination(txout.scriptPubKey, address))
+                vecGroup.push_back(address);
+        addressGroupings.Group(vecGroup);
     }
 
-    return ret;
+    // group lone addrs by themselves
+    BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+        if (IsMine(txout) && ExtractDestination(txout.scriptPubKey, address))
+            addressGroupings.Group(std::vector<CTxDestination>(1, address));
+}
+
+set< set<CTxDestination> > CWallet::GetAddressGroupings()
+{
+    AssertLockHeld(cs_wallet); // mapWallet
+
+    if (fAddressGroupingsDirty) {
+        int64_t nTimeStart = GetTimeMillis();
+        addressGroupings.Clear();
+        fAddressGroupingsDirty = false;
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            GroupAddresses(it->second);
+        LogPrint("bench", "CWallet::GetAddressGroupings -- rebuilt from %u txes, %dms\n", mapWallet.size(), GetTimeMillis() - nTimeStart);
+    }
+
+    return addressGroupings.GetGroupings();
 }
 
 std::set<CTxDestination> CWallet::GetAccountAddresses(const std::string& strAccount) const
@@ -3780,10 +4579,14 @@ void CWallet::GetAllReserveKeys(set<CKeyID>& setAddress) const
 bool CWallet::UpdatedTransaction(const uint256 &hashTx)
 {
     {
-        LOCK(cs_wallet);
+        // callers hold cs_main
+        LOCK2(cs_main, cs_wallet);
         // Only notify UI if this transaction is in this wallet
         map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
         if (mi != mapWallet.end()){
+            // e.g. an InstantSend lock, which changes the depth of the tx
+            UpdateBalances(hashTx);
+            fAddressBalancesCached = false;
             NotifyTransactionChanged(this, hashTx, CT_UPDATED);
             return true;
         }
@@ -3811,6 +4614,7 @@ void CWallet::LockCoin(COutPoint& output)
 
     fAnonymizableTallyCached = false;
     fAnonymizableTallyCachedNonDenom = false;
+    fAddressBalancesCached = false;
 }
 
 void CWallet::UnlockCoin(COutPoint& output)
@@ -3822,6 +4626,7 @@ void CWallet::UnlockCoin(COutPoint& output)
 
     fAnonymizableTallyCached = false;
     fAnonymizableTallyCachedNonDenom = false;
+    fAddressBalancesCached = false;
 }
 
 void CWallet::UnlockAllCoins()
@@ -3942,7 +4747,7 @@ bool CWallet::AddDestData(const CTxDestination &dest, const std::string &key, co
     mapAddressBook[dest].destdata.insert(std::make_pair(key, value));
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteDestData(CBitcoinAddress(dest).ToString(), key, value);
+    return CWalletDBScope(this)->WriteDestData(CBitcoinAddress(dest).ToString(), key, value);
 }
 
 bool CWallet::EraseDestData(const CTxDestination &dest, const std::string &key)
@@ -3951,7 +4756,7 @@ bool CWallet::EraseDestData(const CTxDestination &dest, const std::string &key)
         return false;
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).EraseDestData(CBitcoinAddress(dest).ToString(), key);
+    return CWalletDBScope(this)->EraseDestData(CBitcoinAddress(dest).ToString(), key);
 }
 
 bool CWallet::LoadDestData(const CTxDestination &dest, const std::string &key, const std::string &value)
@@ -9,6 +9,8 @@
 
 #include "amount.h"
 #include "base58.h"
+#include "cachemap.h"
+#include "coins.h"
 #include "streams.h"
 #include "tinyformat.h"
 #include "ui_interface.h"
@@ -43,6 +45,20 @@ extern bool fLargeWorkForkFound;
 extern bool fLargeWorkInvalidChainFound;
 
 static const unsigned int DEFAULT_KEYPOOL_SIZE = 1000;
+//! -keypoollowwater default, 0 tops up the key pool on demand only
+static const unsigned int DEFAULT_KEYPOOL_LOW_WATER = 0;
+//! Number of key pool keys generated and written at a time
+static const unsigned int KEYPOOL_BATCH_SIZE = 1000;
+//! Maximum number of threads generating key pool keys
+static const int MAX_KEYPOOL_THREADS = 8;
+//! Maximum number of outpoints kept in the PrivateSend rounds cache
+static const unsigned int PRIVATESEND_ROUNDS_CACHE_SIZE = 200000;
+//! Maximum number of threads reading and matching blocks during a rescan
+static const int MAX_RESCAN_THREADS = 8;
+//! Number of blocks a rescan may read ahead of the block being added to the wallet
+static const unsigned int RESCAN_PREFETCH_BLOCKS = 64;
+//! Number of blocks a rescan takes from the active chain at a time
+static const unsigned int RESCAN_BATCH_BLOCKS = 2000;
 //! -paytxfee default
 static const CAmount DEFAULT_TRANSACTION_FEE = 0;
 //! -paytxfee will warn if called with a higher fee than this amount (in satoshis) per KB
@@ -78,6 +94,7 @@ class COutput;
 class CReserveKey;
 class CScript;
 class CTxMemPool;
+class CWalletRescanReserver;
 class CWalletTx;
 
 /** (client) version numbers for particular wallet features */
@@ -112,6 +129,114 @@ struct CompactTallyItem
     }
 };
 
+/** Wallet balances by category, all computed in one pass over the wallet */
+struct CWalletBalance
+{
+    CAmount nTrusted;
+    CAmount nUnconfirmed;
+    CAmount nImmature;
+    CAmount nWatchOnlyTrusted;
+    CAmount nWatchOnlyUnconfirmed;
+    CAmount nWatchOnlyImmature;
+    CAmount nAnonymized;
+    CAmount nDenominatedConfirmed;
+    CAmount nDenominatedUnconfirmed;
+
+    CWalletBalance()
+        : nTrusted(0),
+          nUnconfirmed(0),
+          nImmature(0),
+          nWatchOnlyTrusted(0),
+          nWatchOnlyUnconfirmed(0),
+          nWatchOnlyImmature(0),
+          nAnonymized(0),
+          nDenominatedConfirmed(0),
+          nDenominatedUnconfirmed(0)
+    {}
+
+    CWalletBalance& operator+=(const CWalletBalance& b)
+    {
+        nTrusted += b.nTrusted;
+        nUnconfirmed += b.nUnconfirmed;
+        nImmature += b.nImmature;
+        nWatchOnlyTrusted += b.nWatchOnlyTrusted;
+        nWatchOnlyUnconfirmed += b.nWatchOnlyUnconfirmed;
+        nWatchOnlyImmature += b.nWatchOnlyImmature;
+        nAnonymized += b.nAnonymized;
+        nDenominatedConfirmed += b.nDenominatedConfirmed;
+        nDenominatedUnconfirmed += b.nDenominatedUnconfirmed;
+        return *this;
+    }
+
+    CWalletBalance& operator-=(const CWalletBalance& b)
+    {
+        nTrusted -= b.nTrusted;
+        nUnconfirmed -= b.nUnconfirmed;
+        nImmature -= b.nImmature;
+        nWatchOnlyTrusted -= b.nWatchOnlyTrusted;
+        nWatchOnlyUnconfirmed -= b.nWatchOnlyUnconfirmed;
+        nWatchOnlyImmature -= b.nWatchOnlyImmature;
+        nAnonymized -= b.nAnonymized;
+        nDenominatedConfirmed -= b.nDenominatedConfirmed;
+        nDenominatedUnconfirmed -= b.nDenominatedUnconfirmed;
+        return *this;
+    }
+};
+
+/** State of the running or the last finished rescan */
+struct CRescanProgress
+{
+    bool fScanning;
+    int nStartHeight;
+    int nHeight;
+    int nTipHeight;
+    int64_t nStartTime;
+    int64_t nEndTime;
+    int nFound;
+
+    CRescanProgress()
+        : fScanning(false),
+          nStartHeight(-1),
+          nHeight(-1),
+          nTipHeight(-1),
+          nStartTime(0),
+          nEndTime(0),
+          nFound(0)
+    {}
+};
+
+/**
+ * Disjoint sets of addresses, used for the address groupings of the wallet.
+ * Addresses are numbered in the order they are added; sets are joined by
+ * size, and lookups halve the path to the root.
+ */
+class CAddressGroupings
+{
+private:
+    std::map<CTxDestination, uint32_t> mapIndex;
+    std::vector<CTxDestination> vecAddresses;
+    std::vector<uint32_t> vecParent;
+    std::vector<uint32_t> vecSize;
+
+    uint32_t Add(const CTxDestination& address);
+    uint32_t Find(uint32_t n);
+
+public:
+    void Clear();
+    bool Contains(const CTxDestination& address) const { return mapIndex.count(address) > 0; }
+    /** Add the addresses, all of them end up in the same set */
+    void Group(const std::vector<CTxDestination>& vecGroup);
+    std::set< std::set<CTxDestination> > GetGroupings();
+};
+
+/** A new key, encrypted ahead of being added if the wallet is crypted (the secret is then dropped) */
+struct CGeneratedKey
+{
+    CKey secret;
+    CPubKey pubkey;
+    std::vector<unsigned char> vchCryptedSecret;
+};
+
 /** A key pool entry */
 class CKeyPool
 {
@@ -524,6 +649,20 @@ private:
 
     CWalletDB *pwalletdbEncryption;
 
+    /**
+     * Handle of the open write batch, see CWalletDBBatch. Created on the
+     * first write and protected by cs_wallet, which every batch holds.
+     */
+    CWalletDB *pwalletdbBatch;
+    int nWalletDBBatchDepth;
+    bool fWalletDBBatchFlush;
+    friend class CWalletDBBatch;
+
+    /** Generate nCount keys on worker threads, needs no wallet lock */
+    bool GenerateKeys(unsigned int nCount, bool fCompressed, std::vector<CGeneratedKey>& vecKeysRet) const;
+    /** Add generated keys to the wallet and the key pool in one database batch */
+    bool AddKeysToKeyPool(const std::vector<CGeneratedKey>& vecKeys);
+
     //! the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -539,6 +678,93 @@ private:
     mutable bool fAnonymizableTallyCachedNonDenom;
     mutable std::vector<CompactTallyItem> vecAnonymizableTallyCachedNonDenom;
 
+    /**
+     * PrivateSend rounds of wallet outpoints, see GetRealInputPrivateSendRounds.
+     * Protected by cs_wallet. Rounds of an outpoint only depend on its
+     * ancestors, so entries stay valid unless an ancestor shows up late.
+     */
+    mutable CacheMap<COutPoint, int, uint32_t, COutPointKeyHasher> mapOutpointRoundsCache;
+
+    /// Rounds of output nOut of wtx given the rounds of the tx inputs, -10 if they are needed but unknown
+    int GetOutputPrivateSendRounds(const CWalletTx& wtx, unsigned int nOut, int nTxRounds) const;
+    /// Drop cached rounds when a tx arrives after wallet txes spending it
+    void InvalidatePrivateSendRounds(const uint256& hash);
+
+    /**
+     * Outputs of the wallet which are ours and not known to be spent, with their
+     * ownership, and the ones with denominated or collateral amounts by amount.
+     * Used by AvailableCoins and PrivateSend coin selection instead of scanning
+     * mapWallet, callers still check depth, spent and locked status.
+     * mapPrivateSendCoins is bucketed by amount only. Callers filter a bucket by
+     * rounds and address themselves, rounds come from mapOutpointRoundsCache,
+     * which InvalidatePrivateSendRounds can clear when an earlier tx arrives late.
+     * Protected by cs_wallet.
+     */
+    mutable std::map<COutPoint, isminetype> mapUnspentCoins;
+    mutable std::map<CAmount, std::set<COutPoint> > mapPrivateSendCoins;
+    //! Rebuild mapUnspentCoins and mapPrivateSendCoins from mapWallet before their next use
+    mutable bool fUnspentCoinsDirty;
+
+    /**
+     * Address groupings of all wallet txs, extended as txs are added.
+     * A new tx can make inputs of earlier txs ours and address book changes
+     * decide what counts as change; both set fAddressGroupingsDirty to
+     * rebuild from mapWallet on the next use. Protected by cs_wallet.
+     */
+    CAddressGroupings addressGroupings;
+    bool fAddressGroupingsDirty;
+    void AddToAddressGroupings(const CWalletTx& wtx);
+    void GroupAddresses(const CWalletTx& wtx);
+
+    /** Per address balances as of the last change, kept like balanceCached */
+    mutable std::map<CTxDestination, CAmount> mapAddressBalancesCached;
+    mutable bool fAddressBalancesCached;
+    mutable unsigned int nAddressBalancesMempoolUpdated;
+
+    bool IsPrivateSendAmount(CAmount nAmount) const { return IsDenominatedAmount(nAmount) || IsCollateralAmount(nAmount); }
+    /// Add the outputs of a new wallet tx and remove the outputs it spends
+    void UpdateUnspentCoins(const CWalletTx& wtx);
+    void RebuildUnspentCoins() const;
+    /// Checks shared by AvailableCoins and AvailablePrivateSendCoins for the tx of a coin
+    bool IsAvailableTx(const CWalletTx* pcoin, bool fOnlyConfirmed, bool fUseInstantSend, int& nDepthRet) const;
+    /// Amounts accepted as PrivateSend collateral, see IsCollateralAmount
+    std::vector<CAmount> GetCollateralAmounts() const;
+
+    /**
+     * Balances kept up to date by the wallet and chain hooks, protected by
+     * cs_wallet so reads don't need cs_main. mapTxBalances holds the share of
+     * every wallet tx and balanceCached their sum; a hook which changes a tx
+     * replaces its share and the shares of the wallet txs it spends or is
+     * spent by. Shares which a new tip alone can change (unconfirmed and
+     * immature txs) are in setBalanceVolatile. Without fBalanceCached the next
+     * read recomputes everything.
+     */
+    mutable CWalletBalance balanceCached;
+    mutable bool fBalanceCached;
+    mutable std::map<uint256, CWalletBalance> mapTxBalances;
+    mutable std::set<uint256> setBalanceVolatile;
+    mutable const CBlockIndex* pindexBalanceTip;
+    mutable int nBalancePrivateSendRounds;
+    /// Balance share of a single tx, fVolatileRet is set if a new tip can change it
+    CWalletBalance GetTxBalance(const CWalletTx& wtx, bool& fVolatileRet) const;
+    void UpdateTxBalance(const uint256& hashTx) const;
+    void RecomputeBalances() const;
+    /// Bring the balances to the current tip, cs_main and cs_wallet held
+    void UpdateBalancesForTip() const;
+    /**
+     * Txs removed from the mempool since the balances last took them into
+     * account. Filled by TransactionRemovedFromMempool, which runs with the
+     * mempool lock held and so cannot take cs_wallet, and drained by
+     * UpdateBalancesForMempool.
+     */
+    mutable CCriticalSection cs_mempoolRemoved;
+    mutable std::set<uint256> setMempoolRemoved;
+    bool HaveMempoolRemoved() const;
+    /// Recompute the shares of wallet txs which left the mempool, cs_main and cs_wallet held
+    void UpdateBalancesForMempool() const;
+    /// Apply a changed tx to the balances, cs_main and cs_wallet held
+    void UpdateBalances(const uint256& hashTx);
+
     /**
      * Used to keep track of spent outpoints, and
      * detect and report conflicts (double-spends or
@@ -554,6 +780,16 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /* Whether a tx which pays none of our scripts can still be relevant: it is known, spends from us or conflicts with one of our spends. */
+    bool IsSpendRelevant(const CTransaction& tx) const;
+
+    /** Rescan progress, protected by cs_rescan rather than cs_wallet so it can be read while a rescan holds the wallet */
+    mutable CCriticalSection cs_rescan;
+    CRescanProgress rescanProgress;
+    /** Set while a CWalletRescanReserver holds the rescan, protected by cs_rescan */
+    bool fScanningWallet;
+    friend class CWalletRescanReserver;
+
 public:
     /*
      * Main wallet lock.
@@ -600,6 +836,11 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        pwalletdbBatch = NULL;
+        nWalletDBBatchDepth = 0;
+        fWalletDBBatchFlush = false;
+        fScanningWallet = false;
+        nKeyPoolLowWater = 0;
         nOrderPosNext = 0;
         nNextResend = 0;
         nLastResend = 0;
@@ -609,6 +850,21 @@ public:
         fAnonymizableTallyCachedNonDenom = false;
         vecAnonymizableTallyCached.clear();
         vecAnonymizableTallyCachedNonDenom.clear();
+        mapOutpointRoundsCache.Clear();
+        mapOutpointRoundsCache.SetMaxSize(PRIVATESEND_ROUNDS_CACHE_SIZE);
+        mapUnspentCoins.clear();
+        mapPrivateSendCoins.clear();
+        fUnspentCoinsDirty = true;
+        addressGroupings.Clear();
+        fAddressGroupingsDirty = true;
+        mapAddressBalancesCached.clear();
+        fAddressBalancesCached = false;
+        nAddressBalancesMempoolUpdated = 0;
+        fBalanceCached = false;
+        mapTxBalances.clear();
+        setBalanceVolatile.clear();
+        pindexBalanceTip = NULL;
+        nBalancePrivateSendRounds = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -630,6 +886,9 @@ public:
     int64_t nTimeFirstKey;
     int64_t nKeysLeftSinceAutoBackup;
 
+    //! Key pool size below which ThreadTopUpKeyPool refills it, 0 while it is not running
+    unsigned int nKeyPoolLowWater;
+
     const CWalletTx* GetWalletTx(const uint256& hash) const;
 
     //! check whether we are allowed to upgrade (or already support) to the named feature
@@ -639,6 +898,11 @@ public:
      * populate vCoins with vector of available COutputs.
      */
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl = NULL, bool fIncludeZeroValue=false, AvailableCoinsType nCoinType=ALL_COINS, bool fUseInstantSend = false) const;
+    /**
+     * populate vCoins with available COutputs which have one of the given
+     * (denominated or collateral) amounts, without scanning the whole wallet
+     */
+    void AvailablePrivateSendCoins(std::vector<COutput>& vCoins, const std::vector<CAmount>& vecAmounts, bool fOnlyConfirmed=true) const;
 
     /**
      * Shuffle and select coins until nTargetValue is reached while avoiding
@@ -663,7 +927,7 @@ public:
     int  CountInputsWithAmount(CAmount nInputAmount);
 
     // get the PrivateSend chain depth for a given input
-    int GetRealInputPrivateSendRounds(CTxIn txin, int nRounds) const;
+    int GetRealInputPrivateSendRounds(const CTxIn& txin) const;
     // respect current settings
     int GetInputPrivateSendRounds(CTxIn txin) const;
 
@@ -729,11 +993,17 @@ public:
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+    void TransactionRemovedFromMempool(const CTransaction& tx);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
+    /** Returns the number of txs found, -1 if another rescan is running */
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, const CWalletRescanReserver& reserver);
+    CRescanProgress GetRescanProgress() const;
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(int64_t nBestBlockTime);
     std::vector<uint256> ResendWalletTransactionsBefore(int64_t nTime);
+    /// All balances at once, kept up to date as the wallet and the chain change
+    CWalletBalance GetBalances() const;
     CAmount GetBalance() const;
     CAmount GetUnconfirmedBalance() const;
     CAmount GetImmatureBalance() const;
@@ -785,6 +1055,8 @@ public:
 
     bool NewKeyPool();
     bool TopUpKeyPool(unsigned int kpSize = 0);
+    /** Refill the key pool once below nKeyPoolLowWater, generating keys without holding cs_wallet */
+    void TopUpKeyPoolInBackground();
     void ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool);
     void KeepKey(int64_t nIndex);
     void ReturnKey(int64_t nIndex);
@@ -810,6 +1082,7 @@ public:
     CAmount GetCredit(const CTransaction& tx, const isminefilter& filter) const;
     CAmount GetChange(const CTransaction& tx) const;
     void SetBestChain(const CBlockLocator& loc);
+    void UpdatedBlockTip(const CBlockIndex *pindex);
 
     DBErrors LoadWallet(bool& fFirstRunRet);
     DBErrors ZapWalletTx(std::vector<CWalletTx>& vWtx);
@@ -892,6 +1165,80 @@ public:
 
     /* Mark a transaction (and it in-wallet descendants) as abandoned so its inputs may be respent. */
     bool AbandonTransaction(const uint256& hashTx);
+
+    /** Handle of the write batch open on this thread, NULL if there is none */
+    CWalletDB* GetBatchDB();
+};
+
+void ThreadTopUpKeyPool(CWallet* pwallet);
+
+/**
+ * Groups the wallet database writes made while it is in scope into one
+ * database transaction. By default the transaction is committed without a
+ * checkpoint, ThreadFlushWalletDB flushes the log once the wallet has been
+ * idle (or the batch flushes on close with -flushwallet=0). Writes which
+ * must be on disk when the operation returns pass fFlushOnCommit. Holds
+ * cs_wallet for as long as it is open, take cs_main before it where needed.
+ * Batches nest, the outermost one commits and flushes if any of them asked to.
+ *
+ * While a batch is open, database access on its thread must go through
+ * CWalletDBScope: a separate handle would wait for the locks of the batch
+ * transaction. Backups wait for the batch to close as it keeps the file in
+ * use, encryption uses a transaction of its own and must not run in a batch.
+ */
+class CWalletDBBatch
+{
+private:
+    CWallet* pwallet;
+    CCriticalBlock lockWallet;
+
+    CWalletDBBatch(const CWalletDBBatch&);
+    void operator=(const CWalletDBBatch&);
+
+public:
+    explicit CWalletDBBatch(CWallet* pwalletIn, bool fFlushOnCommit = false);
+    ~CWalletDBBatch();
+};
+
+/** Database handle for one wallet operation: the open write batch if any, a handle of its own otherwise */
+class CWalletDBScope
+{
+private:
+    CWalletDB* pwalletdbOwn;
+    CWalletDB* pwalletdb;
+
+    CWalletDBScope(const CWalletDBScope&);
+    void operator=(const CWalletDBScope&);
+
+public:
+    explicit CWalletDBScope(CWallet* pwallet, bool fFlushOnClose = true);
+    ~CWalletDBScope() { delete pwalletdbOwn; }
+
+    CWalletDB* get() const { return pwalletdb; }
+    CWalletDB* operator->() const { return pwalletdb; }
+};
+
+/**
+ * Reserves the rescan of a wallet, only one runs at a time. Callers which
+ * have work to do before the rescan take the reservation first and pass it
+ * to ScanForWalletTransactions, which reserves on its own otherwise.
+ */
+class CWalletRescanReserver
+{
+private:
+    CWallet* pwallet;
+    bool fReserved;
+
+    CWalletRescanReserver(const CWalletRescanReserver&);
+    void operator=(const CWalletRescanReserver&);
+
+public:
+    explicit CWalletRescanReserver(CWallet* pwalletIn) : pwallet(pwalletIn), fReserved(false) {}
+    ~CWalletRescanReserver();
+
+    /** False if another rescan is running */
+    bool Reserve();
+    bool IsReserved() const { return fReserved; }
 };
 
 /** A key allocated from the key pool. */